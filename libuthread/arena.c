@@ -0,0 +1,128 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+/* Memory objects are carved from, preceded by its header */
+struct arena_chunk {
+  arena_chunk_t* next; // next chunk of the arena, or of the cache
+  size_t size; // bytes available after the header
+  max_align_t data[]; // objects
+};
+
+/* Free chunks of ARENA_CHUNK_SIZE, shared by every arena */
+static arena_chunk_t* cache = NULL;
+static int cache_count = 0;
+
+/* Returns a free chunk of ARENA_CHUNK_SIZE, NULL if it cannot be allocated */
+static arena_chunk_t* chunk_get(void)
+{
+  arena_chunk_t* chunk = cache;
+  if (chunk != NULL) {
+    cache = chunk->next;
+    cache_count--;
+    return chunk;
+  }
+  chunk = malloc(sizeof(arena_chunk_t) + ARENA_CHUNK_SIZE);
+  if (chunk != NULL)
+    chunk->size = ARENA_CHUNK_SIZE;
+
+  return chunk;
+}
+
+/* Gives a chunk back to the cache, or to malloc() if it is full or the chunk
+   was allocated for a single large object */
+static void chunk_put(arena_chunk_t* chunk)
+{
+  if (chunk->size != ARENA_CHUNK_SIZE || cache_count >= ARENA_CACHE_CHUNKS) {
+    free(chunk);
+    return;
+  }
+  chunk->next = cache;
+  cache = chunk;
+  cache_count++;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+  void* ptr = arena_bump(arena, size);
+  if (ptr != NULL)
+    return ptr;
+  if (size > SIZE_MAX - ARENA_CHUNK_SIZE)
+    return NULL; // its chunk size would overflow
+  // rounded up so that the next object stays aligned, 0 gets a unique address
+  size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+  if (size == 0)
+    size = ARENA_ALIGN;
+
+  /* Objects larger than a quarter of a chunk get their own, kept behind the
+     chunk being filled which may still have room for smaller ones */
+  if (size > ARENA_CHUNK_SIZE / 4) {
+    arena_chunk_t* chunk = malloc(sizeof(arena_chunk_t) + size);
+    if (chunk == NULL)
+      return NULL;
+    chunk->size = size;
+    if (arena->chunks != NULL) {
+      chunk->next = arena->chunks->next;
+      arena->chunks->next = chunk;
+    } else {
+      chunk->next = NULL;
+      arena->chunks = chunk; // full already, next and end stay NULL
+    }
+    return chunk->data;
+  }
+
+  /* The chunk being filled is full, start a new one */
+  arena_chunk_t* chunk = chunk_get();
+  if (chunk == NULL)
+    return NULL;
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  arena->next = (char*)chunk->data + size;
+  arena->end = (char*)chunk->data + chunk->size;
+
+  return chunk->data;
+}
+
+void arena_reset(arena_t *arena)
+{
+  arena_chunk_t* keep = arena->chunks;
+  if (keep != NULL && keep->size != ARENA_CHUNK_SIZE)
+    keep = NULL; // not worth keeping for small objects
+  arena_chunk_t* chunk = (keep != NULL) ? keep->next : arena->chunks;
+  while (chunk != NULL) {
+    arena_chunk_t* next = chunk->next;
+    chunk_put(chunk);
+    chunk = next;
+  }
+  arena->chunks = keep;
+  if (keep != NULL) {
+    keep->next = NULL;
+    arena->next = (char*)keep->data;
+    arena->end = (char*)keep->data + keep->size;
+  } else {
+    arena->next = arena->end = NULL;
+  }
+}
+
+void arena_release(arena_t *arena)
+{
+  arena_chunk_t* chunk = arena->chunks;
+  while (chunk != NULL) {
+    arena_chunk_t* next = chunk->next;
+    chunk_put(chunk);
+    chunk = next;
+  }
+  arena->chunks = NULL;
+  arena->next = arena->end = NULL;
+}
+
+void arena_trim(void)
+{
+  while (cache != NULL) {
+    arena_chunk_t* next = cache->next;
+    free(cache);
+    cache = next;
+  }
+  cache_count = 0;
+}
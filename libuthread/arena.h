@@ -0,0 +1,85 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/* Size of the chunks objects are carved from, larger objects get their own */
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+/* Most free chunks kept for reuse, the others go back to malloc() */
+#define ARENA_CACHE_CHUNKS 64
+
+/* Alignment of every object */
+#define ARENA_ALIGN 16
+
+typedef struct arena_chunk arena_chunk_t;
+
+/*
+ * arena_t - Bump allocator
+ *
+ * Objects are carved one after the other from the chunk being filled, and are
+ * never freed one by one: they all go at once when the arena is reset or
+ * released. Free chunks are shared by every arena through a cache.
+ */
+typedef struct arena {
+	arena_chunk_t *chunks; // chunk being filled first, NULL if none
+	char *next; // next free byte of the chunk being filled
+	char *end; // end of the chunk being filled
+} arena_t;
+
+/*
+ * arena_bump - Allocate from the chunk being filled
+ * @arena: Arena to allocate from
+ * @size: Size of the object (in bytes)
+ *
+ * Return: NULL if the chunk being filled is too small or @size is 0, the
+ * object otherwise, aligned on ARENA_ALIGN
+ */
+static inline void *arena_bump(arena_t *arena, size_t size)
+{
+	void *ptr = arena->next;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (size == 0 || size > (size_t)(arena->end - arena->next))
+		return NULL;
+	arena->next += size;
+	return ptr;
+}
+
+/*
+ * arena_alloc - Allocate an object
+ * @arena: Arena to allocate from
+ * @size: Size of the object (in bytes)
+ *
+ * Must be called with preemption disabled.
+ *
+ * Return: NULL in case of failure (memory allocation, size overflow), the
+ * object otherwise, aligned on ARENA_ALIGN
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/*
+ * arena_reset - Free every object of an arena
+ * @arena: Arena to reset
+ *
+ * The chunk being filled is kept for the next objects, the other ones go back
+ * to the cache. Must be called with preemption disabled.
+ */
+void arena_reset(arena_t *arena);
+
+/*
+ * arena_release - Free every object and chunk of an arena
+ * @arena: Arena to release
+ *
+ * Must be called with preemption disabled.
+ */
+void arena_release(arena_t *arena);
+
+/*
+ * arena_trim - Free the chunks of the cache
+ *
+ * Must be called with preemption disabled.
+ */
+void arena_trim(void);
+
+#endif /* _ARENA_H */
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -5,9 +7,61 @@
 #include "preempt.h"
 #include "uthread.h"
 
-/* Size of the stack for a thread (in bytes) */
-#define UTHREAD_STACK_SIZE 32768
+#if defined(__x86_64__)
+#define GREG(reg) offsetof(ucontext_t, uc_mcontext.gregs[reg])
+#define FPREG(field) offsetof(ucontext_t, __fpregs_mem.field)
 
+/*
+ * When the signal mask is the same on both sides, the system call that
+ * swapcontext() makes to swap it is wasted. Only the stack and frame pointers,
+ * the resume address and the floating point control state (MXCSR and the x87
+ * control word, where getcontext() leaves them too) are saved: every other
+ * register is declared clobbered so the compiler keeps what it needs on the
+ * stack. The argument registers and %rbx are loaded from @next for contexts
+ * fresh out of makecontext().
+ */
+void uthread_ctx_jump(uthread_ctx_t *prev, uthread_ctx_t *next)
+{
+	__asm__ volatile(
+		"leaq 1f(%%rip), %%rax\n\t"
+		"movq %%rax, %c[rip](%%rdi)\n\t"
+		"movq %%rsp, %c[rsp](%%rdi)\n\t"
+		"movq %%rbp, %c[rbp](%%rdi)\n\t"
+		"stmxcsr %c[mxcsr](%%rdi)\n\t"
+		"fnstcw %c[fcw](%%rdi)\n\t"
+		"ldmxcsr %c[mxcsr](%%rsi)\n\t"
+		"fldcw %c[fcw](%%rsi)\n\t"
+		"movq %c[rsp](%%rsi), %%rsp\n\t"
+		"movq %c[rbp](%%rsi), %%rbp\n\t"
+		"movq %c[rbx](%%rsi), %%rbx\n\t"
+		"movq %c[rdi](%%rsi), %%rdi\n\t"
+		"movq %c[rdx](%%rsi), %%rdx\n\t"
+		"movq %c[rcx](%%rsi), %%rcx\n\t"
+		"movq %c[r8](%%rsi), %%r8\n\t"
+		"movq %c[r9](%%rsi), %%r9\n\t"
+		"movq %c[rip](%%rsi), %%rax\n\t"
+		"movq %c[rsi](%%rsi), %%rsi\n\t"
+		"jmp *%%rax\n"
+		"1:\n\t"
+		: "+D" (prev), "+S" (next)
+		: [rip] "i" (GREG(REG_RIP)), [rsp] "i" (GREG(REG_RSP)),
+		  [rbp] "i" (GREG(REG_RBP)), [rbx] "i" (GREG(REG_RBX)),
+		  [rdi] "i" (GREG(REG_RDI)), [rsi] "i" (GREG(REG_RSI)),
+		  [rdx] "i" (GREG(REG_RDX)), [rcx] "i" (GREG(REG_RCX)),
+		  [r8] "i" (GREG(REG_R8)), [r9] "i" (GREG(REG_R9)),
+		  [mxcsr] "i" (FPREG(mxcsr)), [fcw] "i" (FPREG(cwd))
+		: "rax", "rbx", "rcx", "rdx", "r8", "r9", "r10", "r11", "r12",
+		  "r13", "r14", "r15", "xmm0", "xmm1", "xmm2", "xmm3", "xmm4",
+		  "xmm5", "xmm6", "xmm7", "xmm8", "xmm9", "xmm10", "xmm11",
+		  "xmm12", "xmm13", "xmm14", "xmm15", "memory", "cc");
+}
+#endif
+
+#if !UTHREAD_PREEMPT && defined(__x86_64__)
+/* Without preemption the signal mask never changes */
+void uthread_ctx_switch(uthread_ctx_t *prev, uthread_ctx_t *next)
+	__attribute__((alias("uthread_ctx_jump")));
+#else
 void uthread_ctx_switch(uthread_ctx_t *prev, uthread_ctx_t *next)
 {
 	/*
@@ -19,6 +73,12 @@ void uthread_ctx_switch(uthread_ctx_t *prev, uthread_ctx_t *next)
 		exit(1);
 	}
 }
+#endif
+
+#if !defined(__x86_64__)
+void uthread_ctx_jump(uthread_ctx_t *prev, uthread_ctx_t *next)
+	__attribute__((alias("uthread_ctx_switch")));
+#endif
 
 void *uthread_ctx_alloc_stack(void)
 {
@@ -74,3 +134,23 @@ int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
 	return 0;
 }
 
+int uthread_ctx_init_from(uthread_ctx_t *uctx, const uthread_ctx_t *model,
+			  void *top_of_stack, uthread_func_t func, void *arg)
+{
+	/*
+	 * Start from a copy of @model instead of calling getcontext(), which
+	 * costs a system call to read the signal mask
+	 */
+	*uctx = *model;
+#if defined(__x86_64__) || defined(__i386__)
+	/* The copy must point to its own floating point state, not @model's */
+	uctx->uc_mcontext.fpregs = &uctx->__fpregs_mem;
+#endif
+
+	uctx->uc_stack.ss_sp = top_of_stack;
+	uctx->uc_stack.ss_size = UTHREAD_STACK_SIZE;
+	makecontext(uctx, (void (*)(void)) uthread_ctx_bootstrap,
+		    2, func, arg);
+
+	return 0;
+}
@@ -5,6 +5,9 @@
 
 #include "uthread.h"
 
+/* Size of the stack for a thread (in bytes) */
+#define UTHREAD_STACK_SIZE 32768
+
 /*
  * uthread_ctx_t - User-level thread context
  *
@@ -25,6 +28,19 @@ typedef ucontext_t uthread_ctx_t;
  */
 void uthread_ctx_switch(uthread_ctx_t *prev, uthread_ctx_t *next);
 
+/*
+ * uthread_ctx_jump - Switch between two contexts sharing a signal mask
+ * @prev: Pointer to the execution context structure in which to save the
+ *	currently running code
+ * @next: Pointer to the execution context structure to resume, initialized by
+ *	uthread_ctx_init() or saved by uthread_ctx_jump()
+ *
+ * Same as uthread_ctx_switch(), without saving nor restoring the signal mask,
+ * which is much cheaper. A context saved by this function must only be resumed
+ * by it.
+ */
+void uthread_ctx_jump(uthread_ctx_t *prev, uthread_ctx_t *next);
+
 /*
  * uthread_ctx_alloc_stack - Allocate stack segment
  *
@@ -52,4 +68,22 @@ void uthread_ctx_destroy_stack(void *top_of_stack);
 int uthread_ctx_init(uthread_ctx_t *uctx, void *top_of_stack,
 		     uthread_func_t func, void *arg);
 
+/*
+ * uthread_ctx_init_from - Initialize a thread's execution context from another
+ * @uctx: Pointer to thread context to initialize
+ * @model: Pointer to a thread context already initialized by
+ *	uthread_ctx_init()
+ * @top_of_stack: Pointer to the top of a valid stack segment
+ * @func: Function to be executed by the thread
+ * @arg: Argument to pass to the thread
+ *
+ * Same as uthread_ctx_init(), except that the state which is not specific to
+ * the new thread (such as the signal mask) is copied from @model instead of
+ * being captured again. Used to initialize many contexts in a row.
+ *
+ * Return: 0 if @uctx was properly initialized, or -1 in case of failure
+ */
+int uthread_ctx_init_from(uthread_ctx_t *uctx, const uthread_ctx_t *model,
+			  void *top_of_stack, uthread_func_t func, void *arg);
+
 #endif /* _CONTEXT_H */
@@ -0,0 +1,234 @@
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "executor.h"
+#include "preempt.h"
+#include "queue.h"
+#include "uthread.h"
+
+typedef struct idle_worker idle_worker;
+
+static int worker(void *arg);
+
+static int worker_spawn(uthread_executor_t executor);
+
+/* Stores a submitted task and, once it ran, its result */
+struct uthread_future {
+  uthread_func_t func; // function of the task
+  void* arg; // argument of the task
+  int retval; // return value of the task
+  int done; // 1 once the task ran
+  int waiter; // TID of thread waiting for the task, -1 if none
+};
+
+/* Parked worker, lives on the stack of the worker while it waits for a task */
+struct idle_worker {
+  uthread_t TID; // TID of the worker
+  int woken; // 1 once a task or the shutdown was handed to the worker
+  idle_worker* next; // next parked worker
+};
+
+struct uthread_executor {
+  queue_t tasks; // futures of the tasks waiting for a worker
+  int min_workers; // workers kept when there is no task
+  int max_workers; // maximum number of workers
+  int workers; // number of workers alive
+  idle_worker* idle; // stack of parked workers
+  int shutdown; // 1 once the executor is being destroyed
+  int destroyer; // TID of thread waiting in destroy, -1 if none
+};
+
+/* Runs the tasks of an executor until there is no more work for it */
+static int worker(void *arg)
+{
+  uthread_executor_t executor = (uthread_executor_t)arg;
+  uthread_future_t future;
+
+  preempt_disable();
+  while (1) {
+    if (queue_dequeue(executor->tasks, (void**)&future) == 0) {
+      /* Run the task, then hand the result to the waiting thread if any */
+      preempt_enable();
+      int retval = future->func(future->arg);
+      preempt_disable();
+      future->retval = retval;
+      future->done = 1;
+      int waiter = future->waiter;
+      preempt_enable();
+      if (waiter != -1)
+        uthread_unpark(waiter);
+      preempt_disable();
+    } else if (executor->shutdown ||
+               executor->workers > executor->min_workers) {
+      /* No task left and too many workers, retire */
+      executor->workers--;
+      int destroyer = executor->destroyer;
+      int last = (executor->workers == 0);
+      preempt_enable();
+      if (last && destroyer != -1)
+        uthread_unpark(destroyer);
+      return 0;
+    } else {
+      /* Park until a task is submitted */
+      idle_worker self = { uthread_self(), 0, executor->idle };
+      executor->idle = &self;
+      while (!self.woken) {
+        preempt_enable();
+        uthread_park();
+        preempt_disable();
+      }
+    }
+  }
+}
+
+/* Starts a new detached worker. Must be called with preemption disabled. */
+static int worker_spawn(uthread_executor_t executor)
+{
+  executor->workers++; // count it before other threads get to run
+  preempt_enable();
+  int TID = uthread_create(worker, executor);
+  if (TID != -1)
+    uthread_detach(TID);
+  preempt_disable();
+  if (TID == -1) {
+    executor->workers--;
+    return -1;
+  }
+
+  return 0;
+}
+
+uthread_executor_t uthread_executor_create(int min_workers, int max_workers)
+{
+  if (min_workers < 0 || max_workers < 1 || max_workers < min_workers)
+    return NULL;
+
+  uthread_executor_t executor = malloc(sizeof(struct uthread_executor));
+  if (executor == NULL)
+    return NULL;
+  executor->tasks = queue_create();
+  if (executor->tasks == NULL) {
+    free(executor);
+    return NULL;
+  }
+  executor->min_workers = min_workers;
+  executor->max_workers = max_workers;
+  executor->workers = 0;
+  executor->idle = NULL;
+  executor->shutdown = 0;
+  executor->destroyer = -1;
+
+  return executor;
+}
+
+uthread_future_t uthread_executor_submit(uthread_executor_t executor,
+                                         uthread_func_t func, void *arg)
+{
+  if (executor == NULL || func == NULL || executor->shutdown)
+    return NULL;
+
+  preempt_disable();
+  uthread_future_t future = malloc(sizeof(struct uthread_future));
+  if (future == NULL) {
+    preempt_enable();
+    return NULL;
+  }
+  future->func = func;
+  future->arg = arg;
+  future->retval = 0;
+  future->done = 0;
+  future->waiter = -1;
+  if (queue_enqueue(executor->tasks, future) == -1) {
+    free(future);
+    preempt_enable();
+    return NULL;
+  }
+
+  /* Wake a parked worker, or grow the pool if every worker is busy */
+  idle_worker* woken = executor->idle;
+  if (woken != NULL) {
+    executor->idle = woken->next;
+    woken->woken = 1;
+    uthread_t TID = woken->TID;
+    preempt_enable();
+    uthread_unpark(TID);
+    return future;
+  }
+  if (executor->workers < executor->max_workers &&
+      worker_spawn(executor) == -1 && executor->workers == 0) {
+    /* Nobody could ever run the task */
+    queue_delete(executor->tasks, future);
+    free(future);
+    future = NULL;
+  }
+  preempt_enable();
+
+  return future;
+}
+
+int uthread_executor_destroy(uthread_executor_t executor)
+{
+  if (executor == NULL)
+    return -1;
+
+  preempt_disable();
+  executor->shutdown = 1;
+  executor->destroyer = uthread_self();
+  /* Wake every parked worker so that it retires */
+  while (executor->idle != NULL) {
+    idle_worker* woken = executor->idle;
+    executor->idle = woken->next;
+    woken->woken = 1;
+    uthread_t TID = woken->TID;
+    preempt_enable();
+    uthread_unpark(TID);
+    preempt_disable();
+  }
+  /* Workers only retire once the queue is empty */
+  while (executor->workers > 0) {
+    preempt_enable();
+    uthread_park();
+    preempt_disable();
+  }
+  queue_destroy(executor->tasks);
+  free(executor);
+  preempt_enable();
+
+  return 0;
+}
+
+int uthread_future_wait(uthread_future_t future)
+{
+  if (future == NULL)
+    return -1;
+
+  preempt_disable();
+  if (future->waiter != -1) {
+    preempt_enable();
+    return -1; // another thread is waiting
+  }
+  future->waiter = uthread_self();
+  while (!future->done) {
+    preempt_enable();
+    uthread_park();
+    preempt_disable();
+  }
+  future->waiter = -1;
+  preempt_enable();
+
+  return 0;
+}
+
+int uthread_future_get(uthread_future_t future, int *retval)
+{
+  if (uthread_future_wait(future) == -1)
+    return -1;
+
+  if (retval != NULL)
+    *retval = future->retval;
+  preempt_disable();
+  free(future);
+  preempt_enable();
+
+  return 0;
+}
@@ -0,0 +1,89 @@
+#ifndef _EXECUTOR_H
+#define _EXECUTOR_H
+
+#include "uthread.h"
+
+/*
+ * uthread_executor_t - Executor type
+ *
+ * An executor runs submitted tasks on a set of worker threads that are reused
+ * from one task to the next, instead of creating a thread per task. Tasks are
+ * run in submission order. Idle workers stay parked until a task is submitted.
+ *
+ * The number of workers grows on demand up to a maximum, and shrinks back to a
+ * minimum when workers run out of tasks.
+ */
+typedef struct uthread_executor* uthread_executor_t;
+
+/*
+ * uthread_future_t - Future type
+ *
+ * A future is the handle to a submitted task, which gives access to the return
+ * value of the task once it has run.
+ */
+typedef struct uthread_future* uthread_future_t;
+
+/*
+ * uthread_executor_create - Create an executor
+ * @min_workers: Number of workers kept parked when there is no task to run
+ * @max_workers: Maximum number of workers running tasks at the same time
+ *
+ * Return: Pointer to new executor. NULL if @min_workers is negative, if
+ * @max_workers is smaller than 1 or than @min_workers, or in case of failure
+ * when allocating the executor.
+ */
+uthread_executor_t uthread_executor_create(int min_workers, int max_workers);
+
+/*
+ * uthread_executor_submit - Submit a task
+ * @executor: Executor to run the task
+ * @func: Function to be executed by a worker
+ * @arg: Argument to be passed to the function
+ *
+ * Queue the call of @func with argument @arg, and wake or create a worker to
+ * run it if needed.
+ *
+ * Return: Future of the task, to be released with uthread_future_get(). NULL if
+ * @executor or @func are NULL, if @executor is being destroyed, or in case of
+ * failure when allocating the task.
+ */
+uthread_future_t uthread_executor_submit(uthread_executor_t executor,
+					 uthread_func_t func, void *arg);
+
+/*
+ * uthread_executor_destroy - Deallocate an executor
+ * @executor: Executor to deallocate
+ *
+ * Wait until every submitted task has run and every worker has exited, then
+ * deallocate @executor. Futures of the tasks remain valid.
+ *
+ * This function must not be called from a task of @executor.
+ *
+ * Return: -1 if @executor is NULL. 0 if @executor was successfully destroyed.
+ */
+int uthread_executor_destroy(uthread_executor_t executor);
+
+/*
+ * uthread_future_wait - Wait for a task to complete
+ * @future: Future of the task
+ *
+ * Block the calling thread until the task of @future has run. A future can be
+ * waited on by only one thread at a time.
+ *
+ * Return: -1 if @future is NULL or already being waited on. 0 otherwise.
+ */
+int uthread_future_wait(uthread_future_t future);
+
+/*
+ * uthread_future_get - Get the result of a task
+ * @future: Future of the task
+ * @retval: (Optional) Address of an integer that will receive the return value
+ *
+ * Wait for the task of @future to complete, assign its return value to
+ * @retval, and deallocate @future.
+ *
+ * Return: -1 if @future is NULL or already being waited on. 0 otherwise.
+ */
+int uthread_future_get(uthread_future_t future, int *retval);
+
+#endif /* _EXECUTOR_H */
@@ -0,0 +1,180 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+#include "helper.h"
+#include "histogram.h"
+
+/* Requests waiting for a helper, and completed ones, both in FIFO order */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static helper_request_t* pending_head = NULL;
+static helper_request_t* pending_tail = NULL;
+static helper_request_t* completed_head = NULL;
+static helper_request_t* completed_tail = NULL;
+
+static int completion_fd = -1;
+
+/* State of the pool, protected by the lock */
+static int max_threads = HELPER_THREADS; // most helper threads
+static int threads = 0; // helper threads started
+static int idle = 0; // helper threads waiting for a request
+static int queued = 0; // requests waiting for a helper thread
+static unsigned long long calls = 0; // requests run since the start
+static histogram_t wait_time; // time requests waited for a helper (in ns)
+
+/* Returns the current time (in ns) */
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Runs the requests as they come */
+static void* helper_main(void* arg)
+{
+  (void)arg;
+  while (1) {
+    pthread_mutex_lock(&lock);
+    idle++;
+    while (pending_head == NULL)
+      pthread_cond_wait(&wakeup, &lock);
+    idle--;
+    helper_request_t* req = pending_head;
+    pending_head = req->next;
+    if (pending_head == NULL)
+      pending_tail = NULL;
+    queued--;
+    calls++;
+    histogram_record(&wait_time, now_ns() - req->queued_at);
+    pthread_mutex_unlock(&lock);
+
+    errno = 0;
+    req->result = req->call(req->arg);
+    req->error = errno;
+
+    pthread_mutex_lock(&lock);
+    req->next = NULL;
+    if (completed_tail != NULL)
+      completed_tail->next = req;
+    else
+      completed_head = req;
+    completed_tail = req;
+    pthread_mutex_unlock(&lock);
+    eventfd_write(completion_fd, 1); // wakes the scheduler up
+  }
+
+  return NULL;
+}
+
+/* Starts one more helper thread, returns -1 if it could not be started */
+static int helper_spawn(void)
+{
+  /* Helpers must never take the signals meant for the threads (the
+     preemption timer especially), they inherit a mask blocking all of them */
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_t helper;
+  int ret = pthread_create(&helper, NULL, helper_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (ret != 0)
+    return -1;
+  pthread_detach(helper);
+
+  return 0;
+}
+
+int helper_start(void)
+{
+  if (completion_fd != -1)
+    return 0; // already started
+
+  completion_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (completion_fd == -1)
+    return -1;
+  const char* env = getenv("UTHREAD_HELPERS");
+  if (env != NULL && atoi(env) > 0)
+    max_threads = atoi(env);
+
+  return 0;
+}
+
+int helper_fd(void)
+{
+  return completion_fd;
+}
+
+int helper_submit(helper_request_t *req)
+{
+  req->next = NULL;
+  req->queued_at = now_ns();
+  pthread_mutex_lock(&lock);
+  if (pending_tail != NULL)
+    pending_tail->next = req;
+  else
+    pending_head = req;
+  pending_tail = req;
+  queued++;
+  /* Grow the pool when every helper already has a request to run */
+  int spawn = (queued > idle && threads < max_threads);
+  if (spawn)
+    threads++;
+  pthread_cond_signal(&wakeup);
+  pthread_mutex_unlock(&lock);
+
+  if (spawn && helper_spawn() == -1) {
+    pthread_mutex_lock(&lock);
+    threads--;
+    int orphan = (threads == 0); // nobody could ever run the request
+    if (orphan) {
+      pending_head = pending_tail = NULL; // it was the only one
+      queued--;
+    }
+    pthread_mutex_unlock(&lock);
+    if (orphan)
+      return -1;
+  }
+
+  return 0;
+}
+
+int helper_reap(void (*complete)(helper_request_t *req))
+{
+  eventfd_t count;
+  eventfd_read(completion_fd, &count); // resets the counter
+
+  pthread_mutex_lock(&lock);
+  helper_request_t* req = completed_head;
+  completed_head = completed_tail = NULL;
+  pthread_mutex_unlock(&lock);
+
+  int reaped = 0;
+  while (req != NULL) {
+    helper_request_t* next = req->next; // @complete may reuse the request
+    complete(req);
+    req = next;
+    reaped++;
+  }
+
+  return reaped;
+}
+
+void helper_stats(struct uthread_blocking_stats *stats)
+{
+  pthread_mutex_lock(&lock);
+  stats->threads = threads;
+  stats->max_threads = max_threads;
+  stats->busy = threads - idle;
+  stats->queued = queued;
+  stats->calls = calls;
+  stats->wait_p50 = histogram_percentile(&wait_time, 50);
+  stats->wait_p99 = histogram_percentile(&wait_time, 99);
+  stats->wait_max = wait_time.max;
+  pthread_mutex_unlock(&lock);
+}
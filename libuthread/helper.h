@@ -0,0 +1,72 @@
+#ifndef _HELPER_H
+#define _HELPER_H
+
+#include <stdint.h>
+
+#include "uthread.h"
+
+/* Most helper threads running at once, unless UTHREAD_HELPERS says otherwise */
+#define HELPER_THREADS 4
+
+/*
+ * helper_request_t - Call run on a helper thread
+ *
+ * Helper threads are system threads running the blocking calls that cannot be
+ * made without blocking the whole process. They are started on demand, up to a
+ * bounded number, and run the requests in submission order. Requests are owned
+ * by their submitter until they are handed back by helper_reap().
+ */
+typedef struct helper_request {
+	long (*call)(void *arg); // function to run
+	void *arg; // argument of the function
+	long result; // return value of the function
+	int error; // errno after the function returned
+	void *data; // for the submitter
+	uint64_t queued_at; // time of the submission (in ns)
+	struct helper_request *next;
+} helper_request_t;
+
+/*
+ * helper_start - Prepare the helper threads
+ *
+ * Create the completion file descriptor. Helper threads themselves are started
+ * by helper_submit() when every running one is busy. Calling this function
+ * again once it succeeded does nothing.
+ *
+ * Return: -1 in case of failure, 0 otherwise
+ */
+int helper_start(void);
+
+/*
+ * helper_fd - Get the completion file descriptor
+ *
+ * The descriptor is readable when completed requests are waiting to be reaped.
+ *
+ * Return: Completion file descriptor
+ */
+int helper_fd(void);
+
+/*
+ * helper_submit - Queue a request
+ * @req: Request to run, with @call and @arg set
+ *
+ * Return: -1 if no helper thread is running and none could be started, 0
+ * otherwise
+ */
+int helper_submit(helper_request_t *req);
+
+/*
+ * helper_reap - Hand back completed requests
+ * @complete: Function called with each completed request, in completion order
+ *
+ * Return: Number of requests handed back
+ */
+int helper_reap(void (*complete)(helper_request_t *req));
+
+/*
+ * helper_stats - Get the state of the helper threads
+ * @stats: Address of the structure receiving the state
+ */
+void helper_stats(struct uthread_blocking_stats *stats);
+
+#endif /* _HELPER_H */
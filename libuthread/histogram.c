@@ -0,0 +1,59 @@
+#include <string.h>
+
+#include "histogram.h"
+
+/* Returns the bucket of a value */
+static int bucket_index(uint64_t value)
+{
+  if (value < 2 * HISTOGRAM_SUB_BUCKETS)
+    return (int)value; // one bucket per value at the bottom
+  // position of the most significant bit, at least HISTOGRAM_SUB_BITS + 1
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - HISTOGRAM_SUB_BITS;
+  // (value >> shift) keeps HISTOGRAM_SUB_BITS bits below the leading one
+  return shift * HISTOGRAM_SUB_BUCKETS + (int)(value >> shift);
+}
+
+/* Returns the highest value falling in a bucket */
+static uint64_t bucket_highest(int index)
+{
+  if (index < 2 * HISTOGRAM_SUB_BUCKETS)
+    return (uint64_t)index;
+  int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+  uint64_t sub = index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+void histogram_reset(histogram_t *hist)
+{
+  memset(hist, 0, sizeof(*hist));
+}
+
+void histogram_record(histogram_t *hist, uint64_t value)
+{
+  hist->buckets[bucket_index(value)]++;
+  hist->count++;
+  if (value > hist->max)
+    hist->max = value;
+}
+
+uint64_t histogram_percentile(const histogram_t *hist, double percentile)
+{
+  if (hist->count == 0)
+    return 0;
+
+  /* Rank of the value, counted from 1 */
+  uint64_t rank = (uint64_t)(percentile / 100 * hist->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= rank) {
+      uint64_t highest = bucket_highest(i);
+      return highest < hist->max ? highest : hist->max;
+    }
+  }
+
+  return hist->max;
+}
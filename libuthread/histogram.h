@@ -0,0 +1,50 @@
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Log-linear layout: values below 2 * HISTOGRAM_SUB_BUCKETS get a bucket each,
+ * then every power of two is split into HISTOGRAM_SUB_BUCKETS buckets, so that
+ * any value is recorded with a relative error below 1 / HISTOGRAM_SUB_BUCKETS.
+ */
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((65 - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_BUCKETS)
+
+/*
+ * histogram_t - High dynamic range histogram
+ *
+ * Counts 64-bit values in buckets whose width grows with the values, covering
+ * the whole range with a fixed precision in constant space and time.
+ */
+typedef struct histogram {
+	uint64_t count; // number of values recorded
+	uint64_t max; // largest value recorded, exact
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+/*
+ * histogram_reset - Forget every recorded value
+ * @hist: Histogram to reset
+ */
+void histogram_reset(histogram_t *hist);
+
+/*
+ * histogram_record - Record a value
+ * @hist: Histogram in which to record @value
+ * @value: Value to record
+ */
+void histogram_record(histogram_t *hist, uint64_t value);
+
+/*
+ * histogram_percentile - Get a percentile of the recorded values
+ * @hist: Histogram to query
+ * @percentile: Percentile to get, between 0 and 100
+ *
+ * Return: Highest value of the bucket holding the @percentile-th percentile,
+ * capped to the largest recorded value. 0 if @hist is empty.
+ */
+uint64_t histogram_percentile(const histogram_t *hist, double percentile);
+
+#endif /* _HISTOGRAM_H */
@@ -0,0 +1,329 @@
+/*
+ * Blocking call hooks
+ *
+ * Makes the blocking calls of code which does not know about the library wait
+ * in the scheduler instead of blocking the whole process, without changing the
+ * flags of the file descriptors, which other processes may share. Transfers on
+ * sockets are tried with MSG_DONTWAIT, other files are polled first and only
+ * called once ready, and each time a call would block the calling thread
+ * waits in uthread_poll() before trying again. connect() runs on a helper
+ * thread, and sleeps go to uthread_sleep_ns(). File descriptors in non-blocking
+ * mode are left alone, and so are the calls made by any other system thread
+ * than the one running the threads.
+ *
+ * Built two ways:
+ * - libuthread_hook.so (UTHREAD_HOOK_PRELOAD defined), to be loaded with
+ *   LD_PRELOAD. It finds the library in the executable, which must export its
+ *   symbols (-rdynamic), and calls the real functions otherwise.
+ * - hook.o in libuthread.a, linked in with -Wl,--wrap=read,--wrap=write,...
+ *   (see UTHREAD_WRAP in progs/Makefile).
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "uthread.h"
+
+#ifdef UTHREAD_HOOK_PRELOAD
+#include <dlfcn.h>
+
+#define HOOK(name) name
+#define REAL(name) real_##name()
+
+/* Library of the executable, NULL if it was not linked with it */
+extern int uthread_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+	__attribute__((weak));
+extern void uthread_sleep_ns(unsigned long long ns) __attribute__((weak));
+extern int uthread_on_scheduler(void) __attribute__((weak));
+extern int uthread_blocking_call(uthread_func_t func, void *arg)
+	__attribute__((weak));
+
+/* Defines real_name(), which returns the next definition of @name */
+#define DEFINE_REAL(ret, name, ...)					\
+	static ret (*real_##name(void))(__VA_ARGS__)			\
+	{								\
+		static ret (*func)(__VA_ARGS__) = NULL;			\
+		if (func == NULL)					\
+			func = (ret (*)(__VA_ARGS__))			\
+				dlsym(RTLD_NEXT, #name);		\
+		return func;						\
+	}
+#else
+#define HOOK(name) __wrap_##name
+#define REAL(name) __real_##name
+
+/* Defines the prototype of __real_name(), provided by the linker */
+#define DEFINE_REAL(ret, name, ...) ret __real_##name(__VA_ARGS__);
+#endif
+
+DEFINE_REAL(ssize_t, read, int, void *, size_t)
+DEFINE_REAL(ssize_t, write, int, const void *, size_t)
+DEFINE_REAL(ssize_t, recv, int, void *, size_t, int)
+DEFINE_REAL(ssize_t, send, int, const void *, size_t, int)
+DEFINE_REAL(int, connect, int, const struct sockaddr *, socklen_t)
+DEFINE_REAL(int, accept, int, struct sockaddr *, socklen_t *)
+DEFINE_REAL(int, poll, struct pollfd *, nfds_t, int)
+DEFINE_REAL(unsigned int, sleep, unsigned int)
+DEFINE_REAL(int, usleep, useconds_t)
+DEFINE_REAL(int, nanosleep, const struct timespec *, struct timespec *)
+
+ssize_t HOOK(read)(int fd, void *buf, size_t count);
+ssize_t HOOK(write)(int fd, const void *buf, size_t count);
+ssize_t HOOK(recv)(int fd, void *buf, size_t len, int flags);
+ssize_t HOOK(send)(int fd, const void *buf, size_t len, int flags);
+int HOOK(connect)(int fd, const struct sockaddr *addr, socklen_t len);
+int HOOK(accept)(int fd, struct sockaddr *addr, socklen_t *len);
+int HOOK(poll)(struct pollfd *fds, nfds_t nfds, int timeout);
+unsigned int HOOK(sleep)(unsigned int seconds);
+int HOOK(usleep)(useconds_t usec);
+int HOOK(nanosleep)(const struct timespec *req, struct timespec *rem);
+
+/*
+ * Tells if calls must go through the scheduler: only those of the threads,
+ * made on the system thread running them. Other system threads, such as the
+ * helpers of uthread_blocking_call(), block on their own.
+ */
+static int hooked(void)
+{
+#ifdef UTHREAD_HOOK_PRELOAD
+	if (uthread_poll == NULL || uthread_sleep_ns == NULL ||
+	    uthread_on_scheduler == NULL || uthread_blocking_call == NULL)
+		return 0;
+#endif
+	return uthread_on_scheduler();
+}
+
+/*
+ * Tells if the calls on @fd must go through the scheduler: hooked, and @fd in
+ * blocking mode. Non-blocking ones are the business of their caller.
+ */
+static int hooked_fd(int fd)
+{
+	if (!hooked())
+		return 0;
+	int flags = fcntl(fd, F_GETFL);
+	return flags != -1 && !(flags & O_NONBLOCK);
+}
+
+/* Tells if a call failed only because it would have blocked */
+static int would_block(ssize_t ret)
+{
+	return ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Waits until @fd is ready for @events, letting the other threads run */
+static int wait_fd(int fd, short events)
+{
+	struct pollfd pfd = { fd, events, 0 };
+	int ret;
+	do {
+		ret = uthread_poll(&pfd, 1, -1);
+	} while (ret == -1 && errno == EINTR);
+
+	return (ret == -1) ? -1 : 0;
+}
+
+/*
+ * Tells if @fd is ready for @events right now: 1 if so, -1 otherwise, with
+ * errno set to EAGAIN like a call which would block if it is only not ready.
+ */
+static int ready_fd(int fd, short events)
+{
+	struct pollfd pfd = { fd, events, 0 };
+	int ret = REAL(poll)(&pfd, 1, 0);
+	if (ret == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return ret;
+}
+
+/* Transfers hooked by io_call() */
+enum io_op { IO_READ, IO_WRITE, IO_RECV, IO_SEND };
+
+/* What io_call() learnt about its file descriptor */
+enum io_kind {
+	IO_UNKNOWN, // not tried yet
+	IO_SOCKET, // MSG_DONTWAIT applies
+	IO_FILE, // regular file or block device, always ready
+	IO_STREAM, // pipe, FIFO or character device
+};
+
+/*
+ * Tries @op once without blocking. Sockets take MSG_DONTWAIT, read() and
+ * write() included, which are recv() and send() without flags there. Other
+ * files are polled first: a stream ready for reading returns what it holds,
+ * and one ready for writing takes PIPE_BUF bytes at least, so writes go by
+ * PIPE_BUF there. @kind starts as IO_UNKNOWN, and keeps what was learnt.
+ */
+static ssize_t io_try(enum io_op op, int fd, void *buf, size_t len, int flags,
+		      enum io_kind *kind)
+{
+	int in = op == IO_READ || op == IO_RECV;
+
+	if (*kind == IO_UNKNOWN || *kind == IO_SOCKET) {
+		ssize_t ret = in ?
+			REAL(recv)(fd, buf, len, flags | MSG_DONTWAIT) :
+			REAL(send)(fd, buf, len, flags | MSG_DONTWAIT);
+		if (ret != -1 || errno != ENOTSOCK ||
+		    op == IO_RECV || op == IO_SEND) {
+			*kind = IO_SOCKET;
+			return ret;
+		}
+		struct stat st;
+		if (fstat(fd, &st) == -1)
+			return -1;
+		*kind = (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode)) ?
+			IO_FILE : IO_STREAM;
+	}
+
+	if (*kind == IO_STREAM && ready_fd(fd, in ? POLLIN : POLLOUT) != 1)
+		return -1;
+	if (in)
+		return REAL(read)(fd, buf, len);
+	if (*kind == IO_STREAM && len > PIPE_BUF)
+		len = PIPE_BUF;
+	return REAL(write)(fd, buf, len);
+}
+
+/*
+ * Makes @op on @fd, waiting in the scheduler each time it would block:
+ * readiness alone does not prove the call will not block, another reader may
+ * come first or the data may not fit. Writes, and receives with MSG_WAITALL,
+ * go on until all of @buf is transferred like blocking ones.
+ *
+ * A stream is only called once poll() found it ready. If a tick switches the
+ * thread out in between and another thread takes what was ready, the call
+ * blocks the process until more comes.
+ */
+static ssize_t io_call(enum io_op op, int fd, void *buf, size_t len, int flags)
+{
+	short events = (op == IO_READ || op == IO_RECV) ? POLLIN : POLLOUT;
+	int all = events == POLLOUT || (op == IO_RECV && (flags & MSG_WAITALL));
+	enum io_kind kind = IO_UNKNOWN;
+	size_t done = 0;
+
+	for (;;) {
+		ssize_t ret = io_try(op, fd, (char *)buf + done, len - done,
+				     flags, &kind);
+		if (ret > 0)
+			done += ret;
+		if (ret == -1 && !would_block(ret))
+			return (done > 0) ? (ssize_t)done : -1;
+		if (ret == 0 || (ret > 0 && (!all || done == len)))
+			return done;
+		if (ret == -1 && wait_fd(fd, events) == -1)
+			return (done > 0) ? (ssize_t)done : -1;
+	}
+}
+
+ssize_t HOOK(read)(int fd, void *buf, size_t count)
+{
+	if (!hooked_fd(fd))
+		return REAL(read)(fd, buf, count);
+	return io_call(IO_READ, fd, buf, count, 0);
+}
+
+ssize_t HOOK(write)(int fd, const void *buf, size_t count)
+{
+	if (!hooked_fd(fd))
+		return REAL(write)(fd, buf, count);
+	return io_call(IO_WRITE, fd, (void *)buf, count, 0);
+}
+
+ssize_t HOOK(recv)(int fd, void *buf, size_t len, int flags)
+{
+	if ((flags & MSG_DONTWAIT) || !hooked_fd(fd))
+		return REAL(recv)(fd, buf, len, flags);
+	return io_call(IO_RECV, fd, buf, len, flags);
+}
+
+ssize_t HOOK(send)(int fd, const void *buf, size_t len, int flags)
+{
+	if ((flags & MSG_DONTWAIT) || !hooked_fd(fd))
+		return REAL(send)(fd, buf, len, flags);
+	return io_call(IO_SEND, fd, (void *)buf, len, flags);
+}
+
+/* Arguments of connect(), for connect_call() */
+struct connect_args {
+	int fd;
+	const struct sockaddr *addr;
+	socklen_t len;
+};
+
+/* Runs connect() on a helper thread, see HOOK(connect) */
+static int connect_call(void *arg)
+{
+	struct connect_args *args = arg;
+	return REAL(connect)(args->fd, args->addr, args->len);
+}
+
+int HOOK(connect)(int fd, const struct sockaddr *addr, socklen_t len)
+{
+	if (!hooked_fd(fd))
+		return REAL(connect)(fd, addr, len);
+
+	/* No flag of the call starts connecting without blocking, and the one of
+	   the file descriptor is shared: block a helper thread instead */
+	struct connect_args args = { fd, addr, len };
+	return uthread_blocking_call(connect_call, &args);
+}
+
+int HOOK(accept)(int fd, struct sockaddr *addr, socklen_t *len)
+{
+	if (!hooked_fd(fd))
+		return REAL(accept)(fd, addr, len);
+
+	/* Another thread may take the connection which woke this one up */
+	for (;;) {
+		int ret = ready_fd(fd, POLLIN);
+		if (ret == 1)
+			ret = REAL(accept)(fd, addr, len);
+		if (!would_block(ret) || wait_fd(fd, POLLIN) == -1)
+			return ret;
+	}
+}
+
+int HOOK(poll)(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	if (!hooked())
+		return REAL(poll)(fds, nfds, timeout);
+	return uthread_poll(fds, nfds, timeout);
+}
+
+unsigned int HOOK(sleep)(unsigned int seconds)
+{
+	if (!hooked())
+		return REAL(sleep)(seconds);
+	uthread_sleep_ns(seconds * 1000000000ULL);
+	return 0;
+}
+
+int HOOK(usleep)(useconds_t usec)
+{
+	if (!hooked())
+		return REAL(usleep)(usec);
+	uthread_sleep_ns(usec * 1000ULL);
+	return 0;
+}
+
+int HOOK(nanosleep)(const struct timespec *req, struct timespec *rem)
+{
+	if (!hooked())
+		return REAL(nanosleep)(req, rem);
+	if (req->tv_nsec < 0 || req->tv_nsec >= 1000000000 || req->tv_sec < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	uthread_sleep_ns(req->tv_sec * 1000000000ULL + req->tv_nsec);
+	if (rem != NULL)
+		rem->tv_sec = rem->tv_nsec = 0;
+	return 0;
+}
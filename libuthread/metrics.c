@@ -0,0 +1,55 @@
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+/* Attempts before giving up on a region stuck in an update */
+#define READ_ATTEMPTS 1000
+
+const struct uthread_metrics *uthread_metrics_open(int pid)
+{
+  char path[64];
+  snprintf(path, sizeof(path), UTHREAD_METRICS_PATH, pid);
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return NULL; // process not found or not exporting
+  void* region = mmap(NULL, sizeof(struct uthread_metrics), PROT_READ,
+                      MAP_SHARED, fd, 0);
+  close(fd); // the mapping stays valid
+  if (region == MAP_FAILED)
+    return NULL;
+
+  return region;
+}
+
+int uthread_metrics_read(const struct uthread_metrics *region,
+                         struct uthread_metrics *copy)
+{
+  if (region == NULL || copy == NULL)
+    return -1;
+
+  for (int i = 0; i < READ_ATTEMPTS; i++) {
+    uint32_t seq = __atomic_load_n(&region->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      sched_yield(); // let the writer finish its update
+      continue;
+    }
+    memcpy(copy, region, sizeof(*copy));
+    // the copy must be done before checking the sequence again
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&region->seq, __ATOMIC_RELAXED) == seq)
+      return (copy->magic == UTHREAD_METRICS_MAGIC) ? 0 : -1;
+  }
+
+  return -1; // never saw the region between two updates
+}
+
+void uthread_metrics_close(const struct uthread_metrics *region)
+{
+  if (region != NULL)
+    munmap((void*)region, sizeof(struct uthread_metrics));
+}
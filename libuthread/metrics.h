@@ -0,0 +1,80 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdint.h>
+
+/*
+ * Exporting the metrics
+ *
+ * A process started with the environment variable UTHREAD_METRICS set (to
+ * anything but "0") publishes the state of its scheduler in the memory-mapped
+ * file UTHREAD_METRICS_PATH, named after its PID. The file is created with the
+ * first thread and removed when the process exits normally. Other processes
+ * read it with uthread_metrics_open() and uthread_metrics_read(), without any
+ * system call or lock in the monitored process.
+ */
+#define UTHREAD_METRICS_ENV "UTHREAD_METRICS"
+#define UTHREAD_METRICS_PATH "/dev/shm/uthread-%d"
+#define UTHREAD_METRICS_MAGIC 0x75746d31 // "utm1"
+
+/*
+ * struct uthread_metrics - Published scheduler state
+ * @magic: UTHREAD_METRICS_MAGIC once the region is initialized
+ * @seq: Sequence counter, odd while the process updates the region
+ * @pid: PID of the monitored process
+ * @runnable: Threads ready to run, including the running one
+ * @blocked: Threads blocked in a join or a park
+ * @zombies: Threads that exited and were not collected yet
+ * @switches: Context switches since the start
+ * @preemptions: Switches forced by the timer since the start
+ * @creates: Threads created since the start
+ * @exits: Threads exited since the start
+ * @stack_bytes: Memory used by the stacks of the threads alive or not collected
+ *
+ * The counters are updated at every context switch and thread creation.
+ */
+struct uthread_metrics {
+	uint32_t magic;
+	uint32_t seq;
+	int32_t pid;
+	uint32_t reserved;
+	uint64_t runnable;
+	uint64_t blocked;
+	uint64_t zombies;
+	uint64_t switches;
+	uint64_t preemptions;
+	uint64_t creates;
+	uint64_t exits;
+	uint64_t stack_bytes;
+};
+
+/*
+ * uthread_metrics_open - Map the metrics of a process
+ * @pid: PID of the process
+ *
+ * Return: Read-only mapping of the metrics of process @pid, to be released with
+ * uthread_metrics_close(). NULL if the process does not export its metrics.
+ */
+const struct uthread_metrics *uthread_metrics_open(int pid);
+
+/*
+ * uthread_metrics_read - Take a consistent copy of metrics
+ * @region: Mapping returned by uthread_metrics_open()
+ * @copy: Address of the structure receiving the copy
+ *
+ * Retry while the monitored process is updating the region, the copy being
+ * taken between two updates.
+ *
+ * Return: -1 if the region is not initialized, or if no consistent copy could
+ * be taken (the process died in the middle of an update). 0 otherwise.
+ */
+int uthread_metrics_read(const struct uthread_metrics *region,
+			 struct uthread_metrics *copy);
+
+/*
+ * uthread_metrics_close - Unmap the metrics of a process
+ * @region: Mapping returned by uthread_metrics_open()
+ */
+void uthread_metrics_close(const struct uthread_metrics *region);
+
+#endif /* _METRICS_H */
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+#include <link.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -6,32 +8,447 @@
 #include <stdlib.h>
 #include <sys/time.h>
 #include <string.h>
+#include <ucontext.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#endif
 
 #include "preempt.h"
 #include "uthread.h"
 
+/*
+* Set when a tick asked the running thread to yield but could not switch it
+* right away. Polled by preempt_enable() and by checkpoints.
+*/
+volatile sig_atomic_t uthread_preempt_requested = 0;
+
+#if UTHREAD_PREEMPT
+
 /*
 * Frequency of preemption
 * 100Hz is 100 times per second
 */
 #define HZ 100
+
+/*
+* Delay before trying again when a tick lands in code that must not be
+* preempted (in us)
+*/
+#define RETRY_USEC 100
+
+/* Maximum number of code ranges that must not be preempted */
+#define MAX_UNSAFE 32
+
+/* Colon-separated names of more libraries that must not be preempted */
+#define UNSAFE_ENV "UTHREAD_PREEMPT_UNSAFE"
+
 sigset_t set;
 
-static void alarm_handler(int signum);
+/* Number of times a tick made the running thread yield */
+static unsigned long preemptions = 0;
+
+/* Number of ticks handled, read by the watchdog from its own system thread */
+static volatile unsigned long ticks = 0;
+
+/* Polling mode: 1 between preempt_disable() and preempt_enable(), where a
+   forced yield must not switch the thread out */
+static volatile sig_atomic_t poll_masked = 0;
+
+/* Preemption mode, fixed once preemption started */
+static enum uthread_preempt_mode preempt_mode = UTHREAD_PREEMPT_SIGNAL;
+
+/* Handler of SIGVTALRM before preemption started, restored when it stops */
+static struct sigaction old_action;
+
+/*
+* Executable ranges of the C library, the dynamic loader and the other
+* libraries below. They are not reentrant (malloc for instance), so a thread
+* interrupted there cannot be switched out: another thread could call into the
+* same code.
+*/
+static struct {
+ uintptr_t start;
+ uintptr_t end;
+} unsafe[MAX_UNSAFE];
+static int nb_unsafe = 0;
+
+/* Libraries protected by default, matched anywhere in the path of an object */
+static const char *const unsafe_libs[] = {
+ "/libc.so", "/ld-linux", "/libpthread", // glibc
+ "/libstdc++.so", "/libgcc_s.so", // C++ runtime, unwinder
+ "/libjemalloc.so", "/libtcmalloc", "/libmimalloc.so", // allocators
+ NULL
+};
+
+static void alarm_handler(int signum, siginfo_t *info, void *ucontext);
+
+static bool unsafe_name(const char *name, const char *extra);
+
+static int find_unsafe(struct dl_phdr_info *info, size_t size, void *arg);
+
+static bool unsafe_pc(uintptr_t pc);
+
+static void retry_soon(void);
+
+#if defined(__x86_64__)
+/*
+* Preemption trampoline
+*
+* The signal handler does not switch threads itself: it makes the interrupted
+* context resume in preempt_trampoline, outside of the signal frame, with
+* SIGVTALRM still blocked. The trampoline skips the red zone, saves every
+* register and the extended (FPU/SSE/AVX) state since the interrupted code did
+* not expect a call, yields through preempt_resume(), and finally returns to
+* the interrupted instruction with `ret $128` to restore the stack pointer.
+*/
+uintptr_t preempt_resume(void) __attribute__((visibility("hidden")));
+
+/* Size of the XSAVE area, 0 to fall back to FXSAVE */
+unsigned long preempt_xsave_size __attribute__((visibility("hidden"))) = 0;
+
+/* Interrupted instruction, handed from the handler to the trampoline, and
+   set while the trampoline did not read it yet */
+static volatile uintptr_t resume_pc;
+static volatile sig_atomic_t resume_pending = 0;
+
+extern char preempt_trampoline[];
+
+__asm__(
+ "	.text\n"
+ "	.globl preempt_trampoline\n"
+ "	.hidden preempt_trampoline\n"
+ "	.type preempt_trampoline, @function\n"
+ "preempt_trampoline:\n"
+ "	leaq -8(%rsp), %rsp\n" // slot receiving the address to resume at,
+ "	pushfq\n" // flags untouched so far (unlike with subq)
+ "	pushq %rax\n"
+ "	pushq %rcx\n"
+ "	pushq %rdx\n"
+ "	pushq %rsi\n"
+ "	pushq %rdi\n"
+ "	pushq %r8\n"
+ "	pushq %r9\n"
+ "	pushq %r10\n"
+ "	pushq %r11\n"
+ "	pushq %rbx\n"
+ "	movq %rsp, %rbx\n"
+ "	movq preempt_xsave_size(%rip), %rcx\n"
+ "	testq %rcx, %rcx\n"
+ "	jz 1f\n"
+ "	subq %rcx, %rsp\n"
+ "	andq $-64, %rsp\n"
+ "	xorl %eax, %eax\n" // XSAVE header must start zeroed
+ "	movl $8, %ecx\n"
+ "0:	movq %rax, 504(%rsp,%rcx,8)\n"
+ "	loop 0b\n"
+ "	movl $-1, %eax\n"
+ "	movl $-1, %edx\n"
+ "	xsave (%rsp)\n"
+ "	jmp 2f\n"
+ "1:	subq $512, %rsp\n"
+ "	andq $-16, %rsp\n"
+ "	fxsave (%rsp)\n"
+ "2:	call preempt_resume\n"
+ "	movq %rax, 88(%rbx)\n" // above the 10 saved registers and the flags
+ "	cmpq $0, preempt_xsave_size(%rip)\n"
+ "	jz 3f\n"
+ "	movl $-1, %eax\n"
+ "	movl $-1, %edx\n"
+ "	xrstor (%rsp)\n"
+ "	jmp 4f\n"
+ "3:	fxrstor (%rsp)\n"
+ "4:	movq %rbx, %rsp\n"
+ "	popq %rbx\n"
+ "	popq %r11\n"
+ "	popq %r10\n"
+ "	popq %r9\n"
+ "	popq %r8\n"
+ "	popq %rdi\n"
+ "	popq %rsi\n"
+ "	popq %rdx\n"
+ "	popq %rcx\n"
+ "	popq %rax\n"
+ "	popfq\n"
+ "	ret $128\n"
+ "	.size preempt_trampoline, .-preempt_trampoline\n"
+);
+
+/* Called from the trampoline, returns the address to resume at */
+uintptr_t preempt_resume(void)
+{
+ // read before resume_pending is cleared, threads may be redirected again then
+ uintptr_t pc = resume_pc;
+ resume_pending = 0;
+ preemptions++;
+ uthread_yield(); //forces a yield
+ return pc;
+}
+
+/* Makes an interrupted thread resume in the trampoline instead, returns false
+   if it cannot be switched out there */
+static bool redirect(ucontext_t *uc)
+{
+  uintptr_t pc = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+  if (resume_pending || unsafe_pc(pc))
+    return false;
+  resume_pc = pc;
+  resume_pending = 1;
+  uc->uc_mcontext.gregs[REG_RSP] -= 128; //skip the red zone
+  uc->uc_mcontext.gregs[REG_RIP] = (greg_t)(uintptr_t)preempt_trampoline;
+  if (preempt_mode == UTHREAD_PREEMPT_SIGNAL)
+    sigaddset(&uc->uc_sigmask, SIGVTALRM); //keep ticks out until the yield
+  return true;
+}
+#elif defined(__aarch64__)
+/*
+* Preemption trampoline
+*
+* A branch back to the interrupted instruction would need a free register, and
+* any of them may be live (x16 and x17 within PLT stubs for instance). The
+* trampoline returns through rt_sigreturn instead, which restores every
+* register, the FP/SIMD state and the signal mask from a signal frame. It
+* reuses the frame of the tick: the handler stashes the interrupted pc and sp
+* in its siginfo, which rt_sigreturn ignores, and makes the thread resume in
+* preempt_trampoline right on top of the frame, with SIGVTALRM still blocked.
+* The trampoline yields through preempt_resume(), which puts the interrupted
+* context back in the frame before rt_sigreturn.
+*/
+struct preempt_frame;
+
+void preempt_resume(struct preempt_frame *frame)
+  __attribute__((visibility("hidden")));
+
+/* Frame of a signal, laid out as struct rt_sigframe */
+struct preempt_frame {
+  union {
+    siginfo_t info;
+    struct {
+      uintptr_t pc;
+      uintptr_t sp;
+      int masked; // SIGVTALRM was added to the mask by the redirect
+    } saved;
+  };
+  ucontext_t uc;
+};
+
+extern char preempt_trampoline[];
+
+__asm__(
+ "	.text\n"
+ "	.p2align 2\n"
+ "	.globl preempt_trampoline\n"
+ "	.hidden preempt_trampoline\n"
+ "	.type preempt_trampoline, %function\n"
+ "preempt_trampoline:\n"
+ "	hint #38\n" // bti jc, the interrupted code may have just branched
+ "	mov x0, sp\n" // the frame, kept above the calls
+ "	bl preempt_resume\n"
+ "	mov x8, #139\n" // __NR_rt_sigreturn, with sp back on the frame
+ "	svc #0\n"
+ "	.size preempt_trampoline, .-preempt_trampoline\n"
+);
+
+/* Called from the trampoline, restores the interrupted context in @frame */
+void preempt_resume(struct preempt_frame *frame)
+{
+ uintptr_t pc = frame->saved.pc;
+ uintptr_t sp = frame->saved.sp;
+ int masked = frame->saved.masked;
+ preemptions++;
+ uthread_yield(); //forces a yield
+ frame->uc.uc_mcontext.pc = pc;
+ frame->uc.uc_mcontext.sp = sp;
+ if (masked)
+   sigdelset(&frame->uc.uc_sigmask, SIGVTALRM);
+}
+
+/* Makes an interrupted thread resume in the trampoline instead, returns false
+   if it cannot be switched out there */
+static bool redirect(ucontext_t *uc)
+{
+  uintptr_t pc = (uintptr_t)uc->uc_mcontext.pc;
+  // a tick interrupting the handler of another signal may see it redirected
+  if (pc == (uintptr_t)preempt_trampoline || unsafe_pc(pc))
+    return false;
+  struct preempt_frame *frame = (struct preempt_frame *)
+    ((char *)uc - offsetof(struct preempt_frame, uc));
+  frame->saved.pc = pc;
+  frame->saved.sp = (uintptr_t)uc->uc_mcontext.sp;
+  frame->saved.masked = preempt_mode == UTHREAD_PREEMPT_SIGNAL;
+  uc->uc_mcontext.sp = (uintptr_t)frame;
+  uc->uc_mcontext.pc = (uintptr_t)preempt_trampoline;
+  if (preempt_mode == UTHREAD_PREEMPT_SIGNAL)
+    sigaddset(&uc->uc_sigmask, SIGVTALRM); //keep ticks out until the yield
+  return true;
+}
+#else
+#error "preemption needs a trampoline on this architecture, build with UTHREAD_PREEMPT=0"
+#endif
+
+static void alarm_handler(int signum, siginfo_t *info, void *ucontext) //signal handler function
+{
+ (void)info;
+ if (signum != SIGVTALRM)
+   return;
+ ticks++;
+
+ /* In polling mode the thread yields at its next checkpoint */
+ if (preempt_mode == UTHREAD_PREEMPT_POLL) {
+   uthread_preempt_requested = 1;
+   return;
+ }
+
+ /* Resume in the trampoline instead, which yields out of signal context */
+ if (redirect((ucontext_t *)ucontext))
+   return;
+ /* Cannot preempt here: try again shortly, or at the next library call */
+ uthread_preempt_requested = 1;
+ retry_soon();
+}
+
+/* Tells if the path of a loaded object names a library that must not be
+   preempted, from unsafe_libs or the names in @extra (see UNSAFE_ENV) */
+static bool unsafe_name(const char *name, const char *extra)
+{
+ for (int i = 0; unsafe_libs[i] != NULL; i++)
+   if (strstr(name, unsafe_libs[i]) != NULL)
+     return true;
+ while (extra != NULL && *extra != '\0') {
+   const char *end = strchrnul(extra, ':');
+   size_t len = end - extra;
+   for (const char *p = name; len > 0 && *p != '\0'; p++)
+     if (strncmp(p, extra, len) == 0)
+       return true;
+   extra = (*end == ':') ? end + 1 : end;
+ }
+ return false;
+}
+
+/* dl_iterate_phdr() callback recording the code of the libraries that must not
+   be preempted, @arg holds the value of UNSAFE_ENV */
+static int find_unsafe(struct dl_phdr_info *info, size_t size, void *arg)
+{
+ (void)size;
+ const char *name = info->dlpi_name;
+ if (name == NULL || !unsafe_name(name, arg))
+   return 0; //not a library we have to protect
+
+ for (int i = 0; i < info->dlpi_phnum && nb_unsafe < MAX_UNSAFE; i++) {
+   const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+   if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X)) {
+     unsafe[nb_unsafe].start = info->dlpi_addr + phdr->p_vaddr;
+     unsafe[nb_unsafe].end = unsafe[nb_unsafe].start + phdr->p_memsz;
+     nb_unsafe++;
+   }
+ }
+ return 0;
+}
+
+/* Tells if an interrupted instruction is in code that must not be preempted */
+static bool unsafe_pc(uintptr_t pc)
+{
+ for (int i = 0; i < nb_unsafe; i++)
+   if (pc >= unsafe[i].start && pc < unsafe[i].end)
+     return true;
+ return false;
+}
+
+/* Makes the next tick come early, keeping the regular period afterwards */
+static void retry_soon(void)
+{
+ struct itimerval timer_settings;
+ timer_settings.it_value.tv_sec = 0;
+ timer_settings.it_value.tv_usec = RETRY_USEC;
+ timer_settings.it_interval.tv_sec = 0;
+ timer_settings.it_interval.tv_usec = 1000000 / HZ;
+ setitimer(ITIMER_VIRTUAL, &timer_settings, NULL); //system call, signal safe
+}
 
-static void alarm_handler(int signum) { //signal handler function
- if (signum == SIGVTALRM)
-   uthread_yield(); //forces a yield
+int preempt_set_mode(enum uthread_preempt_mode mode)
+{
+  if (mode != UTHREAD_PREEMPT_SIGNAL && mode != UTHREAD_PREEMPT_POLL)
+    return -1;
+  preempt_mode = mode;
+  return 0;
 }
 
 void preempt_disable(void)
 {
-  sigprocmask(SIG_BLOCK, &set, NULL); //blocks SIGVTALRM
+  /* Ticks never switch threads in polling mode, no need to mask them */
+  if (preempt_mode == UTHREAD_PREEMPT_SIGNAL)
+    sigprocmask(SIG_BLOCK, &set, NULL); //blocks SIGVTALRM
+  else
+    poll_masked = 1; // only for preempt_force()
 }
 
 void preempt_enable(void)
 {
-  sigprocmask(SIG_UNBLOCK, &set, NULL); //unblocks SIGVTALRM
+  /* Honor a tick that could not preempt the thread when it fired */
+  int preempt = uthread_preempt_requested;
+  if (preempt) {
+    uthread_preempt_requested = 0;
+    preemptions++; // counted while ticks are still blocked
+  }
+  if (preempt_mode == UTHREAD_PREEMPT_SIGNAL)
+    sigprocmask(SIG_UNBLOCK, &set, NULL); //unblocks SIGVTALRM
+  else
+    poll_masked = 0;
+  if (preempt)
+    uthread_yield();
+}
+
+unsigned long preempt_preemptions(void)
+{
+  return preemptions;
+}
+
+unsigned long preempt_ticks(void)
+{
+  return ticks;
+}
+
+int preempt_masked(void *ucontext)
+{
+  if (preempt_mode == UTHREAD_PREEMPT_POLL)
+    return poll_masked;
+  return sigismember(&((ucontext_t *)ucontext)->uc_sigmask, SIGVTALRM);
+}
+
+int preempt_force(void *ucontext)
+{
+  /* A thread in a critical section of the library stays there */
+  if (!preempt_masked(ucontext) && redirect((ucontext_t *)ucontext))
+    return 0;
+  uthread_preempt_requested = 1;
+  if (preempt_mode == UTHREAD_PREEMPT_SIGNAL)
+    retry_soon();
+  return -1;
+}
+
+void preempt_unmask(void *ucontext)
+{
+  if (preempt_mode == UTHREAD_PREEMPT_POLL)
+    return; // ticks are never masked
+  /* The tick coming shortly preempts it, as if preemption was enabled */
+  sigdelset(&((ucontext_t *)ucontext)->uc_sigmask, SIGVTALRM);
+  uthread_preempt_requested = 1;
+  retry_soon();
+}
+
+void *preempt_interrupted(void *ucontext)
+{
+  /* A signal delivered along with a tick runs before the first instruction of
+     the tick handler, which holds the context of the thread in its third
+     argument */
+  ucontext_t *uc = ucontext;
+#if defined(__x86_64__)
+  if (uc->uc_mcontext.gregs[REG_RIP] == (greg_t)(uintptr_t)alarm_handler)
+    return (void *)uc->uc_mcontext.gregs[REG_RDX];
+#elif defined(__aarch64__)
+  if (uc->uc_mcontext.pc == (uintptr_t)alarm_handler)
+    return (void *)uc->uc_mcontext.regs[2];
+#endif
+  return ucontext;
 }
 
 void preempt_start(void)
@@ -39,12 +456,25 @@ void preempt_start(void)
  sigemptyset(&set); //make set of signals empty
  sigaddset(&set,SIGVTALRM); //add SIGVTALRM to signal set
 
+ nb_unsafe = 0; //found again if preemption starts over
+
+ /*Find the code that must never be preempted, by a tick in signal mode or
+   by preempt_force() in both modes*/
+ dl_iterate_phdr(find_unsafe, getenv(UNSAFE_ENV));
+#if defined(__x86_64__)
+ unsigned int eax, ebx, ecx, edx;
+ if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_OSXSAVE) &&
+     __get_cpuid_count(0xd, 0, &eax, &ebx, &ecx, &edx))
+   preempt_xsave_size = ebx; //size for the features enabled by the OS
+#endif
+
  /*Setup for timer handler*/
  struct sigaction handle_specs; //contains specifications for handling
  memset(&handle_specs, 0, sizeof(handle_specs)); //sets all specifications to 0
- handle_specs.sa_handler = &alarm_handler; //function handler to call
+ handle_specs.sa_sigaction = &alarm_handler; //function handler to call
+ handle_specs.sa_flags = SA_SIGINFO | SA_RESTART; //get the interrupted context
 
- sigaction(SIGVTALRM, &handle_specs, NULL); // sets up signal handler
+ sigaction(SIGVTALRM, &handle_specs, &old_action); // sets up signal handler
 
  /*Configuring Timer*/
  // 100Hz -> T = 10ms = 10000us
@@ -52,13 +482,31 @@ void preempt_start(void)
 
  //the first alarm turns on after 10000us
  timer_settings.it_value.tv_sec = 0;
- timer_settings.it_value.tv_usec = 10000;
+ timer_settings.it_value.tv_usec = 1000000 / HZ;
 
  //the period is set to 10000us
  timer_settings.it_interval.tv_sec = 0;
- timer_settings.it_interval.tv_usec = 10000;
+ timer_settings.it_interval.tv_usec = 1000000 / HZ;
 
  if (setitimer(ITIMER_VIRTUAL, &timer_settings, NULL) != 0) //starting the timer
    printf("timer setup error\n");
 
 }
+
+void preempt_stop(void)
+{
+ /*Stopping the timer*/
+ struct itimerval timer_settings;
+ memset(&timer_settings, 0, sizeof(timer_settings)); //zero disarms it
+ setitimer(ITIMER_VIRTUAL, &timer_settings, NULL);
+
+ /*Discarding a pending tick, then restoring the previous handler*/
+ struct sigaction ignore_specs;
+ memset(&ignore_specs, 0, sizeof(ignore_specs));
+ ignore_specs.sa_handler = SIG_IGN;
+ sigaction(SIGVTALRM, &ignore_specs, NULL);
+ sigaction(SIGVTALRM, &old_action, NULL);
+ uthread_preempt_requested = 0;
+}
+
+#endif /* UTHREAD_PREEMPT */
@@ -1,22 +1,200 @@
 #ifndef _PREEMPT_H
 #define _PREEMPT_H
 
+/*
+ * UTHREAD_PREEMPT - Preemption build switch
+ *
+ * The library is built with preemption unless UTHREAD_PREEMPT is defined to 0
+ * (`make UTHREAD_PREEMPT=0` builds libuthread-coop.a). In that cooperative-only
+ * variant threads only switch when they call the library, no timer or signal
+ * handler is installed and the functions below compile to nothing.
+ *
+ * Preemption needs a trampoline written for the architecture, see preempt.c:
+ * it exists for x86-64 and aarch64, elsewhere only the cooperative variant
+ * builds.
+ */
+#ifndef UTHREAD_PREEMPT
+#define UTHREAD_PREEMPT 1
+#endif
+
+#include "uthread.h"
+
+#if UTHREAD_PREEMPT
+
+/*
+ * preempt_set_mode - Select how ticks preempt threads
+ * @mode: UTHREAD_PREEMPT_SIGNAL or UTHREAD_PREEMPT_POLL
+ *
+ * Must be called before preempt_start().
+ *
+ * Return: -1 if @mode is invalid, 0 otherwise
+ */
+int preempt_set_mode(enum uthread_preempt_mode mode);
+
 /*
  * preempt_start - Start thread preemption
  *
  * Configure a timer that must fire a virtual alarm at a frequency of 100 Hz and
  * setup a timer handler that forcefully yields the currently running thread.
+ *
+ * The handler never switches threads from signal context. It redirects the
+ * interrupted thread to a trampoline that yields once the handler returned. A
+ * tick landing in non-reentrant code is deferred instead, and retried shortly
+ * or at the next preempt_enable().
+ *
+ * Non-reentrant code is the one of the libraries loaded when preemption starts
+ * whose path contains the name of the C library, the dynamic loader,
+ * libpthread, libstdc++, libgcc_s, jemalloc, tcmalloc or mimalloc, or one of
+ * the names listed in UTHREAD_PREEMPT_UNSAFE, separated by colons (for instance
+ * UTHREAD_PREEMPT_UNSAFE=libfoo.so:libbar). Libraries loaded later are not
+ * protected, nor is non-reentrant code linked into the program itself (a
+ * static allocator for instance): such programs should use the polling mode.
+ *
+ * In polling mode, the handler only sets uthread_preempt_requested and the
+ * running thread yields at its next checkpoint or preempt_enable().
  */
 void preempt_start(void);
 
+/*
+ * preempt_stop - Stop thread preemption
+ *
+ * Disarm the timer, discard a pending tick and restore the handler which was
+ * installed before preempt_start(). Preemption may be started again.
+ */
+void preempt_stop(void);
+
 /*
  * preempt_enable - Enable preemption
+ *
+ * Yields if a tick was deferred while preemption could not take place, or in
+ * polling mode if a tick fired since the last check.
  */
 void preempt_enable(void);
 
+/*
+ * preempt_preemptions - Count preemptions
+ *
+ * Return: Number of times a tick made the running thread yield
+ */
+unsigned long preempt_preemptions(void);
+
 /*
  * preempt_disable - Disable preemption
+ *
+ * Masks nothing in polling mode, where ticks never switch threads by
+ * themselves, but still keeps preempt_force() away.
  */
 void preempt_disable(void);
 
+/*
+ * preempt_ticks - Count ticks
+ *
+ * May be called from any system thread.
+ *
+ * Return: Number of ticks handled since the start, in both modes
+ */
+unsigned long preempt_ticks(void);
+
+/*
+ * preempt_masked - Tell if an interrupted thread has preemption disabled
+ * @ucontext: Context of the thread, as given to a signal handler
+ *
+ * Return: Nonzero if the thread was between preempt_disable() and
+ * preempt_enable(), or had ticks masked otherwise in signal mode. 0 otherwise.
+ */
+int preempt_masked(void *ucontext);
+
+/*
+ * preempt_force - Make an interrupted thread yield
+ * @ucontext: Context of the thread, as given to a signal handler
+ *
+ * From a signal handler, makes the interrupted thread yield once the handler
+ * returns, through the same trampoline as a tick, in both modes. A thread with
+ * preemption disabled or in non-reentrant code yields at its next
+ * preempt_enable() or checkpoint instead.
+ *
+ * Return: 0 if the thread yields right after the handler, -1 if later
+ */
+int preempt_force(void *ucontext);
+
+/*
+ * preempt_unmask - Enable preemption again in an interrupted thread
+ * @ucontext: Context of the thread, as given to a signal handler
+ *
+ * For a thread left with preemption disabled by mistake: ticks are unmasked
+ * when the handler returns, and the next one comes shortly to preempt it. Does
+ * nothing in polling mode.
+ */
+void preempt_unmask(void *ucontext);
+
+/*
+ * preempt_interrupted - Find the context of an interrupted thread
+ * @ucontext: Context interrupted by a signal, as given to its handler
+ *
+ * A signal coming at the same time as a tick, such as the ones of other timers
+ * expiring on the same kernel tick, interrupts the tick handler as it starts.
+ *
+ * Return: The context interrupted by the tick in that case, @ucontext otherwise
+ */
+void *preempt_interrupted(void *ucontext);
+
+#else /* !UTHREAD_PREEMPT */
+
+static inline int preempt_set_mode(enum uthread_preempt_mode mode)
+{
+	(void)mode;
+	return -1; // there is no timer to configure
+}
+
+static inline void preempt_start(void)
+{
+}
+
+static inline void preempt_stop(void)
+{
+}
+
+static inline void preempt_enable(void)
+{
+}
+
+static inline void preempt_disable(void)
+{
+}
+
+static inline unsigned long preempt_preemptions(void)
+{
+	return 0;
+}
+
+static inline unsigned long preempt_ticks(void)
+{
+	return 0;
+}
+
+static inline int preempt_masked(void *ucontext)
+{
+	(void)ucontext;
+	return 0;
+}
+
+static inline int preempt_force(void *ucontext)
+{
+	(void)ucontext;
+	uthread_preempt_requested = 1; // honored at the next checkpoint
+	return -1;
+}
+
+static inline void preempt_unmask(void *ucontext)
+{
+	(void)ucontext;
+}
+
+static inline void *preempt_interrupted(void *ucontext)
+{
+	return ucontext;
+}
+
+#endif /* UTHREAD_PREEMPT */
+
 #endif /* _PREEMPT_H */
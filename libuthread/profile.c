@@ -0,0 +1,314 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "preempt.h"
+#include "profile.h"
+
+/* A sample: the running thread, and the frames it was in, innermost first */
+struct profile_sample {
+  uthread_t tid;
+  unsigned short depth;
+  uintptr_t pcs[PROFILE_DEPTH];
+};
+
+/* Settings, fixed while sampling */
+static profile_inspect_t inspect = NULL;
+static pthread_t sched_thread; // system thread running the threads
+static uintptr_t sched_lo, sched_hi; // bounds of its stack
+static struct sigaction old_action; // handler of SIGPROF before
+static int perf_fd = -1; // event sending SIGPROF, -1 if ITIMER_PROF does
+static int running = 0;
+
+/* Samples, only appended to by the handler: the first count ones are
+   complete. The first resolved ones hold function addresses, see
+   profile_write(). */
+static struct profile_sample* samples = NULL;
+static unsigned long max_samples = 0;
+static unsigned long count = 0;
+static unsigned long resolved = 0;
+static unsigned long dropped = 0;
+
+/* Records the running thread and its frames, following the chain of frame
+   pointers within the stack the thread was interrupted on */
+static void profile_handler(int signum, siginfo_t* info, void* ucontext)
+{
+  (void)signum;
+  (void)info;
+  if (!pthread_equal(pthread_self(), sched_thread))
+    return; // some other system thread spent the CPU time
+  unsigned long slot = count;
+  if (slot >= max_samples) {
+    dropped++;
+    return;
+  }
+  struct profile_sample* sample = &samples[slot];
+  uintptr_t pc, sp, fp;
+  // not the tick handler, if it was interrupted as it started
+  profile_regs(preempt_interrupted(ucontext), &pc, &sp, &fp);
+  uintptr_t lo, hi;
+  sample->tid = inspect(sp, &lo, &hi);
+  if (lo == 0 && sp >= sched_lo && sp < sched_hi) {
+    lo = sched_lo;
+    hi = sched_hi;
+  }
+  sample->depth = profile_unwind(pc, sp, fp, lo, hi, sample->pcs,
+                                 PROFILE_DEPTH);
+  __atomic_store_n(&count, slot + 1, __ATOMIC_RELEASE);
+}
+
+void profile_regs(const ucontext_t* uc, uintptr_t* pc, uintptr_t* sp,
+                  uintptr_t* fp)
+{
+#if defined(__x86_64__)
+  *pc = uc->uc_mcontext.gregs[REG_RIP];
+  *sp = uc->uc_mcontext.gregs[REG_RSP];
+  *fp = uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+  *pc = uc->uc_mcontext.pc;
+  *sp = uc->uc_mcontext.sp;
+  *fp = uc->uc_mcontext.regs[29];
+#else
+  // no unwinding
+  (void)uc;
+  *pc = *sp = *fp = 0;
+#endif
+}
+
+int profile_unwind(uintptr_t pc, uintptr_t sp, uintptr_t fp, uintptr_t lo,
+                   uintptr_t hi, uintptr_t* pcs, int max)
+{
+  int depth = 0;
+  if (pc != 0 && depth < max)
+    pcs[depth++] = pc;
+  // each frame holds the previous frame pointer, then the return address
+  while (depth < max && fp >= sp && fp >= lo &&
+         fp + 2 * sizeof(uintptr_t) <= hi && fp % sizeof(uintptr_t) == 0) {
+    uintptr_t* frame = (uintptr_t*)fp;
+    if (frame[1] == 0)
+      break; // outermost frame
+    pcs[depth++] = frame[1];
+    if (frame[0] <= fp)
+      break; // frames are found up the stack, or it is not a frame
+    fp = frame[0];
+  }
+  return depth;
+}
+
+void profile_symbol(uintptr_t pc, char* buf, size_t size)
+{
+  Dl_info info;
+  if (dladdr((void*)pc, &info) == 0 || info.dli_fname == NULL) {
+    snprintf(buf, size, "0x%lx", (unsigned long)pc);
+  } else if (info.dli_sname != NULL) {
+    snprintf(buf, size, "%s+0x%lx", info.dli_sname,
+             (unsigned long)(pc - (uintptr_t)info.dli_saddr));
+  } else {
+    const char* file = strrchr(info.dli_fname, '/');
+    snprintf(buf, size, "%s+0x%lx", (file != NULL) ? file + 1 : info.dli_fname,
+             (unsigned long)(pc - (uintptr_t)info.dli_fbase));
+  }
+}
+
+/* Opens a clock of the CPU time the calling system thread spends in user
+   space, which sends it SIGPROF every 1/@hz s. Unlike ITIMER_PROF, it runs on a
+   high resolution timer. Returns its file descriptor, or -1 if perf events
+   are not available. */
+static int perf_open(unsigned int hz)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_SW_TASK_CLOCK;
+  attr.sample_period = 1000000000 / hz; // in ns
+  attr.wakeup_events = 1; // a signal per period
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.disabled = 1;
+  int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                   PERF_FLAG_FD_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  struct f_owner_ex owner = { F_OWNER_TID, gettid() };
+  if (fcntl(fd, F_SETOWN_EX, &owner) == -1 ||
+      fcntl(fd, F_SETSIG, SIGPROF) == -1 ||
+      fcntl(fd, F_SETFL, O_ASYNC) == -1 ||
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int profile_start(unsigned int hz, unsigned int max,
+                  profile_inspect_t fn)
+{
+  if (running || hz == 0 || hz > 1000000 || max == 0)
+    return -1;
+
+  /* Bounds of the stack of the system thread, for the main thread */
+  pthread_attr_t attr;
+  void* stack_addr;
+  size_t stack_size;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0)
+    return -1;
+  pthread_attr_getstack(&attr, &stack_addr, &stack_size);
+  pthread_attr_destroy(&attr);
+  sched_lo = (uintptr_t)stack_addr;
+  sched_hi = sched_lo + stack_size;
+
+  /* Samples of the last run are discarded */
+  free(samples);
+  samples = malloc((size_t)max * sizeof(struct profile_sample));
+  if (samples == NULL)
+    return -1;
+  max_samples = max;
+  count = resolved = dropped = 0;
+  inspect = fn;
+  sched_thread = pthread_self();
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = profile_handler;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigaddset(&action.sa_mask, SIGVTALRM); // no tick while it runs
+  sigaction(SIGPROF, &action, &old_action);
+
+  perf_fd = perf_open(hz);
+  if (perf_fd == -1) {
+    /* Expires on the ticks of the kernel only, along with the preemption
+       ticks */
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+      sigaction(SIGPROF, &old_action, NULL);
+      return -1;
+    }
+  }
+  running = 1;
+
+  return 0;
+}
+
+int profile_stop(void)
+{
+  if (!running)
+    return -1;
+
+  if (perf_fd != -1) {
+    ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    close(perf_fd);
+    perf_fd = -1;
+  } else {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+  }
+  sigaction(SIGPROF, &old_action, NULL);
+  running = 0;
+
+  return (dropped > INT_MAX) ? INT_MAX : (int)dropped;
+}
+
+/* Orders the samples by thread, then by stack */
+static int sample_cmp(const void* a, const void* b)
+{
+  const struct profile_sample* x = *(const struct profile_sample* const*)a;
+  const struct profile_sample* y = *(const struct profile_sample* const*)b;
+  if (x->tid != y->tid)
+    return (x->tid < y->tid) ? -1 : 1;
+  if (x->depth != y->depth)
+    return (x->depth < y->depth) ? -1 : 1;
+  for (int i = 0; i < x->depth; i++) {
+    if (x->pcs[i] != y->pcs[i])
+      return (x->pcs[i] < y->pcs[i]) ? -1 : 1;
+  }
+  return 0;
+}
+
+/* Writes the name of the function at @pc, or its offset in its file if it is
+   not exported */
+static void write_frame(FILE* out, uintptr_t pc)
+{
+  Dl_info info;
+  if (dladdr((void*)pc, &info) == 0 || info.dli_fname == NULL) {
+    fprintf(out, ";0x%lx", (unsigned long)pc);
+  } else if (info.dli_sname != NULL) {
+    fprintf(out, ";%s", info.dli_sname);
+  } else {
+    const char* file = strrchr(info.dli_fname, '/');
+    fprintf(out, ";%s+0x%lx", (file != NULL) ? file + 1 : info.dli_fname,
+            (unsigned long)(pc - (uintptr_t)info.dli_fbase));
+  }
+}
+
+int profile_write(int fd)
+{
+  if (running)
+    return -1;
+
+  unsigned long n = __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+  /* Frames are replaced by the address of their function, so that the
+     samples taken anywhere in the same functions fold together. Return
+     addresses may follow the last instruction of a function. */
+  for (unsigned long i = resolved; i < n; i++) {
+    for (int j = 0; j < samples[i].depth; j++) {
+      uintptr_t pc = samples[i].pcs[j];
+      Dl_info info;
+      if (dladdr((void*)(j == 0 ? pc : pc - 1), &info) != 0 &&
+          info.dli_saddr != NULL)
+        samples[i].pcs[j] = (uintptr_t)info.dli_saddr;
+    }
+  }
+  resolved = n;
+
+  struct profile_sample** sorted = malloc(n * sizeof(*sorted) + 1);
+  int out_fd = dup(fd);
+  FILE* out = (out_fd != -1) ? fdopen(out_fd, "w") : NULL;
+  if (sorted == NULL || out == NULL) {
+    free(sorted);
+    if (out != NULL)
+      fclose(out);
+    else if (out_fd != -1)
+      close(out_fd);
+    return -1;
+  }
+  for (unsigned long i = 0; i < n; i++)
+    sorted[i] = &samples[i];
+  qsort(sorted, n, sizeof(*sorted), sample_cmp);
+
+  /* A line per distinct stack: the thread, the frames outermost first, and
+     the number of samples */
+  unsigned long i = 0;
+  while (i < n) {
+    unsigned long same = 1;
+    while (i + same < n && sample_cmp(&sorted[i], &sorted[i + same]) == 0)
+      same++;
+    fprintf(out, "uthread-%u", sorted[i]->tid);
+    for (int j = sorted[i]->depth - 1; j >= 0; j--)
+      write_frame(out, sorted[i]->pcs[j]);
+    fprintf(out, " %lu\n", same);
+    i += same;
+  }
+  free(sorted);
+  if (fclose(out) != 0)
+    return -1;
+
+  return n;
+}
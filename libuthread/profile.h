@@ -0,0 +1,96 @@
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ucontext.h>
+
+#include "uthread.h"
+
+/* Most frames kept per sample, the innermost ones */
+#define PROFILE_DEPTH 32
+
+/*
+ * profile_inspect_t - Find the running thread from the signal handler
+ * @sp: Stack pointer of the interrupted code
+ * @lo: Receives the lowest address of the stack holding @sp
+ * @hi: Receives the address just above it
+ *
+ * Both bounds are 0 if @sp is in no stack known to the library, as on the
+ * stack of the system thread.
+ *
+ * Return: TID of the running thread
+ */
+typedef uthread_t (*profile_inspect_t)(uintptr_t sp, uintptr_t *lo,
+				       uintptr_t *hi);
+
+/*
+ * profile_start - Start sampling
+ * @hz: Samples per second of CPU time
+ * @max_samples: Samples kept at most
+ * @inspect: Function giving the running thread and its stack
+ *
+ * Must be called from the system thread running the threads: samples taken
+ * while another system thread runs are dropped.
+ *
+ * Return: -1 if the profiler already runs or in case of failure, 0 otherwise
+ */
+int profile_start(unsigned int hz, unsigned int max_samples,
+		  profile_inspect_t inspect);
+
+/*
+ * profile_stop - Stop sampling, keeping the samples
+ *
+ * Return: -1 if the profiler does not run, the number of samples dropped for
+ * lack of room otherwise
+ */
+int profile_stop(void);
+
+/*
+ * profile_write - Write the samples as folded stacks
+ * @fd: File descriptor to write to
+ *
+ * Return: -1 if the profiler runs or in case of failure, the number of
+ * samples written otherwise
+ */
+int profile_write(int fd);
+
+/*
+ * profile_regs - Read the registers locating code in a context
+ * @uc: Context interrupted by a signal, or saved by a switch
+ * @pc: Receives the address of its next instruction
+ * @sp: Receives its stack pointer
+ * @fp: Receives its frame pointer
+ *
+ * All three are 0 on architectures without unwinding.
+ */
+void profile_regs(const ucontext_t *uc, uintptr_t *pc, uintptr_t *sp,
+		  uintptr_t *fp);
+
+/*
+ * profile_unwind - Follow the frame pointers of a stack
+ * @pc: Address of the next instruction
+ * @sp: Stack pointer
+ * @fp: Frame pointer
+ * @lo: Lowest address of the stack
+ * @hi: Address just above it, no frame is read outside of the stack
+ * @pcs: Receives @pc then the return addresses, innermost first
+ * @max: Room in @pcs
+ *
+ * Async-signal-safe.
+ *
+ * Return: Number of addresses written to @pcs
+ */
+int profile_unwind(uintptr_t pc, uintptr_t sp, uintptr_t fp, uintptr_t lo,
+		   uintptr_t hi, uintptr_t *pcs, int max);
+
+/*
+ * profile_symbol - Name the code at an address
+ * @pc: Address
+ * @buf: Receives "function+0xoffset", or "file+0xoffset" if the function is
+ *	not exported, or the address alone
+ * @size: Size of @buf
+ */
+void profile_symbol(uintptr_t pc, char *buf, size_t size);
+
+#endif /* _PROFILE_H */
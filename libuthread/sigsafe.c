@@ -0,0 +1,54 @@
+#include <errno.h>
+#include <unistd.h>
+
+#include "sigsafe.h"
+
+void sigsafe_str(struct sigsafe_line* line, const char* str)
+{
+  while (*str != '\0' && line->len < SIGSAFE_LINE)
+    line->buf[line->len++] = *str++;
+}
+
+/* Appends @value in @base, digits found from the lowest one */
+static void sigsafe_number(struct sigsafe_line* line, unsigned long long value,
+                           unsigned int base)
+{
+  static const char digits[] = "0123456789abcdef";
+  char buf[24]; // 20 decimal digits at most
+  int len = 0;
+  do {
+    buf[len++] = digits[value % base];
+    value /= base;
+  } while (value != 0);
+  while (len > 0 && line->len < SIGSAFE_LINE)
+    line->buf[line->len++] = buf[--len];
+}
+
+void sigsafe_dec(struct sigsafe_line* line, unsigned long long value)
+{
+  sigsafe_number(line, value, 10);
+}
+
+void sigsafe_hex(struct sigsafe_line* line, unsigned long long value)
+{
+  sigsafe_str(line, "0x");
+  sigsafe_number(line, value, 16);
+}
+
+int sigsafe_write(struct sigsafe_line* line, int fd)
+{
+  int done = 0;
+  while (done < line->len) {
+    ssize_t ret = write(fd, line->buf + done, line->len - done);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret <= 0) {
+      line->len = 0;
+      return -1;
+    }
+    done += ret;
+  }
+  line->len = 0;
+
+  return 0;
+}
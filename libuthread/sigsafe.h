@@ -0,0 +1,51 @@
+#ifndef _SIGSAFE_H
+#define _SIGSAFE_H
+
+/* Most bytes of a line, longer ones are truncated */
+#define SIGSAFE_LINE 256
+
+/*
+ * struct sigsafe_line - Line written from a signal handler
+ * @buf: Bytes of the line
+ * @len: Number of bytes in @buf
+ *
+ * Signal handlers may not use stdio, nor any function of the printf() family:
+ * they build their lines with the functions below, which are all
+ * async-signal-safe, and write them with write(2).
+ */
+struct sigsafe_line {
+	char buf[SIGSAFE_LINE];
+	int len;
+};
+
+/*
+ * sigsafe_str - Append a string to a line
+ * @line: Line to append to
+ * @str: String to append
+ */
+void sigsafe_str(struct sigsafe_line *line, const char *str);
+
+/*
+ * sigsafe_dec - Append a number in decimal to a line
+ * @line: Line to append to
+ * @value: Number to append
+ */
+void sigsafe_dec(struct sigsafe_line *line, unsigned long long value);
+
+/*
+ * sigsafe_hex - Append a number in hexadecimal, after 0x, to a line
+ * @line: Line to append to
+ * @value: Number to append
+ */
+void sigsafe_hex(struct sigsafe_line *line, unsigned long long value);
+
+/*
+ * sigsafe_write - Write a line, and empty it
+ * @line: Line to write
+ * @fd: File descriptor to write to
+ *
+ * Return: -1 in case of error (errno is set), 0 otherwise
+ */
+int sigsafe_write(struct sigsafe_line *line, int fd);
+
+#endif /* _SIGSAFE_H */
@@ -0,0 +1,128 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+/* Submission and completion rings, shared with the kernel */
+static int ring_fd = -1;
+static unsigned* sq_head;
+static unsigned* sq_tail;
+static unsigned* sq_mask;
+static unsigned* sq_array;
+static struct io_uring_sqe* sqes;
+static unsigned* cq_head;
+static unsigned* cq_tail;
+static unsigned* cq_mask;
+static struct io_uring_cqe* cqes;
+static unsigned sq_entries;
+static unsigned sqe_tail = 0; // entries queued, published by uring_submit()
+static unsigned sqe_submitted = 0; // entries handed to the kernel
+
+int uring_init(unsigned entries)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0)
+    return -1; // not supported or not allowed
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    close(fd);
+    return -1; // kernels before 5.4, not worth supporting
+  }
+
+  /* Both rings share a mapping, the entries have their own */
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes +
+                   params.cq_entries * sizeof(struct io_uring_cqe);
+  size_t ring_size = (sq_size > cq_size) ? sq_size : cq_size;
+  char* ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  void* entries_map = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           fd, IORING_OFF_SQES);
+  if (entries_map == MAP_FAILED) {
+    munmap(ring, ring_size);
+    close(fd);
+    return -1;
+  }
+
+  sq_head = (unsigned*)(ring + params.sq_off.head);
+  sq_tail = (unsigned*)(ring + params.sq_off.tail);
+  sq_mask = (unsigned*)(ring + params.sq_off.ring_mask);
+  sq_array = (unsigned*)(ring + params.sq_off.array);
+  cq_head = (unsigned*)(ring + params.cq_off.head);
+  cq_tail = (unsigned*)(ring + params.cq_off.tail);
+  cq_mask = (unsigned*)(ring + params.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe*)(ring + params.cq_off.cqes);
+  sqes = entries_map;
+  sq_entries = params.sq_entries;
+  sqe_tail = sqe_submitted = *sq_tail;
+  ring_fd = fd;
+
+  return 0;
+}
+
+int uring_fd(void)
+{
+  return ring_fd;
+}
+
+struct io_uring_sqe *uring_get_sqe(void)
+{
+  unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+  if (sqe_tail - head >= sq_entries)
+    return NULL; // the kernel did not consume enough entries yet
+
+  unsigned index = sqe_tail & *sq_mask;
+  struct io_uring_sqe* sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[index] = index;
+  sqe_tail++;
+
+  return sqe;
+}
+
+int uring_submit(void)
+{
+  unsigned count = sqe_tail - sqe_submitted;
+  if (count == 0)
+    return 0;
+
+  // the entries must be visible before the kernel sees the new tail
+  __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+  int ret;
+  do {
+    ret = syscall(__NR_io_uring_enter, ring_fd, count, 0, 0, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+  if (ret < 0)
+    return -1;
+  sqe_submitted += ret;
+
+  return ret;
+}
+
+int uring_reap(void (*complete)(void *data, int res))
+{
+  unsigned head = *cq_head;
+  unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+  int count = 0;
+
+  while (head != tail) {
+    struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+    complete((void*)(uintptr_t)cqe->user_data, cqe->res);
+    head++;
+    count++;
+  }
+  // hand the entries back to the kernel once read
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+  return count;
+}
@@ -0,0 +1,53 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <linux/io_uring.h>
+
+/*
+ * uring_init - Set up the io_uring instance
+ * @entries: Number of submission queue entries
+ *
+ * Return: -1 if io_uring is not available (old kernel, seccomp filter...), 0
+ * otherwise
+ */
+int uring_init(unsigned entries);
+
+/*
+ * uring_fd - Get the file descriptor of the ring
+ *
+ * The descriptor is readable when completions are waiting to be reaped.
+ *
+ * Return: File descriptor of the ring
+ */
+int uring_fd(void);
+
+/*
+ * uring_get_sqe - Get a free submission queue entry
+ *
+ * The entry is queued, but only handed to the kernel by the next
+ * uring_submit(). It must be filled before that.
+ *
+ * Return: Zeroed entry, or NULL if the submission queue is full
+ */
+struct io_uring_sqe *uring_get_sqe(void);
+
+/*
+ * uring_submit - Submit the queued entries
+ *
+ * Hand every entry queued since the last submission to the kernel at once,
+ * without waiting for any completion.
+ *
+ * Return: -1 in case of failure, the number of entries submitted otherwise
+ */
+int uring_submit(void);
+
+/*
+ * uring_reap - Reap completions
+ * @complete: Function called with the user data and the result of each
+ *	completion
+ *
+ * Return: Number of completions reaped
+ */
+int uring_reap(void (*complete)(void *data, int res));
+
+#endif /* _URING_H */
@@ -0,0 +1,172 @@
+"""gdb command dumping the threads of libuthread, like uthread_dump()
+
+Works on a live process as on a core dump, which is where it helps most: gdb
+only sees the system thread, while the other threads exist as contexts saved
+in their thread data. The library must have been built with debug information
+(`make D=1`), on x86_64.
+
+    (gdb) source libuthread/uthread-gdb.py
+    (gdb) uthread-dump [max frames]
+
+The running thread is unwound by gdb from the selected system thread, which
+must be the one running the threads. The others are unwound by following the
+frame pointers from their saved context.
+"""
+
+import struct
+
+import gdb
+
+# Size of a thread stack, UTHREAD_STACK_SIZE in context.h
+STACK_SIZE = 32768
+
+# Indexes of the registers in uc_mcontext.gregs, from <sys/ucontext.h>
+REG_RBP = 10
+REG_RSP = 15
+REG_RIP = 16
+
+STATES = {
+    "THREAD_READY": "ready",
+    "THREAD_RUNNING": "running",
+    "THREAD_BLOCKED": "blocked",
+    "THREAD_THROTTLED": "throttled",
+    "THREAD_ZOMBIE": "zombie",
+}
+
+
+def symbol(pc, is_return):
+    """Names the code at pc, with its source line if known"""
+    try:
+        info = gdb.execute("info symbol 0x%x" % pc, to_string=True).strip()
+    except gdb.error:
+        info = ""
+    if info == "" or info.startswith("No symbol"):
+        name = "0x%x" % pc
+    else:
+        name = info.split(" in section ")[0].replace(" + ", "+")
+    # return addresses may follow the last instruction of the call's line
+    sal = gdb.find_pc_line(pc - 1 if is_return else pc)
+    if sal.symtab is not None:
+        name += " at %s:%d" % (sal.symtab.filename, sal.line)
+    return name
+
+
+def unwind(pc, sp, fp, lo, hi, max_frames):
+    """Follows the frame pointers from a saved context, within [lo, hi) if
+    the stack is known"""
+    inferior = gdb.selected_inferior()
+    pcs = [pc]
+    while len(pcs) < max_frames and fp >= sp and fp % 8 == 0:
+        if hi != 0 and (fp < lo or fp + 16 > hi):
+            break
+        try:
+            prev_fp, ret = struct.unpack(
+                "<QQ", bytes(inferior.read_memory(fp, 16)))
+        except gdb.MemoryError:
+            break
+        if ret == 0:
+            break  # outermost frame
+        pcs.append(ret)
+        if prev_fp <= fp:
+            break  # frames are found up the stack, or it is not a frame
+        fp = prev_fp
+    return pcs
+
+
+def thread_stack(data, sp):
+    """Finds the stack of a thread holding sp, its own or the one of a
+    generator it runs: (0, 0) if none does, as for the main thread"""
+    base = int(data["stack_pointer"])
+    gen = data["gen"]
+    while int(gen) != 0:
+        gen_base = int(gen["stack_pointer"])
+        if gen_base <= sp < gen_base + STACK_SIZE:
+            base = gen_base
+            break
+        gen = gen["prev"]
+    if base != 0 and base <= sp < base + STACK_SIZE:
+        return base, base + STACK_SIZE
+    return 0, 0
+
+
+def thread_waits(data, run_waiter):
+    """Tells what a blocked thread waits for"""
+    if int(data["TID_join"]) != 0:
+        return "join"
+    if int(data["futex"]) != 0:
+        return "futex"
+    if int(data["waiting_io"]) != 0:
+        return "I/O or sleep"
+    if int(data["waiting_msg"]) != 0:
+        return "mailbox"
+    if int(data) == run_waiter:
+        return "uthread_run"
+    return "park or group"
+
+
+class UthreadDump(gdb.Command):
+    """Dump the threads of libuthread: uthread-dump [max frames]"""
+
+    def __init__(self):
+        super().__init__("uthread-dump", gdb.COMMAND_DATA)
+
+    def invoke(self, arg, from_tty):
+        max_frames = int(arg) if arg else 32
+        table = gdb.parse_and_eval("'uthread.c'::thread_table")
+        current = int(gdb.parse_and_eval("'uthread.c'::current"))
+        run_waiter = int(gdb.parse_and_eval("'uthread.c'::run_waiter"))
+        data_type = gdb.lookup_type("thread_data").pointer()
+        if current == 0:
+            print("uthread dump: no threads")
+            return
+
+        # one read for the whole table
+        size = table.type.sizeof
+        raw = bytes(gdb.selected_inferior().read_memory(table.address, size))
+        pointers = struct.unpack("<%dQ" % (size // 8), raw)
+        threads = [gdb.Value(p).cast(data_type) for p in pointers if p != 0]
+        ready = sum(1 for d in threads if str(d["state"]) == "THREAD_READY")
+        print("uthread dump: %d threads, %d ready" % (len(threads), ready))
+        for data in threads:
+            self.dump_one(data, int(data) == current, run_waiter, max_frames)
+
+    def dump_one(self, data, running, run_waiter, max_frames):
+        state = str(data["state"])
+        gregs = data["context"]["uc_mcontext"]["gregs"]
+        if running:
+            sp = int(gdb.parse_and_eval("$sp"))
+        else:
+            sp = int(gregs[REG_RSP])
+        lo, hi = thread_stack(data, sp)
+
+        line = 'thread %d "%s": %s' % (int(data["TID"]),
+                                       data["name"].string(),
+                                       STATES.get(state, state))
+        if state == "THREAD_BLOCKED":
+            line += " (%s)" % thread_waits(data, run_waiter)
+        if int(data["TID_join"]) != 0:
+            line += ", joins %d" % int(data["TID_join"])
+        if hi != 0 and state != "THREAD_ZOMBIE":
+            line += ", stack %d/%d bytes" % (hi - sp, hi - lo)
+        if int(data["daemon"]) != 0:
+            line += ", daemon"
+        if int(data["detached"]) != 0:
+            line += ", detached"
+        print(line)
+        if state == "THREAD_ZOMBIE":
+            return  # it will not run again
+
+        if running:
+            frame = gdb.newest_frame()
+            pcs = []
+            while frame is not None and len(pcs) < max_frames:
+                pcs.append(frame.pc())
+                frame = frame.older()
+        else:
+            pcs = unwind(int(gregs[REG_RIP]), sp, int(gregs[REG_RBP]), lo,
+                         hi, max_frames)
+        for i, pc in enumerate(pcs):
+            print("  #%d %s" % (i, symbol(pc, i > 0)))
+
+
+UthreadDump()
@@ -1,311 +1,3287 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "context.h"
+#include "helper.h"
+#include "histogram.h"
+#include "metrics.h"
 #include "preempt.h"
-#include "queue.h"
+#include "profile.h"
+#include "sigsafe.h"
+#include "uring.h"
 #include "uthread.h"
+#include "watchdog.h"
 
-static int new_thread_init(uthread_t TID, uthread_func_t func, void *arg);
+typedef struct thread_data thread_data;
 
-static int uthread_init();
+typedef struct thread_list thread_list;
 
-static int TID_max(void *data, void *arg);
+typedef struct io_waiter io_waiter;
 
-static uthread_t max3(uthread_t v1, uthread_t v2, uthread_t v3);
+typedef struct io_request io_request;
 
-static int get_data(void *data, void *arg);
+typedef struct futex_waiter futex_waiter;
 
-static int get_data_TID(void *data, void *arg);
+typedef struct actor_spec actor_spec;
 
-static int get_data_TID_join(void *data, void *arg);
+static int new_thread_init(uthread_t TID, uthread_group_t group,
+                           uthread_func_t func, void *arg,
+                           uthread_init_func_t init);
 
-static void collect_thread(uthread_t TID);
+static int thread_create(uthread_group_t group, uthread_func_t func,
+                         void *arg, uthread_init_func_t init);
 
-typedef struct thread_data thread_data;
+static int scheduler_init();
+
+static void scheduler_teardown(void);
+
+static int thread_start(void* arg);
+
+static uthread_t TID_alloc(void);
+
+static void list_enqueue(thread_list* list, thread_data* data);
+
+static thread_data* list_dequeue(thread_list* list);
+
+static void list_remove(thread_list* list, thread_data* data);
+
+static void list_splice(thread_list* list, thread_data* first,
+                        thread_data* last, int count);
+
+static void ready_push(thread_data* data);
+
+static thread_data* ready_pop(void);
+
+static void ready_remove(thread_data* data);
+
+static int ready_count(void);
+
+static void heap_push(thread_list* heap, thread_data* data);
+
+static thread_data* heap_pop(thread_list* heap);
+
+static void heap_remove(thread_list* heap, thread_data* data);
+
+static uint64_t heap_key(const thread_data* data);
+
+static thread_data* heap_meld(thread_data* a, thread_data* b);
+
+static thread_data* heap_merge_pairs(thread_data* first);
+
+static void thread_charge(thread_data* data, uint64_t now);
+
+static void thread_block(thread_data* data_current);
+
+static void thread_unblock(thread_data* data);
+
+static void thread_ready(thread_data* data);
+
+static void thread_testcancel(void);
+
+static void thread_yield(void);
+
+static int group_over_quota(uthread_group_t group);
+
+static void group_refill(uint64_t now);
+
+static void group_set_quota(uthread_group_t group, unsigned long long quota,
+                            unsigned long long period);
+
+static int gen_start(void* arg);
+
+static int host_run(uint64_t deadline, int once);
+
+static void host_wake(void);
+
+static void loop_arm(void);
+
+static uint64_t now_ns(void);
+
+static void metrics_export(void);
+
+static void metrics_publish(void);
+
+static void metrics_unlink(void);
+
+static void io_wait(io_waiter* waiter);
+
+static void io_waiter_done(io_waiter* w, int ready);
+
+static void io_block(int* done);
+
+static void io_poll(int block);
+
+static int io_pending(void);
+
+static int io_wait_ready(void);
+
+static int io_start(void);
+
+static long io_submit(io_request* req);
+
+static void io_complete(void* data, int res);
+
+static void io_helper_complete(helper_request_t* req);
+
+static long io_helper_call(void* arg);
+
+static ssize_t io_run(io_request* req);
+
+static void thread_switch(thread_data* prev, thread_data* next);
+
+static void thread_switch_work(thread_data* prev, thread_data* next);
+
+static void switch_work_set(int feature, int on);
+
+static void collect_thread(thread_data* data_zombie);
+
+static void collect_detached(void);
+
+static void futex_unlink(futex_waiter* w);
+
+static int actor_start(void* arg);
+
+static void actor_init(void* mem, void* arg);
+
+/* Scheduling state of a thread */
+enum thread_state {
+  THREAD_RUNNING, // currently running, in no queue
+  THREAD_READY, // waiting in ready_q (a heap in fair mode), or in edf_q
+  THREAD_BLOCKED, // waiting in block_q
+  THREAD_THROTTLED, // ready, but its group used its quota for the period
+  THREAD_ZOMBIE // exited, waiting in zombie_q to be collected
+};
+
+/* Distance between two stacks of a batch. The extra page keeps the stacks
+   from using only every eighth set of the TLBs, and the extra cache line the
+   tops of the stacks from all mapping to the same cache sets. The padding is
+   never touched. */
+#define BATCH_STACK_STRIDE (UTHREAD_STACK_SIZE + 4096 + 64)
+
+typedef struct thread_batch thread_batch;
 
 /* Stores the data of each thread, including context. */
 struct thread_data {
   uthread_t TID; // TID of the thread
   uthread_ctx_t context; // context of the thread
   void* stack_pointer; // pointer to the top of the thread stack
-  int* return_value; // pointer to return value of join function
+  int retval; // return value of the thread, set when it exits
   int TID_join; // TID of thread to join
+  thread_data* joiner; // thread joining this one, NULL if none
+  int detached; // 1 if collected automatically when it exits
+  int daemon; // 1 if uthread_run() does not wait for it
+  int park_permit; // 1 if the next uthread_park() returns right away
+  enum thread_state state; // scheduling state of the thread
+  thread_data* prev; // previous thread in the queue of its state
+  thread_data* next; // next thread in the queue of its state
+  thread_data* child; // first child in edf_q, or in ready_q in fair mode
+  thread_batch* batch; // allocation holding this thread, NULL if its own
+  uint64_t ready_since; // time at which it became ready (in ns)
+  histogram_t* latency; // own scheduling latencies, NULL if not tracked
+  int waiting_io; // 1 while blocked waiting for I/O, unpark leaves it alone
+  uint64_t vruntime; // time run (in ns), scaled by the default over its weight
+  unsigned int weight; // share of the CPU in fair mode
+  uint64_t deadline; // absolute deadline (in ns), 0 if best effort
+  uthread_func_t func; // function of the thread
+  void* arg; // argument of the function
+  uthread_group_t group; // group of the thread, NULL if none
+  thread_data* group_prev; // previous member of its group
+  thread_data* group_next; // next member of its group
+  int canceled; // 1 once its group was canceled
+  io_waiter* waiter; // its wait in uthread_poll() or uthread_sleep_ns()
+  futex_waiter* futex; // its wait in uthread_futex_wait(), NULL if none
+  struct uthread_msg* mbox_head; // oldest message of an actor's mailbox
+  struct uthread_msg* mbox_tail; // newest message of an actor's mailbox
+  int waiting_msg; // 1 while an actor is blocked on its empty mailbox
+  arena_t arena; // objects of uthread_arena_alloc(), released when it exits
+  uthread_gen_t gen; // generator running on it, NULL if none
+  char name[UTHREAD_NAME_SIZE]; // name shown by uthread_dump(), "" if none
+  // argument built by uthread_create_inline()
+  max_align_t inline_arg[UTHREAD_INLINE_SIZE / sizeof(max_align_t)];
+};
+
+/* Thread waiting in uthread_poll() or uthread_sleep_ns(), lives on its stack
+   while it is blocked */
+struct io_waiter {
+  thread_data* thread; // waiting thread
+  struct pollfd* fds; // file descriptors it waits for
+  nfds_t nfds; // number of file descriptors
+  uint64_t deadline; // time at which it stops waiting (in ns), UINT64_MAX if never
+  int ready; // number of file descriptors with events once done
+  int done; // 1 once the wait is over
+  io_waiter* prev; // previous waiter
+  io_waiter* next; // next waiter
+};
+
+/* Operation submitted by uthread_pread() and the like, lives on the stack of
+   the thread while it is blocked */
+struct io_request {
+  thread_data* thread; // submitting thread
+  int opcode; // IORING_OP_* of the operation, or IO_OP_CALL
+  int fd; // file descriptor
+  void* buf; // buffer to read or write
+  size_t len; // length of the buffer
+  off_t offset; // offset in the file
+  int flags; // flags of send() and recv()
+  uthread_func_t func; // function of a blocking call, @buf is its argument
+  long res; // result, or -errno (except for a blocking call)
+  int error; // errno left by a blocking call, 0 if unchanged
+  int done; // 1 once completed
+  helper_request_t helper; // when run by a helper thread
 };
 
-/* Stores the data of all ready or running threads. */
-queue_t ready_q = NULL;
+/* Thread waiting in uthread_futex_wait(), lives on its stack while it is
+   blocked */
+struct futex_waiter {
+  thread_data* thread; // waiting thread
+  unsigned int* addr; // word it waits on
+  io_waiter* timeout; // its wait for the timeout, NULL if it has none
+  int woken; // 1 once woken by uthread_futex_wake()
+  futex_waiter* prev; // previous waiter of its bucket
+  futex_waiter* next; // next waiter of its bucket
+};
+
+/* Handler of an actor and its state, built in the inline argument of its
+   thread */
+struct actor_spec {
+  uthread_actor_func_t handler; // function handling each message
+  void* state; // state passed to the handler
+  int batch; // most messages handled per activation
+};
+
+/* Single allocation holding the threads of a uthread_create_n() call, their
+   stacks follow the array. Freed when its last thread is collected. */
+struct thread_batch {
+  int count; // threads of the batch not collected yet
+  thread_data threads[]; // data of each thread of the batch
+};
+
+/* Queue of threads, oldest first. The links are kept in thread_data (a thread
+   is in at most one queue) so that a thread can be taken out in O(1). */
+struct thread_list {
+  thread_data* head; // oldest thread
+  thread_data* tail; // newest thread
+  int length; // number of threads
+};
+
+/* Group of threads, which live in it until they are collected */
+struct uthread_group {
+  thread_data* members; // members, linked through group_next
+  int alive; // members that did not exit yet
+  thread_data* joiner; // thread waiting in uthread_group_join(), if any
+  int canceled; // 1 once canceled
+  uint64_t quota; // CPU time allowed per period (in ns), 0 if unlimited
+  uint64_t period; // length of a period (in ns)
+  uint64_t used; // CPU time used during the current period (in ns)
+  uint64_t period_end; // end of the current period (in ns)
+  thread_list throttled; // ready members waiting for the next period
+  uthread_group_t prev; // previous group with a quota
+  uthread_group_t next; // next group with a quota
+};
+
+/* Generator, runs on the stack it owns within the thread calling
+   uthread_gen_next() */
+struct uthread_gen {
+  uthread_ctx_t context; // context of the generator
+  uthread_ctx_t caller; // context of uthread_gen_next() while it runs
+  void* stack_pointer; // pointer to the top of its stack
+  uthread_func_t func; // function of the generator
+  void* arg; // argument of the function
+  void* value; // last value yielded
+  int running; // 1 while it runs
+  int done; // 1 once its function returned
+  uthread_gen_t prev; // generator running on the thread before this one
+};
+
+/* Most destroyed generators kept with their stack for the next ones */
+#define GEN_CACHE 64
+
+/* Thread that is currently running (it is not part of any queue). */
+static thread_data* current = NULL;
+
+/* TID of current, read by uthread_self() */
+uthread_t uthread_running = 0;
+
+/* Set on the system thread running the threads, while the library is
+   initialized: the helpers and any other system thread see it clear. */
+static __thread int on_scheduler = 0;
+
+/* Every thread that has not been collected yet, indexed by TID. */
+static thread_data* thread_table[USHRT_MAX + 1];
+
+/* Next TID to try when creating a thread */
+static uthread_t TID_next = 1;
+
+/* Stores the data of all ready threads. In round-robin, a FIFO. In fair
+   mode, a pairing heap ordered by vruntime whose root is ready_q.head: a
+   thread links to its first child through child, to its next sibling through
+   next, and to its previous sibling (or parent for a first child) through
+   prev. */
+static thread_list ready_q;
+
+/* Ready threads which have a deadline, run before any thread of ready_q.
+   A pairing heap ordered by deadline, linked like ready_q in fair mode. */
+static thread_list edf_q;
+
+/* 1 if threads picked after their deadline, before they ever ran, exit right
+   away instead of running */
+static int shedding = 0;
+
+/* Scheduling policy, fixed once the first thread is created */
+static enum uthread_sched_policy sched_policy = UTHREAD_SCHED_RR;
+
+/* Time at which the running thread was last charged (in ns) */
+static uint64_t run_since = 0;
+
+/* Fair mode: vruntime of the last thread picked, never decreasing. Threads
+   that were not ready, or new ones, start again from around there. */
+static uint64_t min_vruntime = 0;
+
+/* Thread embedding the scheduler in its own loop, which runs the others from
+   uthread_run_for() only. While it is in there (host_inside), it is blocked
+   until its guests ran out of work, time or switches. */
+static thread_data* host = NULL;
+static int host_inside = 0;
+static uint64_t host_deadline = 0;
+static unsigned long host_switches = 0;
+
+/* File descriptors of uthread_get_fd(): an epoll set, readable when a thread
+   is ready (loop_event), when the nearest deadline passed (loop_timer), or
+   when the I/O that threads wait for completes */
+static int loop_fd = -1;
+static int loop_event = -1;
+static int loop_timer = -1;
+static int loop_signaled = 0; // 1 once loop_event was written
+static uint64_t loop_timer_at = UINT64_MAX; // time loop_timer is armed for
+static int loop_ring_added = 0; // 1 once the ring is in the set
+static int loop_helper_added = 0; // 1 once the helpers are in the set
+static unsigned long loop_gen = 0; // io_waiters_gen of the set
+static uint64_t loop_waiters_deadline = UINT64_MAX; // nearest waiter deadline
+static struct epoll_event* loop_regs = NULL; // waiter fds in the set
+static int loop_nb_regs = 0;
+static int loop_regs_size = 0;
+
+/* Destroyed generators kept for reuse, linked through prev */
+static uthread_gen_t gen_cache = NULL;
+static int gen_cached = 0;
+
+/* Groups with a quota, the earliest end of their periods, and the members
+   waiting for it */
+static uthread_group_t quota_groups = NULL;
+static uint64_t next_refill = UINT64_MAX;
+static int nb_throttled = 0;
+
+/* Fair mode: vruntime credit of a waking thread, behind min_vruntime, so
+   that it runs soon without catching up on all the time it was blocked */
+#define FAIR_WAKEUP_CREDIT 10000000
 
 /*stores the data of all blocked threads*/
-queue_t block_q = NULL;
+static thread_list block_q;
 
 /*stores the data of all zombie threads*/
-queue_t zombie_q = NULL;
+static thread_list zombie_q;
+
+/* Scheduling latencies of every thread, from ready to running (in ns) */
+static histogram_t latency_global;
+
+/* Counters of the scheduler, published with the metrics */
+static uint64_t count_switches = 0;
+static uint64_t count_creates = 0;
+static uint64_t count_exits = 0;
+static uint64_t stack_bytes = 0; // stacks of the threads not collected yet
+
+/* Metrics shared with monitoring tools, NULL if not exported */
+static struct uthread_metrics* metrics = NULL;
+
+/* When other threads keep running, switches check the waiting threads at most
+   this often (in ns) */
+#define IO_POLL_INTERVAL 1000000
+
+/* Threads waiting for file descriptors or a timeout */
+static io_waiter* io_waiters = NULL;
+static nfds_t io_nb_fds = 0; // file descriptors of all the waiters
+static uint64_t io_last_poll = 0; // time of the last check (in ns)
+
+/* Array gathering the file descriptors of all the waiters, followed by the
+   ones of the ring and the helpers */
+static struct pollfd* io_fds = NULL;
+static nfds_t io_fds_size = 0;
+
+/* Entries of the ring, the most operations in flight at once */
+#define IO_RING_ENTRIES 256
+
+/* Backend of the operations: 0 until the first one, then IO_RING (io_uring)
+   or IO_HELPER (blocking calls on the helper threads) */
+#define IO_RING 1
+#define IO_HELPER 2
+static int io_backend = 0;
+
+/* Incremented whenever the set of waiters changes */
+static unsigned long io_waiters_gen = 0;
+
+/* Operation of uthread_blocking_call(), always run by a helper thread */
+#define IO_OP_CALL -1
+
+/* Operations submitted and not completed, on the ring and on the helpers */
+static unsigned io_ring_inflight = 0;
+static unsigned io_helper_inflight = 0;
+
+/* Detached zombies waiting to be collected by the next thread to run, linked
+   through their next field */
+static thread_data* detached_zombies = NULL;
+
+/* Threads waiting in uthread_futex_wait(), hashed by address into buckets
+   which each list their waiters oldest first */
+#define FUTEX_BITS 10
+static struct {
+  futex_waiter* head;
+  futex_waiter* tail;
+} futex_buckets[1 << FUTEX_BITS];
+
+/* Main thread while it waits in uthread_run(), for the threads which are not
+   daemons (nb_foreground) to exit. run_stuck is set if the threads left can
+   never run again. */
+static thread_data* run_waiter = NULL;
+static int nb_foreground = 0;
+static int run_stuck = 0;
+
+/* Work done at every switch on top of the switch itself, one bit per feature
+   which needs it: switches only test switch_work while every feature is off */
+#define SWITCH_LATENCY 0x01 // the global latency histogram records, default
+#define SWITCH_TRACKED 0x02 // some threads record their own latencies
+#define SWITCH_STARVATION 0x04 // the watchdog looks for starving threads
+#define SWITCH_FAIR 0x08 // the fair policy charges runtimes
+#define SWITCH_QUOTA 0x10 // a group has a quota, charged its runtimes
+#define SWITCH_WATCHDOG 0x20 // the watchdog samples the switches
+#define SWITCH_METRICS 0x40 // the metrics are exported
+#define SWITCH_HOOKS 0x80 // a switch hook is set
+#define SWITCH_HOST 0x100 // a host loop drives the threads
+/* Features reading when threads become ready */
+#define SWITCH_STAMPS (SWITCH_LATENCY | SWITCH_TRACKED | SWITCH_STARVATION)
+/* Features charging the runtimes */
+#define SWITCH_CHARGE (SWITCH_FAIR | SWITCH_QUOTA)
+static int switch_work = SWITCH_LATENCY;
+
+/* Threads with their own latency histogram, not collected yet */
+static int nb_tracked = 0;
+
+/* Hooks of uthread_set_switch_hooks() */
+static uthread_switch_hook_t hook_switch_out = NULL;
+static uthread_switch_hook_t hook_switch_in = NULL;
+static uthread_create_hook_t hook_create = NULL;
+static uthread_exit_hook_t hook_exit = NULL;
+static void* hook_userdata = NULL;
 
 /* Initializes a new thread and places it in the ready_q */
-static int new_thread_init(uthread_t TID, uthread_func_t func, void *arg)
+static int new_thread_init(uthread_t TID, uthread_group_t group,
+                           uthread_func_t func, void *arg,
+                           uthread_init_func_t init)
 {
+  /* Allocations are done with preemption disabled since other threads may
+     allocate too, and the context saves the signal mask so it is created
+     masked: the new thread enables it in uthread_ctx_bootstrap() */
+  preempt_disable();
   /* Initialize a new thread struct */
   void* stack_pointer = uthread_ctx_alloc_stack();
-  if (stack_pointer == NULL)
+  if (stack_pointer == NULL) {
+    preempt_enable();
     return -1; // return error if stack allocation fails
-  uthread_ctx_t new_context;
-  if (uthread_ctx_init(&new_context, stack_pointer, func, arg) != 0)
-    return -1; // return error if main initialization fails
+  }
   thread_data* new_thread = (thread_data*) malloc(sizeof(thread_data));
+  if (new_thread == NULL) {
+    uthread_ctx_destroy_stack(stack_pointer);
+    preempt_enable();
+    return -1; // return error if thread allocation fails
+  }
+  if (uthread_ctx_init(&new_thread->context, stack_pointer, thread_start,
+                       new_thread) != 0) {
+    uthread_ctx_destroy_stack(stack_pointer);
+    free(new_thread);
+    preempt_enable();
+    return -1; // return error if context initialization fails
+  }
   new_thread->TID = TID;
-  new_thread->context = new_context;
   new_thread->stack_pointer = stack_pointer;
-  new_thread->return_value = NULL;
+  new_thread->retval = 0;
   new_thread->TID_join = 0;
-  preempt_disable();
-  if (queue_enqueue(ready_q, (void*)new_thread) == -1) // enqueue thread
-    return -1; // return error if enqueuing fails
+  new_thread->joiner = NULL;
+  new_thread->detached = 0;
+  new_thread->daemon = current->daemon; // like the thread creating it
+  new_thread->park_permit = 0;
+  new_thread->batch = NULL;
+  new_thread->latency = NULL;
+  new_thread->arena = (arena_t){ NULL, NULL, NULL };
+  new_thread->gen = NULL;
+  new_thread->waiting_io = 0;
+  new_thread->vruntime = min_vruntime;
+  new_thread->weight = UTHREAD_WEIGHT_DEFAULT;
+  new_thread->deadline = 0;
+  new_thread->func = func;
+  new_thread->arg = arg;
+  if (init != NULL) {
+    /* Its argument lives in its own data, built before it can run */
+    new_thread->arg = new_thread->inline_arg;
+    init(new_thread->inline_arg, arg);
+  }
+  new_thread->group = group;
+  new_thread->canceled = 0;
+  new_thread->waiter = NULL;
+  new_thread->futex = NULL;
+  new_thread->mbox_head = new_thread->mbox_tail = NULL;
+  new_thread->waiting_msg = 0;
+  new_thread->name[0] = '\0';
+  if (group != NULL) {
+    new_thread->group_prev = NULL;
+    new_thread->group_next = group->members;
+    if (group->members != NULL)
+      group->members->group_prev = new_thread;
+    group->members = new_thread;
+    group->alive++;
+    new_thread->canceled = group->canceled;
+  }
+  thread_table[TID] = new_thread;
+  if (!new_thread->daemon)
+    nb_foreground++;
+  count_creates++;
+  if (hook_create != NULL)
+    hook_create(current->TID, TID, hook_userdata);
+  stack_bytes += UTHREAD_STACK_SIZE;
+  thread_ready(new_thread); // enqueue thread
   preempt_enable();
 
   return 0; // return 0 if no errors
 }
 
-/* Initialize queues and main thread */
-static int uthread_init()
+/* Initialize main thread */
+static int scheduler_init()
 {
   /* ready_q stores threads that are ready to be run
-     block_q stores queues that are blocked until they join another thread
+     block_q stores threads that are blocked until they join another thread
+     or are unparked
      zombie_q stores threads that exited but have not been collected */
-  ready_q = queue_create();
-  block_q = queue_create();
-  zombie_q = queue_create();
-  if (ready_q == NULL || block_q == NULL || zombie_q == NULL)
-    return -1; // return error if queue creation fails
+
+  /* The main thread runs on the process stack, its context is saved on the
+     first switch away from it */
+  thread_data* main_thread = (thread_data*) calloc(1, sizeof(thread_data));
+  if (main_thread == NULL)
+    return -1; // return error if thread allocation fails
+  main_thread->TID = 0;
+  main_thread->state = THREAD_RUNNING;
+  main_thread->weight = UTHREAD_WEIGHT_DEFAULT;
+  thread_table[0] = main_thread;
+  current = main_thread;
+  on_scheduler = 1;
+  run_since = now_ns();
   preempt_start(); // starts timer and setups signal handler
-  if (new_thread_init(0, 0, 0) == -1)
-    return -1; // return error if thread init failed
+  metrics_export(); // if requested by the environment
 
   return 0; // return 0 if no errors
 }
 
-/* Callback function that returns largest TID being used */
-static int TID_max(void *data, void *arg)
+/* First function run by every thread, sheds it if it starts too late */
+static int thread_start(void* arg)
 {
-  /* Return 1 if piece of data is a match */
-  thread_data* a = (thread_data*)data;
-  uthread_t TID_temp = a->TID; // new TID
-  uthread_t *arg_temp = (uthread_t*)arg; // stored TID
-  if (TID_temp > *arg_temp) // if new TID is larger, store it
-      *arg_temp = TID_temp;
+  thread_data* data = arg;
+  if (shedding && data->deadline != 0 && now_ns() > data->deadline)
+    return UTHREAD_SHED;
+  if (data->canceled)
+    return UTHREAD_CANCELED;
 
-  return 0; // return 0 to keep iterating through queue
+  return data->func(data->arg);
 }
 
-/* Find the largest of 3 values */
-static uthread_t max3(uthread_t v1, uthread_t v2, uthread_t v3)
+/* Returns the next unused TID, or 0 if all TIDs are in use */
+static uthread_t TID_alloc(void)
 {
-  /* Finds max between v1 and v2 */
-  uthread_t max = 0;
-  if (v1 > v2) {
-    max = v1;
-  } else {
-    max = v2;
+  for (int i = 0; i < USHRT_MAX; i++) {
+    uthread_t TID = TID_next;
+    // TIDs are handed out in increasing order, 0 is reserved for main
+    TID_next = (TID_next == USHRT_MAX) ? 1 : TID_next + 1;
+    if (thread_table[TID] == NULL)
+      return TID;
   }
-  /* Finds max between max(v1, v2) and v3 */
-  if (v3 > max)
-    max = v3;
 
-  return max; // return largest value
+  return 0; // every TID is taken
 }
 
-/* Callback function that provides thread info from queue.
-   arg = location of data node in queue */
-static int get_data(void *data, void *arg)
+/* Appends a thread to the end of a queue */
+static void list_enqueue(thread_list* list, thread_data* data)
 {
-  if (data == NULL) // variable should not be used
-    return -1;
-  if ((*(int*)arg) == 1) { // if arg = 1 then get current node
-    return 1;
-  } else {
-    (*(int*)arg)--; // else decrement arg for next loop
+  data->next = NULL;
+  data->prev = list->tail;
+  if (list->tail != NULL)
+    list->tail->next = data;
+  else
+    list->head = data;
+  list->tail = data;
+  list->length++;
+}
+
+/* Removes and returns the oldest thread of a queue, NULL if it is empty */
+static thread_data* list_dequeue(thread_list* list)
+{
+  thread_data* data = list->head;
+  if (data != NULL)
+    list_remove(list, data);
+
+  return data;
+}
+
+/* Removes a thread from anywhere in a queue */
+static void list_remove(thread_list* list, thread_data* data)
+{
+  if (data->prev != NULL)
+    data->prev->next = data->next;
+  else
+    list->head = data->next;
+  if (data->next != NULL)
+    data->next->prev = data->prev;
+  else
+    list->tail = data->prev;
+  list->length--;
+}
+
+/* Appends a chain of @count threads linked through next to a queue */
+static void list_splice(thread_list* list, thread_data* first,
+                        thread_data* last, int count)
+{
+  first->prev = list->tail;
+  last->next = NULL;
+  if (list->tail != NULL)
+    list->tail->next = first;
+  else
+    list->head = first;
+  list->tail = last;
+  list->length += count;
+}
+
+/* Adds a thread to the ready threads of its class */
+static void ready_push(thread_data* data)
+{
+  if (data->deadline != 0)
+    heap_push(&edf_q, data);
+  else if (sched_policy == UTHREAD_SCHED_RR)
+    list_enqueue(&ready_q, data);
+  else
+    heap_push(&ready_q, data);
+}
+
+/* Removes and returns the next thread to run, the one with the nearest
+   deadline if any. NULL if no thread is ready. */
+static thread_data* ready_pop(void)
+{
+  if (edf_q.length > 0)
+    return heap_pop(&edf_q);
+  if (sched_policy == UTHREAD_SCHED_RR)
+    return list_dequeue(&ready_q);
+  return heap_pop(&ready_q);
+}
+
+/* Removes a ready thread from its class */
+static void ready_remove(thread_data* data)
+{
+  if (data->deadline != 0)
+    heap_remove(&edf_q, data);
+  else if (sched_policy == UTHREAD_SCHED_RR)
+    list_remove(&ready_q, data);
+  else
+    heap_remove(&ready_q, data);
+}
+
+/* Returns the number of ready threads */
+static int ready_count(void)
+{
+  return ready_q.length + edf_q.length;
+}
+
+/* Adds a thread to a heap */
+static void heap_push(thread_list* heap, thread_data* data)
+{
+  data->prev = data->next = data->child = NULL;
+  heap->head = heap_meld(heap->head, data);
+  heap->length++;
+}
+
+/* Removes and returns the root of a heap, NULL if it is empty */
+static thread_data* heap_pop(thread_list* heap)
+{
+  thread_data* data = heap->head;
+  if (data != NULL) {
+    heap->head = heap_merge_pairs(data->child);
+    heap->length--;
   }
 
-  return 0; // return 0 to continue through queue
+  return data;
 }
 
-/* Callback function that finds the position of a thread in ready_q.
-   Will set arg equal to position (arg should be set to 0 beforehand) */
-static int get_data_TID(void *data, void *arg)
+/* Removes a thread from anywhere in a heap */
+static void heap_remove(thread_list* heap, thread_data* data)
 {
-  /* Return 1 if TID is a match */
-  thread_data* a = (thread_data*)data;
-  uthread_t TID_temp = a->TID;
-  uthread_t *arg_temp = (uthread_t*)arg;
-  /* Increment the position in the queue */
-  if (TID_temp == *arg_temp) { // if TID is found, return
-      return 1;
+  if (data == heap->head) {
+    heap_pop(heap);
+    return;
   }
+  /* Unlink its subtree, whose children are merged back into the heap */
+  if (data->prev->child == data)
+    data->prev->child = data->next;
+  else
+    data->prev->next = data->next;
+  if (data->next != NULL)
+    data->next->prev = data->prev;
+  heap->head = heap_meld(heap->head, heap_merge_pairs(data->child));
+  heap->length--;
+}
 
-  return 0; // return 0 to continue through queue
+/* Returns the key ordering a thread in its heap: its deadline in edf_q, its
+   vruntime in ready_q */
+static uint64_t heap_key(const thread_data* data)
+{
+  return (data->deadline != 0) ? data->deadline : data->vruntime;
 }
 
-/* Callback function that returns the data of a thread with a given TID_join */
-static int get_data_TID_join(void *data, void *arg) {
-  /* Return 1 if TID_join is a match */
-  thread_data* a = (thread_data*)data;
-  uthread_t TID_join_temp = a->TID_join; // TID_join in next node in queue
-  uthread_t *arg_temp = (uthread_t*)arg;
-  if (TID_join_temp == *arg_temp) // if TID_join is found, return
-      return 1;
+/* Melds two heaps, returns the new root. On a tie @a stays the root, so
+   that threads pushed last run last. */
+static thread_data* heap_meld(thread_data* a, thread_data* b)
+{
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+  if (heap_key(b) < heap_key(a)) {
+    thread_data* swap = a;
+    a = b;
+    b = swap;
+  }
+  b->prev = a;
+  b->next = a->child;
+  if (a->child != NULL)
+    a->child->prev = b;
+  a->child = b;
 
-  return 0; // return 0 to continue through queue
+  return a;
 }
 
-/* Deallocates a zombie thread given a TID */
-static void collect_thread(uthread_t TID)
+/* Melds a list of siblings into one heap: pairs from left to right, then
+   the pairs from right to left. Returns the root. */
+static thread_data* heap_merge_pairs(thread_data* first)
 {
-  preempt_disable();
-  thread_data* data_current; // data to collect
-  queue_iterate(zombie_q, get_data_TID, &TID , (void**)&data_current);
-  uthread_ctx_destroy_stack(data_current->stack_pointer); // clear stack
-  queue_delete(zombie_q, (void *)data_current);
-  free(data_current); // free pointer
-  preempt_enable();
+  thread_data* pairs = NULL; // melded pairs, last one first
+  while (first != NULL) {
+    thread_data* a = first;
+    thread_data* b = a->next;
+    first = (b != NULL) ? b->next : NULL;
+    a->prev = a->next = NULL;
+    if (b != NULL)
+      b->prev = b->next = NULL;
+    thread_data* pair = heap_meld(a, b);
+    pair->next = pairs;
+    pairs = pair;
+  }
+
+  thread_data* root = NULL;
+  while (pairs != NULL) {
+    thread_data* pair = pairs;
+    pairs = pair->next;
+    pair->next = NULL;
+    root = heap_meld(pair, root);
+  }
+  if (root != NULL)
+    root->prev = NULL;
+
+  return root;
 }
 
-int uthread_create(uthread_func_t func, void *arg)
+/* Charges the running thread for the time since it was charged last: to its
+   vruntime scaled by its weight in fair mode, and to its group */
+static void thread_charge(thread_data* data, uint64_t now)
 {
-	/* Initialize thread queues and main thread if first time running */
-  if (ready_q == NULL && uthread_init() == -1)
-    return -1; // return error if initialization failed
+  uint64_t ran = now - run_since;
+  run_since = now;
+  if (sched_policy == UTHREAD_SCHED_FAIR)
+    data->vruntime += ran * UTHREAD_WEIGHT_DEFAULT / data->weight;
+  if (data->group != NULL)
+    data->group->used += ran;
+}
 
-  /* Find biggest queue value */
-  uthread_t TID_biggest = 0, TID_rmax = 0, TID_bmax = 0, TID_zmax = 0;
-  queue_iterate(ready_q, TID_max, (void*)&TID_rmax, NULL);
-  queue_iterate(block_q, TID_max, (void*)&TID_bmax, NULL);
-  queue_iterate(zombie_q, TID_max, (void*)&TID_zmax, NULL);
-  // new queue TID is equal to largest existing TID + 1
-  TID_biggest = max3(TID_rmax, TID_bmax, TID_zmax) + 1;
+/* Blocks the running thread and switches to the next ready thread. Must be
+   called with preemption disabled and ready_q not empty. */
+static void thread_block(thread_data* data_current)
+{
+  thread_data* data_next = ready_pop();
+  data_current->state = THREAD_BLOCKED;
+  list_enqueue(&block_q, data_current); // add to blocked
+  thread_switch(data_current, data_next);
+}
 
-  /* Initialize the new thread */
-  if (new_thread_init(TID_biggest, func, arg) == -1)
-    return -1; // return error if thread init failed
+/* Moves a blocked thread to the end of ready_q. Must be called with
+   preemption disabled. */
+static void thread_unblock(thread_data* data)
+{
+  list_remove(&block_q, data);
+  thread_ready(data);
+}
+
+/* Appends a thread to ready_q, starting the measure of its scheduling
+   latency. Must be called with preemption disabled. */
+static void thread_ready(thread_data* data)
+{
+  if (data == current && data->state == THREAD_RUNNING) {
+    // its place, or whether it may run, depends on its runtime
+    if (sched_policy == UTHREAD_SCHED_FAIR ||
+        (data->group != NULL && data->group->quota != 0))
+      thread_charge(data, now_ns());
+  } else if (sched_policy == UTHREAD_SCHED_FAIR &&
+             data->vruntime + FAIR_WAKEUP_CREDIT < min_vruntime) {
+    data->vruntime = min_vruntime - FAIR_WAKEUP_CREDIT; // slept long
+  }
+  if (group_over_quota(data->group)) {
+    /* Runs again once the period of its group ends */
+    list_enqueue(&data->group->throttled, data);
+    data->state = THREAD_THROTTLED;
+    nb_throttled++;
+    return;
+  }
+  ready_push(data);
+  data->state = THREAD_READY;
+  if (loop_fd != -1 && !loop_signaled && !host_inside && data != host) {
+    eventfd_write(loop_event, 1); // the host has threads to run
+    loop_signaled = 1;
+  }
+  // a nearer deadline takes the CPU as soon as preemption is enabled again
+  if (data->deadline != 0 && data != current &&
+      (current->deadline == 0 || data->deadline < current->deadline))
+    uthread_preempt_requested = 1;
+  // the running thread is about to switch out, which reads the clock anyway
+  if (data != current) {
+    if (switch_work & SWITCH_STAMPS)
+      data->ready_since = now_ns();
+    if (metrics != NULL)
+      metrics_publish();
+  }
+}
 
-  return (TID_biggest); // return TID of new thread
+/* Exits the running thread if its group was canceled. Must be called with
+   preemption enabled. */
+static void thread_testcancel(void)
+{
+  if (current != NULL && current->canceled)
+    uthread_exit(UTHREAD_CANCELED);
 }
 
-uthread_t uthread_self(void)
+/* Tells if a group used its quota for the current period */
+static int group_over_quota(uthread_group_t group)
 {
-	/* Returns the TID of the thread that is running */
-  int i = 1;
-  thread_data* data_current;
-  // gets the thread context from first thread in queue
-  queue_iterate(ready_q, get_data, (void*)&i , (void**)&data_current);
-  return data_current->TID;
+  return group != NULL && group->quota != 0 && group->used >= group->quota;
 }
 
-void uthread_yield(void)
+/* Starts a new period for the groups whose period ended, and makes ready
+   again their throttled members if they are under quota. Must be called with
+   preemption disabled. */
+static void group_refill(uint64_t now)
 {
-  preempt_disable();
-  /* Yield if another thread is ready to run */
-  if (queue_length(ready_q) > 1) {
-    thread_data* data_current; // current thread
-    thread_data* data_oldest; // next thread in queue
-    // removes current running thread from ready queue
-    queue_dequeue(ready_q, (void**)&data_current);
-    int i = 1;
-    // get first thread in queue
-    queue_iterate(ready_q, get_data, (void*)&i , (void**)&data_oldest);
-    // move running thread to end of ready queue, putting it in its ready state
-    queue_enqueue(ready_q, (void*)data_current);
-    // makes next thread in queue the running thread
-    uthread_ctx_switch(&(data_current->context), &(data_oldest->context));
+  next_refill = UINT64_MAX;
+  for (uthread_group_t group = quota_groups; group != NULL;
+       group = group->next) {
+    if (now >= group->period_end) {
+      // time run past the quota is paid back, up to a whole quota
+      uint64_t debt = (group->used > group->quota) ?
+                      group->used - group->quota : 0;
+      group->used = (debt < group->quota) ? debt : group->quota;
+      uint64_t periods = (now - group->period_end) / group->period + 1;
+      group->period_end += periods * group->period;
+      while (!group_over_quota(group) && group->throttled.length > 0) {
+        thread_data* data = list_dequeue(&group->throttled);
+        nb_throttled--;
+        thread_ready(data);
+      }
+    }
+    if (group->period_end < next_refill)
+      next_refill = group->period_end;
   }
-  preempt_enable();
 }
 
-void uthread_exit(int retval)
+/* Sets the quota of a group, see uthread_group_set_quota(). Must be called
+   with preemption disabled. */
+static void group_set_quota(uthread_group_t group, unsigned long long quota,
+                            unsigned long long period)
 {
-	/* Gets data from exiting (current) node */
-  uthread_t TID_exit = uthread_self(); // TID of exiting thread
-  thread_data* data_current;
+  if (group->quota != 0) {
+    /* Unlink it from the groups with a quota */
+    if (group->prev != NULL)
+      group->prev->next = group->next;
+    else
+      quota_groups = group->next;
+    if (group->next != NULL)
+      group->next->prev = group->prev;
+  }
+  group->quota = quota;
+  group->period = period;
+  group->used = 0;
+  if (quota != 0) {
+    group->period_end = now_ns() + period;
+    group->prev = NULL;
+    group->next = quota_groups;
+    if (quota_groups != NULL)
+      quota_groups->prev = group;
+    quota_groups = group;
+  }
+  /* Throttled members run again right away, under the new quota */
+  while (group->throttled.length > 0) {
+    thread_data* data = list_dequeue(&group->throttled);
+    nb_throttled--;
+    thread_ready(data);
+  }
+  next_refill = 0; // recomputed at the next switch
+  switch_work_set(SWITCH_QUOTA, quota_groups != NULL);
+}
 
-  /* Turn exiting node into zombie */
-  preempt_disable();
-  queue_dequeue(ready_q, (void**)&data_current); // remove from ready queue
-  queue_enqueue(zombie_q, (void*)data_current); // add to zombie queue
-  preempt_enable();
+/* Returns the current time (in ns) */
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-  /* Check if a thread to join exists */
-  thread_data* data_parent = NULL;
-  queue_iterate(block_q, get_data_TID_join, &TID_exit, (void**)&data_parent);
-  if (data_parent != NULL) { // a thread to join exists
-    if (data_parent->return_value != NULL) // if return variable is provided
-      *(data_parent->return_value) = retval; // deref and set equal to retval
+/* Creates the metrics file if the environment asks for it */
+static void metrics_export(void)
+{
+  const char* env = getenv(UTHREAD_METRICS_ENV);
+  if (env == NULL || strcmp(env, "0") == 0)
+    return; // not requested
+  if (metrics != NULL)
+    return; // still exported since a previous uthread_run()
 
-    /* Change state of parent from blocked to ready */
-    preempt_disable();
-    queue_delete(block_q, (void*) data_parent); // Unblock parent
-    // Set TID_join value back to 0 because parent is no longer joining
-    data_parent->TID_join = 0;
-    queue_enqueue(ready_q, (void*)data_parent);
-    preempt_enable();
-    collect_thread(TID_exit); // collect exiting thread
+  char path[64];
+  snprintf(path, sizeof(path), UTHREAD_METRICS_PATH, (int)getpid());
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    return; // metrics are best effort, threads work without them
+  if (ftruncate(fd, sizeof(struct uthread_metrics)) == -1) {
+    close(fd);
+    unlink(path);
+    return;
   }
+  void* region = mmap(NULL, sizeof(struct uthread_metrics),
+                      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd); // the mapping stays valid
+  if (region == MAP_FAILED) {
+    unlink(path);
+    return;
+  }
+  metrics = region;
+  switch_work_set(SWITCH_METRICS, 1);
+  metrics->pid = getpid();
+  metrics_publish();
+  // readers ignore the region until it is complete
+  __atomic_store_n(&metrics->magic, UTHREAD_METRICS_MAGIC, __ATOMIC_RELEASE);
+  atexit(metrics_unlink);
+}
 
-  /* If queue is not empty, switch to another node */
-  if (queue_length(ready_q) > 0) {
-    thread_data* data_oldest = NULL; // next thread in queue
-    int i = 1;
-    queue_iterate(ready_q, get_data, &i , (void**)&data_oldest);
-    uthread_ctx_switch(&(data_current->context), &(data_oldest->context));
+/* Copies the counters to the metrics, readers retry while the sequence is
+   odd. Must be called with preemption disabled. */
+static void metrics_publish(void)
+{
+  uint32_t seq = metrics->seq;
+  __atomic_store_n(&metrics->seq, seq + 1, __ATOMIC_RELAXED);
+  // the sequence must turn odd before any counter changes
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  metrics->runnable = ready_count() + 1; // and the running thread
+  metrics->blocked = block_q.length;
+  metrics->zombies = zombie_q.length;
+  metrics->switches = count_switches;
+  metrics->preemptions = preempt_preemptions();
+  metrics->creates = count_creates;
+  metrics->exits = count_exits;
+  metrics->stack_bytes = stack_bytes;
+  __atomic_store_n(&metrics->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Blocks the running thread until its wait is over, checking the waiters
+   itself when no other thread can run. Must be called with preemption
+   disabled. */
+static void io_wait(io_waiter* waiter)
+{
+  waiter->done = 0;
+  waiter->ready = 0;
+  waiter->prev = NULL;
+  waiter->next = io_waiters;
+  if (io_waiters != NULL)
+    io_waiters->prev = waiter;
+  io_waiters = waiter;
+  io_nb_fds += waiter->nfds;
+  io_waiters_gen++;
+  current->waiter = waiter;
+  io_block(&waiter->done);
+  current->waiter = NULL;
+}
+
+/* Ends the wait of a waiter with @ready file descriptors, and makes its
+   thread ready. Must be called with preemption disabled. */
+static void io_waiter_done(io_waiter* w, int ready)
+{
+  w->ready = ready;
+  w->done = 1;
+  if (w->prev != NULL)
+    w->prev->next = w->next;
+  else
+    io_waiters = w->next;
+  if (w->next != NULL)
+    w->next->prev = w->prev;
+  io_nb_fds -= w->nfds;
+  io_waiters_gen++;
+  if (w->thread->state == THREAD_BLOCKED)
+    thread_unblock(w->thread);
+}
+
+/* Blocks the running thread until @done is set, checking the waiters and
+   operations itself when no other thread can run. Must be called with
+   preemption disabled. */
+static void io_block(int* done)
+{
+  current->waiting_io = 1;
+  while (!*done) {
+    if (host_inside && ready_count() == 0)
+      host_wake(); // the host runs meanwhile, and polls through its loop
+    if (ready_count() > 0)
+      thread_block(current); // woken by whoever checks the waiters next
+    else
+      io_poll(1); // nobody else can run, wait for the first event
   }
+  current->waiting_io = 0;
 }
 
-int uthread_join(uthread_t tid, int *retval)
+/* Checks the file descriptors and deadlines of the waiters, and makes ready
+   the threads whose wait is over. If @block, first waits until that happens
+   for one of them. Must be called with preemption disabled. */
+static void io_poll(int block)
 {
-  int tid_parent = uthread_self(); // get tid of parent
-	/* Check for error cases */
-  if (tid == tid_parent || tid == 0) // check for TID errors
-    return -1;
+  if (io_nb_fds + 2 > io_fds_size) {
+    struct pollfd* fds = realloc(io_fds, (io_nb_fds + 2) * sizeof(struct pollfd));
+    if (fds == NULL)
+      return; // waiters are checked again later
+    io_fds = fds;
+    io_fds_size = io_nb_fds + 2;
+  }
 
-  /* Checks if TID is already being joined */
-  thread_data* data_current = NULL;
-  queue_iterate(block_q, get_data_TID_join, &tid, (void**)&data_current);
-  if (data_current != NULL) // if join thread exists, return error
-    return -1;
+  /* Gather the file descriptors and the closest deadline */
+  nfds_t n = 0;
+  uint64_t deadline = UINT64_MAX;
+  for (io_waiter* w = io_waiters; w != NULL; w = w->next) {
+    for (nfds_t i = 0; i < w->nfds; i++)
+      io_fds[n++] = w->fds[i];
+    if (w->deadline < deadline)
+      deadline = w->deadline;
+  }
+  if (nb_throttled > 0 && next_refill < deadline)
+    deadline = next_refill; // throttled threads run again then
+  /* Operations in flight complete on the ring or the helpers */
+  nfds_t n_waiters = n;
+  if (io_ring_inflight > 0) {
+    uring_submit(); // everything queued since the last check at once
+    io_fds[n].fd = uring_fd();
+    io_fds[n].events = POLLIN;
+    n++;
+  }
+  if (io_helper_inflight > 0) {
+    io_fds[n].fd = helper_fd();
+    io_fds[n].events = POLLIN;
+    n++;
+  }
+  struct timespec timeout = { 0, 0 };
+  struct timespec* ptimeout = &timeout;
+  if (block && deadline == UINT64_MAX) {
+    ptimeout = NULL; // no deadline, wait for an event
+  } else if (block) {
+    uint64_t now = now_ns();
+    uint64_t left = (deadline > now) ? deadline - now : 0;
+    timeout.tv_sec = left / 1000000000;
+    timeout.tv_nsec = left % 1000000000;
+  }
+  // ppoll() since poll() may be hooked to come back here
+  int ret = ppoll(io_fds, n, ptimeout, NULL);
+  uint64_t now = now_ns();
+  io_last_poll = now;
+  if (ret < 0)
+    return; // interrupted, waiters are checked again later
+
+  for (nfds_t i = n_waiters; i < n; i++) {
+    if (io_fds[i].revents == 0)
+      continue;
+    if (io_fds[i].fd == helper_fd())
+      io_helper_inflight -= helper_reap(io_helper_complete);
+    else
+      io_ring_inflight -= uring_reap(io_complete);
+  }
+
+  /* Wake the waiters with events or past their deadline */
+  n = 0;
+  io_waiter* next;
+  for (io_waiter* w = io_waiters; w != NULL; w = next) {
+    next = w->next;
+    int ready = 0;
+    for (nfds_t i = 0; i < w->nfds; i++) {
+      w->fds[i].revents = io_fds[n++].revents;
+      if (w->fds[i].revents != 0)
+        ready++;
+    }
+    if (ready == 0 && w->deadline > now)
+      continue; // keeps waiting
+    io_waiter_done(w, ready);
+  }
+  if (now >= next_refill)
+    group_refill(now);
+}
+
+/* Waits for a thread to be ready to run, returns -1 if none ever will.
+   Must be called with preemption disabled. */
+static int io_wait_ready(void)
+{
+  while (ready_count() == 0) {
+    if (host_inside) {
+      host_wake(); // every guest is blocked, back to the host
+      break;
+    }
+    if (!io_pending() && nb_throttled == 0)
+      return -1; // nothing could ever make a thread ready
+    if (current != NULL)
+      thread_charge(current, now_ns());
+    io_poll(1);
+    run_since = now_ns(); // the time spent waiting is charged to nobody
+  }
+
+  return 0;
+}
+
+/* Tells if threads are waiting for I/O */
+static int io_pending(void)
+{
+  return io_waiters != NULL || io_ring_inflight > 0 || io_helper_inflight > 0;
+}
 
-  /* Checks if child is already dead */
-  queue_iterate(zombie_q, get_data_TID, &tid, NULL);
-  if (data_current != NULL) {
-    collect_thread(tid); // if already dead, collect and return
+/* Picks the backend of the operations, io_uring unless it is not available
+   or UTHREAD_IO_URING is set to 0 */
+static int io_start(void)
+{
+  const char* env = getenv("UTHREAD_IO_URING");
+  if ((env == NULL || strcmp(env, "0") != 0) &&
+      uring_init(IO_RING_ENTRIES) == 0) {
+    io_backend = IO_RING;
+    return 0;
+  }
+  if (helper_start() == 0) {
+    io_backend = IO_HELPER;
     return 0;
   }
 
-  /* Checks if thread to join exists in ready queue */
-  queue_iterate(ready_q, get_data_TID, (void*)&tid, (void**)&data_current);
-  if (data_current == NULL)
-    return -1;
+  return -1;
+}
 
-  /* Sets the parent node to blocked */
-  int i = 1;
-  // grabs parent data from the first element in queue
-  queue_iterate(ready_q, get_data, (void*)&i , (void**)&data_current);
-  // set return value pointer for thread to be joined
-  data_current->return_value = retval;
-  // sets the parent join status equal to the tid of child
-  data_current->TID_join = tid;
-  preempt_disable();
-  queue_dequeue(ready_q, (void**)&data_current); // remove parent from ready
-  queue_enqueue(block_q, (void*)data_current); // add parent to blocked
-  preempt_enable();
-  thread_data* data_oldest;
+/* Runs an operation, blocking the running thread until it completes. Leaves
+   @req->done to 0 and returns -EAGAIN if it could not be submitted. Must be
+   called with preemption disabled. */
+static long io_submit(io_request* req)
+{
+  req->thread = current;
+  req->error = 0;
+  req->done = 0;
+
+  if (io_backend == IO_HELPER || req->opcode == IO_OP_CALL) {
+    req->helper.call = io_helper_call;
+    req->helper.arg = req;
+    req->helper.data = req;
+    if (helper_submit(&req->helper) == -1)
+      return -EAGAIN;
+    io_helper_inflight++;
+  } else {
+    /* Ring full, let the operations in flight complete first */
+    while (io_ring_inflight >= IO_RING_ENTRIES) {
+      if (ready_count() > 0) {
+        thread_data* data_next = ready_pop();
+        thread_ready(current);
+        thread_switch(current, data_next);
+      } else {
+        io_poll(1);
+      }
+    }
+    // the kernel consumed every submitted entry, so one is free after this
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    if (sqe == NULL) {
+      uring_submit();
+      sqe = uring_get_sqe();
+    }
+    sqe->opcode = req->opcode;
+    sqe->fd = req->fd;
+    sqe->addr = (uintptr_t)req->buf;
+    sqe->len = req->len;
+    sqe->off = req->offset;
+    sqe->msg_flags = req->flags;
+    sqe->user_data = (uintptr_t)req;
+    // submitted with the others when ready_q drains or at the next check
+    io_ring_inflight++;
+  }
+  io_block(&req->done);
 
-  /* Switch to next ready thread after blocking parent */
-  i = 1;
-  queue_iterate(ready_q, get_data, (void*)&i , (void**)&data_oldest);
-  uthread_ctx_switch(&(data_current->context), &(data_oldest->context));
+  return req->res;
+}
 
-  return 0; // return back to code of caller
+/* Completion of an operation on the ring */
+static void io_complete(void* data, int res)
+{
+  io_request* req = data;
+  req->res = res;
+  req->done = 1;
+  if (req->thread->state == THREAD_BLOCKED)
+    thread_unblock(req->thread);
+}
+
+/* Completion of an operation on a helper thread */
+static void io_helper_complete(helper_request_t* helper)
+{
+  io_request* req = helper->data;
+  if (req->opcode == IO_OP_CALL) {
+    req->error = helper->error; // any result is valid, errno is kept aside
+    io_complete(req, (int)helper->result);
+  } else {
+    io_complete(req, (helper->result < 0) ? -helper->error :
+                                            (int)helper->result);
+  }
+}
+
+/* Makes an operation with a blocking call, on a helper thread */
+static long io_helper_call(void* arg)
+{
+  io_request* req = arg;
+  switch (req->opcode) {
+  case IO_OP_CALL:
+    return req->func(req->buf);
+  case IORING_OP_READ:
+    return pread(req->fd, req->buf, req->len, req->offset);
+  case IORING_OP_WRITE:
+    return pwrite(req->fd, req->buf, req->len, req->offset);
+  case IORING_OP_FSYNC:
+    return fsync(req->fd);
+  case IORING_OP_SEND:
+    // not send(), which may be hooked to wait in the scheduler
+    return sendto(req->fd, req->buf, req->len, req->flags, NULL, 0);
+  case IORING_OP_RECV:
+    return recvfrom(req->fd, req->buf, req->len, req->flags, NULL, NULL);
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+}
+
+/* Removes the metrics file when the process exits */
+static void metrics_unlink(void)
+{
+  char path[64];
+  snprintf(path, sizeof(path), UTHREAD_METRICS_PATH, metrics->pid);
+  unlink(path);
+}
+
+/* Saves the context of @prev and makes @next the running thread.
+   Must be called with preemption disabled. */
+static void thread_switch(thread_data* prev, thread_data* next)
+{
+  next->state = THREAD_RUNNING;
+  current = next;
+  uthread_running = next->TID;
+  count_switches++;
+  // a few tests while no feature needs more than the switch itself
+  if (switch_work != 0 || io_pending() || host_inside)
+    thread_switch_work(prev, next);
+  uthread_preempt_requested = 0; // the switch serves any pending tick
+  uthread_ctx_switch(&(prev->context), &(next->context));
+  // we are running again, free threads that were detached when they exited
+  collect_detached();
+}
+
+/* Does the work of the features which need it at a switch from @prev to
+   @next, see switch_work. Must be called with preemption disabled. */
+static void thread_switch_work(thread_data* prev, thread_data* next)
+{
+  uint64_t now = 0;
+  if ((switch_work & (SWITCH_STAMPS | SWITCH_CHARGE)) || io_pending() ||
+      host_inside)
+    now = now_ns();
+  if (switch_work & SWITCH_STAMPS) {
+    // the thread waited in ready_q since ready_since
+    uint64_t latency = now - next->ready_since;
+    if (switch_work & SWITCH_LATENCY)
+      histogram_record(&latency_global, latency);
+    if (next->latency != NULL)
+      histogram_record(next->latency, latency);
+    if (prev->state == THREAD_READY)
+      prev->ready_since = now; // yielded, it starts waiting now
+  }
+  if (switch_work & SWITCH_CHARGE) {
+    thread_charge(prev, now);
+    if (sched_policy == UTHREAD_SCHED_FAIR && next->deadline == 0 &&
+        next->vruntime > min_vruntime)
+      min_vruntime = next->vruntime;
+    if (now >= next_refill)
+      group_refill(now);
+  }
+  if (switch_work & SWITCH_WATCHDOG) {
+    __atomic_store_n(&watchdog_probe.switches, count_switches,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&watchdog_probe.ready, ready_count(), __ATOMIC_RELAXED);
+  }
+  if (switch_work & SWITCH_METRICS)
+    metrics_publish();
+  // threads busy running must not starve the waiting ones
+  if (io_pending() && now - io_last_poll >= IO_POLL_INTERVAL)
+    io_poll(0);
+  // the host takes over from the next thread as soon as it enables preemption
+  if (host_inside && (now >= host_deadline || --host_switches == 0))
+    host_wake();
+  if (switch_work & SWITCH_HOOKS) {
+    if (hook_switch_out != NULL)
+      hook_switch_out(prev->TID, next->TID, hook_userdata);
+    if (hook_switch_in != NULL)
+      hook_switch_in(prev->TID, next->TID, hook_userdata);
+  }
+}
+
+/* Turns the work of a feature at every switch on or off. Stamps the ready
+   threads or restarts the charged time when a feature starts needing them.
+   Must be called with preemption disabled. */
+static void switch_work_set(int feature, int on)
+{
+  int before = switch_work;
+  switch_work = on ? (switch_work | feature) : (switch_work & ~feature);
+  if (!(before & SWITCH_STAMPS) && (switch_work & SWITCH_STAMPS)) {
+    uint64_t now = now_ns();
+    for (int tid = 0; tid <= USHRT_MAX; tid++) {
+      thread_data* data = thread_table[tid];
+      if (data != NULL && data->state == THREAD_READY)
+        data->ready_since = now;
+    }
+  }
+  if (!(before & SWITCH_CHARGE) && (switch_work & SWITCH_CHARGE))
+    run_since = now_ns();
+}
+
+/* Deallocates a zombie thread. Must be called with preemption disabled. */
+static void collect_thread(thread_data* data_zombie)
+{
+  list_remove(&zombie_q, data_zombie);
+  thread_table[data_zombie->TID] = NULL;
+  uthread_group_t group = data_zombie->group;
+  if (group != NULL) {
+    if (data_zombie->group_prev != NULL)
+      data_zombie->group_prev->group_next = data_zombie->group_next;
+    else
+      group->members = data_zombie->group_next;
+    if (data_zombie->group_next != NULL)
+      data_zombie->group_next->group_prev = data_zombie->group_prev;
+  }
+  if (data_zombie->latency != NULL) {
+    free(data_zombie->latency);
+    if (--nb_tracked == 0)
+      switch_work_set(SWITCH_TRACKED, 0);
+  }
+  stack_bytes -= UTHREAD_STACK_SIZE;
+  if (data_zombie->batch != NULL) {
+    /* Stack and data belong to a batch, free it with its last thread */
+    if (--data_zombie->batch->count == 0)
+      free(data_zombie->batch);
+  } else {
+    uthread_ctx_destroy_stack(data_zombie->stack_pointer); // clear stack
+    free(data_zombie); // free pointer
+  }
+  if (metrics != NULL)
+    metrics_publish();
+}
+
+/* Deallocates the detached threads that exited, none of them can be running
+   anymore. Must be called with preemption disabled. */
+static void collect_detached(void)
+{
+  while (detached_zombies != NULL) {
+    thread_data* data_zombie = detached_zombies;
+    detached_zombies = data_zombie->joiner; // reused as the list link
+    collect_thread(data_zombie);
+  }
+}
+
+int uthread_create(uthread_func_t func, void *arg)
+{
+  return thread_create(NULL, func, arg, NULL);
+}
+
+int uthread_create_inline(uthread_func_t func, size_t size,
+                          uthread_init_func_t init, void *init_arg)
+{
+  if (func == NULL || init == NULL || size > UTHREAD_INLINE_SIZE)
+    return -1;
+
+  return thread_create(NULL, func, init_arg, init);
+}
+
+/* Creates a thread in @group, or in no group if NULL. If @init is set, it
+   builds the argument of the thread in its data, from @arg. */
+static int thread_create(uthread_group_t group, uthread_func_t func,
+                         void *arg, uthread_init_func_t init)
+{
+	/* Initialize main thread if first time running */
+  if (current == NULL && scheduler_init() == -1)
+    return -1; // return error if initialization failed
+
+  preempt_disable();
+  collect_detached();
+  uthread_t TID_new = TID_alloc();
+  preempt_enable();
+  if (TID_new == 0)
+    return -1; // return error if TIDs overflowed
+
+  /* Initialize the new thread */
+  if (new_thread_init(TID_new, group, func, arg, init) == -1)
+    return -1; // return error if thread init failed
+
+  return (TID_new); // return TID of new thread
+}
+
+int uthread_create_n(uthread_func_t func, void *args[], int n,
+                     uthread_t tids[])
+{
+  if (func == NULL || n <= 0)
+    return -1;
+	/* Initialize main thread if first time running */
+  if (current == NULL && scheduler_init() == -1)
+    return -1; // return error if initialization failed
+
+  /* Allocation and contexts are done with preemption disabled, see
+     new_thread_init() */
+  preempt_disable();
+  collect_detached();
+  /* One allocation for the batch, its thread data and then the stacks */
+  size_t data_size = sizeof(thread_batch) + n * sizeof(thread_data);
+  data_size = (data_size + 15) & ~(size_t)15; // keep stacks 16-byte aligned
+  thread_batch* batch = malloc(data_size + (size_t)n * BATCH_STACK_STRIDE);
+  if (batch == NULL) {
+    preempt_enable();
+    return -1; // return error if allocation fails
+  }
+  char* stacks = (char*)batch + data_size;
+  batch->count = n;
+
+  int i;
+  for (i = 0; i < n; i++) {
+    thread_data* new_thread = &batch->threads[i];
+    uthread_t TID = TID_alloc();
+    if (TID == 0)
+      break; // TIDs overflowed
+    new_thread->TID = TID;
+    new_thread->stack_pointer = stacks + (size_t)i * BATCH_STACK_STRIDE;
+    new_thread->retval = 0;
+    new_thread->TID_join = 0;
+    new_thread->joiner = NULL;
+    new_thread->detached = 0;
+    new_thread->daemon = current->daemon;
+    new_thread->park_permit = 0;
+    new_thread->state = THREAD_READY;
+    new_thread->batch = batch;
+    new_thread->latency = NULL;
+    new_thread->arena = (arena_t){ NULL, NULL, NULL };
+    new_thread->gen = NULL;
+    new_thread->waiting_io = 0;
+    new_thread->vruntime = min_vruntime;
+    new_thread->weight = UTHREAD_WEIGHT_DEFAULT;
+    new_thread->deadline = 0;
+    new_thread->func = func;
+    new_thread->arg = (args != NULL) ? args[i] : NULL;
+    new_thread->group = NULL;
+    new_thread->canceled = 0;
+    new_thread->waiter = NULL;
+    new_thread->futex = NULL;
+    new_thread->mbox_head = new_thread->mbox_tail = NULL;
+    new_thread->waiting_msg = 0;
+    new_thread->name[0] = '\0';
+    // only the first context is captured, the others are copied from it
+    int ctx_error = (i == 0) ?
+      uthread_ctx_init(&new_thread->context, new_thread->stack_pointer,
+                       thread_start, new_thread) :
+      uthread_ctx_init_from(&new_thread->context, &batch->threads[0].context,
+                            new_thread->stack_pointer, thread_start,
+                            new_thread);
+    if (ctx_error != 0)
+      break; // context initialization failed
+    // chain the batch in order, it is spliced onto ready_q at once
+    new_thread->prev = (i > 0) ? &batch->threads[i - 1] : NULL;
+    new_thread->next = (i < n - 1) ? &batch->threads[i + 1] : NULL;
+    thread_table[TID] = new_thread;
+    if (tids != NULL)
+      tids[i] = TID;
+  }
+  if (i < n) {
+    /* Undo the threads initialized so far, none of them ran */
+    while (i-- > 0)
+      thread_table[batch->threads[i].TID] = NULL;
+    free(batch);
+    preempt_enable();
+    return -1; // return error if any thread could not be initialized
+  }
+  if (switch_work & SWITCH_STAMPS) {
+    uint64_t now = now_ns();
+    for (i = 0; i < n; i++)
+      batch->threads[i].ready_since = now;
+  }
+  if (hook_create != NULL) {
+    for (i = 0; i < n; i++)
+      hook_create(current->TID, batch->threads[i].TID, hook_userdata);
+  }
+  if (sched_policy == UTHREAD_SCHED_RR) {
+    list_splice(&ready_q, &batch->threads[0], &batch->threads[n - 1], n);
+  } else {
+    for (i = 0; i < n; i++)
+      ready_push(&batch->threads[i]);
+  }
+  if (!current->daemon)
+    nb_foreground += n;
+  if (loop_fd != -1 && !loop_signaled && !host_inside) {
+    eventfd_write(loop_event, 1); // the host has threads to run
+    loop_signaled = 1;
+  }
+  count_creates += n;
+  stack_bytes += (uint64_t)n * UTHREAD_STACK_SIZE; // padding is not counted
+  if (metrics != NULL)
+    metrics_publish();
+  preempt_enable();
+
+  return 0;
+}
+
+int uthread_on_scheduler(void)
+{
+  return on_scheduler;
+}
+
+void uthread_yield(void)
+{
+  preempt_disable();
+  thread_yield();
+  preempt_enable();
+}
+
+/* Lets the other ready threads run, see uthread_yield(). Must be called with
+   preemption disabled. */
+static void thread_yield(void)
+{
+  thread_data* data_current = current;
+  /* Plain round-robin, with no deadline nor any feature of switch_work in
+     use but the global latencies: the next thread runs right away, and the
+     switch reads the clock once both to record it and to stamp this one */
+  if ((switch_work & ~SWITCH_LATENCY) == 0 && edf_q.length == 0 &&
+      data_current->deadline == 0 && ready_q.head != NULL) {
+    thread_data* data_next = list_dequeue(&ready_q);
+    list_enqueue(&ready_q, data_current);
+    data_current->state = THREAD_READY;
+    thread_switch(data_current, data_next);
+    return;
+  }
+  if (data_current == host)
+    return; // the host lets the others run from uthread_run_for() only
+  // a thread yielding with nobody else ready must not starve the waiting ones
+  if (io_pending() && ready_count() == 0 &&
+      now_ns() - io_last_poll >= IO_POLL_INTERVAL)
+    io_poll(0);
+  if (host_inside && (ready_count() == 0 || now_ns() >= host_deadline))
+    host_wake(); // out of work or time, the host runs next
+  uthread_group_t group = data_current->group;
+  if (group != NULL && group->quota != 0)
+    thread_charge(data_current, now_ns()); // it may have to stop for its group
+  /* Yield if another thread is ready to run, and should run before this one
+     (the fair policy or a deadline may keep it running), or if its group
+     used its quota */
+  if (ready_count() > 0 || group_over_quota(group)) {
+    // move running thread to ready queue, putting it in its ready state
+    thread_ready(data_current);
+    io_wait_ready(); // until the next period if nothing else can run
+    thread_data* data_next = ready_pop(); // next thread in queue
+    if (data_next != data_current)
+      thread_switch(data_current, data_next);
+    else
+      data_current->state = THREAD_RUNNING;
+  }
+}
+
+int uthread_set_sched_policy(enum uthread_sched_policy policy)
+{
+  if (current != NULL)
+    return -1; // threads are already scheduled
+  if (policy != UTHREAD_SCHED_RR && policy != UTHREAD_SCHED_FAIR)
+    return -1;
+  sched_policy = policy;
+  switch_work_set(SWITCH_FAIR, policy == UTHREAD_SCHED_FAIR);
+  return 0;
+}
+
+int uthread_set_weight(uthread_t tid, unsigned int weight)
+{
+  if (weight == 0)
+    return -1;
+
+  preempt_disable();
+  thread_data* data = (current != NULL) ? thread_table[tid] : NULL;
+  if (data == NULL || data->state == THREAD_ZOMBIE) {
+    preempt_enable();
+    return -1; // thread not found or exited
+  }
+  // the time already run keeps its weight, a ready thread keeps its place
+  data->weight = weight;
+  preempt_enable();
+
+  return 0;
+}
+
+int uthread_set_deadline(uthread_t tid, unsigned long long deadline)
+{
+  preempt_disable();
+  thread_data* data = (current != NULL) ? thread_table[tid] : NULL;
+  if (data == NULL || data->state == THREAD_ZOMBIE) {
+    preempt_enable();
+    return -1; // thread not found or exited
+  }
+  if (data->state == THREAD_READY) {
+    /* Move it to the class and place of its new deadline */
+    ready_remove(data);
+    data->deadline = deadline;
+    thread_ready(data);
+  } else {
+    data->deadline = deadline;
+    if (data == current && edf_q.length > 0)
+      uthread_preempt_requested = 1; // a ready deadline may be nearer now
+  }
+  preempt_enable();
+
+  return 0;
+}
+
+void uthread_set_shedding(int enable)
+{
+  shedding = enable;
+}
+
+int uthread_set_preempt_mode(enum uthread_preempt_mode mode)
+{
+  if (current != NULL)
+    return -1; // preemption started with the first thread
+  return preempt_set_mode(mode);
+}
+
+void uthread_checkpoint(void)
+{
+  if (!uthread_preempt_requested)
+    return; // no tick since the last switch
+  // preempt_enable() yields for the tick, even if no other thread can run
+  preempt_disable();
+  preempt_enable();
+}
+
+int uthread_yield_to(uthread_t tid)
+{
+  if (tid == uthread_self())
+    return 0; // target is already running
+
+  preempt_disable();
+  /* Target must be waiting in the ready queue */
+  thread_data* data_target = thread_table[tid];
+  if (data_target == NULL || data_target->state != THREAD_READY) {
+    preempt_enable();
+    return -1; // return error if target is not runnable
+  }
+  thread_data* data_current = current;
+  // target skips the line, the other ready threads keep their order
+  ready_remove(data_target);
+  // move running thread to end of ready queue, like a regular yield
+  thread_ready(data_current);
+  thread_switch(data_current, data_target);
+  preempt_enable();
+
+  return 0;
+}
+
+void uthread_exit(int retval)
+{
+	/* Gets data from exiting (current) node */
+  thread_data* data_current = current;
+
+  /* Turn exiting node into zombie */
+  preempt_disable();
+  if (hook_exit != NULL)
+    hook_exit(data_current->TID, retval, hook_userdata);
+  data_current->retval = retval;
+  data_current->state = THREAD_ZOMBIE;
+  list_enqueue(&zombie_q, data_current); // add to zombie queue
+  count_exits++;
+  arena_release(&data_current->arena); // its chunks go to the next threads
+  if (data_current->TID != 0 && !data_current->daemon &&
+      --nb_foreground == 0 && run_waiter != NULL &&
+      run_waiter->state == THREAD_BLOCKED)
+    thread_unblock(run_waiter); // the last thread uthread_run() waits for
+  uthread_group_t group = data_current->group;
+  if (group != NULL && --group->alive == 0 && group->joiner != NULL &&
+      group->joiner->state == THREAD_BLOCKED)
+    thread_unblock(group->joiner); // last member, its zombie is collected
+
+  if (data_current->joiner != NULL) { // a thread to join exists
+    /* Change state of parent from blocked to ready, it collects the exiting
+       thread once it resumes since we are still running on its stack */
+    // Set TID_join value back to 0 because parent is no longer joining
+    data_current->joiner->TID_join = 0;
+    thread_unblock(data_current->joiner);
+  } else if (data_current->detached) {
+    /* Nobody will join, the next thread to run collects it */
+    data_current->joiner = detached_zombies;
+    detached_zombies = data_current;
+  }
+
+  /* If queue is not empty, switch to another node */
+  if (io_wait_ready() == -1 && run_waiter != NULL &&
+      run_waiter->state == THREAD_BLOCKED) {
+    /* The threads left are blocked for good, uthread_run() gives up */
+    run_stuck = 1;
+    thread_unblock(run_waiter);
+  }
+  thread_data* data_next = ready_pop();
+  if (data_next != NULL)
+    thread_switch(data_current, data_next);
+  preempt_enable();
+}
+
+int uthread_join(uthread_t tid, int *retval)
+{
+	/* Check for error cases */
+  if (current == NULL || tid == uthread_self() || tid == 0)
+    return -1; // check for TID errors
+
+  preempt_disable();
+  /* Checks if thread to join exists, is joinable and not already joined */
+  thread_data* data_child = thread_table[tid];
+  if (data_child == NULL || data_child->detached ||
+      data_child->joiner != NULL) {
+    preempt_enable();
+    return -1;
+  }
+
+  /* Block until child is dead */
+  if (data_child->state != THREAD_ZOMBIE) {
+    if (io_wait_ready() == -1) {
+      preempt_enable();
+      return -1; // nothing could ever wake us up
+    }
+
+    /* Sets the parent node to blocked and switch to next ready thread */
+    thread_data* data_current = current;
+    // sets the parent join status equal to the tid of child
+    data_current->TID_join = tid;
+    data_child->joiner = data_current;
+    thread_block(data_current);
+  }
+
+  /* Child is a zombie now, collect it */
+  if (retval != NULL) // if return variable is provided
+    *retval = data_child->retval;
+  collect_thread(data_child);
+  preempt_enable();
+
+  return 0; // return back to code of caller
+}
+
+int uthread_detach(uthread_t tid)
+{
+  if (tid == 0)
+    return -1; // the main thread is never collected
+
+  preempt_disable();
+  thread_data* data = thread_table[tid];
+  if (data == NULL || data->detached || data->joiner != NULL) {
+    preempt_enable();
+    return -1; // thread not found, or already detached or joined
+  }
+  if (data->state == THREAD_ZOMBIE)
+    collect_thread(data); // already exited, collect it now
+  else
+    data->detached = 1;
+  preempt_enable();
+
+  return 0;
+}
+
+void uthread_park(void)
+{
+  preempt_disable();
+  thread_data* data_current = current;
+  /* Consume a pending unpark, or block if another thread can run */
+  if (data_current->park_permit)
+    data_current->park_permit = 0;
+  else if (io_wait_ready() == 0)
+    thread_block(data_current);
+  preempt_enable();
+  thread_testcancel();
+}
+
+int uthread_unpark(uthread_t tid)
+{
+  preempt_disable();
+  thread_data* data = thread_table[tid];
+  if (data == NULL || data->state == THREAD_ZOMBIE) {
+    preempt_enable();
+    return -1; // thread not found or exited
+  }
+  /* Wake the thread if it is parked, otherwise its next park returns */
+  if (data->state == THREAD_BLOCKED && data->TID_join == 0 &&
+      !data->waiting_io && data->futex == NULL && !data->waiting_msg)
+    thread_unblock(data);
+  else
+    data->park_permit = 1;
+  preempt_enable();
+
+  return 0;
+}
+
+/* Returns the index of the bucket of the waiters on @addr */
+static inline unsigned int futex_hash(const unsigned int* addr)
+{
+  // Fibonacci hashing, words next to each other land far apart
+  return (unsigned int)(((uintptr_t)addr >> 2) * 0x9e3779b97f4a7c15ULL >>
+                        (64 - FUTEX_BITS));
+}
+
+/* Removes a waiter from its bucket. Must be called with preemption
+   disabled. */
+static void futex_unlink(futex_waiter* w)
+{
+  unsigned int bucket = futex_hash(w->addr);
+  if (w->prev != NULL)
+    w->prev->next = w->next;
+  else
+    futex_buckets[bucket].head = w->next;
+  if (w->next != NULL)
+    w->next->prev = w->prev;
+  else
+    futex_buckets[bucket].tail = w->prev;
+  w->thread->futex = NULL;
+}
+
+int uthread_futex_wait(unsigned int *addr, unsigned int expected,
+                       long long timeout)
+{
+  if (addr == NULL || current == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  preempt_disable();
+  // checked and queued at once, a wake cannot slip in between
+  if (*(volatile unsigned int*)addr != expected) {
+    preempt_enable();
+    errno = EAGAIN;
+    return -1;
+  }
+  if (timeout == 0) {
+    preempt_enable();
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  if (timeout < 0 && io_wait_ready() == -1) {
+    preempt_enable();
+    errno = EDEADLK;
+    return -1; // nothing could ever wake us up
+  }
+
+  /* Queue it behind the other waiters of its bucket */
+  futex_waiter w;
+  w.thread = current;
+  w.addr = addr;
+  w.woken = 0;
+  w.timeout = NULL;
+  w.next = NULL;
+  unsigned int bucket = futex_hash(addr);
+  w.prev = futex_buckets[bucket].tail;
+  if (w.prev != NULL)
+    w.prev->next = &w;
+  else
+    futex_buckets[bucket].head = &w;
+  futex_buckets[bucket].tail = &w;
+  current->futex = &w;
+
+  /* Block until woken, or canceled. A timeout is a sleep that a wake ends
+     early. */
+  if (timeout > 0) {
+    io_waiter waiter;
+    waiter.thread = current;
+    waiter.fds = NULL;
+    waiter.nfds = 0;
+    waiter.deadline = now_ns() + (uint64_t)timeout;
+    w.timeout = &waiter;
+    io_wait(&waiter);
+    if (current->futex != NULL)
+      futex_unlink(&w); // timed out
+  } else {
+    thread_block(current);
+  }
+  preempt_enable();
+  thread_testcancel();
+
+  if (!w.woken) {
+    errno = ETIMEDOUT;
+    return -1;
+  }
+  return 0;
+}
+
+int uthread_futex_wake(unsigned int *addr, int n)
+{
+  if (addr == NULL)
+    return -1;
+  // the usual case: a wake with no waiter, not even in the bucket
+  unsigned int bucket = futex_hash(addr);
+  if (futex_buckets[bucket].head == NULL || n <= 0)
+    return 0;
+
+  preempt_disable();
+  int woken = 0;
+  futex_waiter* w = futex_buckets[bucket].head;
+  while (w != NULL && woken < n) {
+    futex_waiter* next = w->next;
+    if (w->addr == addr) {
+      futex_unlink(w);
+      w->woken = 1;
+      if (w->timeout != NULL)
+        io_waiter_done(w->timeout, 1);
+      else
+        thread_unblock(w->thread);
+      woken++;
+    }
+    w = next;
+  }
+  preempt_enable();
+
+  return woken;
+}
+
+/* Thread function of every actor: handles the messages of its mailbox batch
+   by batch, and blocks while it is empty */
+static int actor_start(void* arg)
+{
+  actor_spec* spec = arg;
+  thread_data* self = current;
+  struct uthread_msg* msg = NULL; // left by the last batch
+  struct uthread_msg* last = NULL;
+  int handled = 0; // since the actor last let the other threads run
+  while (1) {
+    preempt_disable();
+    if (msg != NULL) {
+      /* The rest goes back ahead of the messages sent meanwhile */
+      last->next = self->mbox_head;
+      if (self->mbox_head == NULL)
+        self->mbox_tail = last;
+      self->mbox_head = msg;
+    }
+    if (handled >= spec->batch) {
+      /* Batch over, even if it took several grabs of the mailbox: wait for
+         the other threads to run */
+      thread_yield();
+      handled = 0;
+    }
+    while (self->mbox_head == NULL) {
+      if (io_wait_ready() == -1) {
+        preempt_enable();
+        return -1; // nobody could ever send it a message
+      }
+      self->waiting_msg = 1;
+      thread_block(self); // until uthread_actor_send()
+      self->waiting_msg = 0;
+      handled = 0; // the other threads ran meanwhile
+    }
+    /* Take the whole mailbox at once, the messages are then handled with
+       preemption enabled */
+    msg = self->mbox_head;
+    last = self->mbox_tail;
+    self->mbox_head = self->mbox_tail = NULL;
+    preempt_enable();
+
+    for (; handled < spec->batch && msg != NULL; handled++) {
+      struct uthread_msg* next = msg->next; // the handler may send it again
+      int ret = spec->handler(spec->state, msg);
+      if (ret != 0)
+        return ret;
+      msg = next;
+    }
+  }
+}
+
+/* Builds the spec of an actor in its thread, see uthread_create_inline() */
+static void actor_init(void* mem, void* arg)
+{
+  *(actor_spec*)mem = *(actor_spec*)arg;
+}
+
+/* Returns the thread of actor @tid, or NULL if it is not an actor or it
+   stopped. Must be called with preemption disabled. */
+static thread_data* actor_find(uthread_t tid)
+{
+  thread_data* data = thread_table[tid];
+  if (data == NULL || data->func != actor_start ||
+      data->state == THREAD_ZOMBIE)
+    return NULL;
+  return data;
+}
+
+int uthread_actor_spawn(uthread_actor_func_t handler, void *state)
+{
+  if (handler == NULL)
+    return -1;
+
+  actor_spec spec = { handler, state, UTHREAD_ACTOR_BATCH };
+  return thread_create(NULL, actor_start, &spec, actor_init);
+}
+
+int uthread_actor_send(uthread_t actor, struct uthread_msg *msg)
+{
+  if (msg == NULL)
+    return -1;
+
+  preempt_disable();
+  thread_data* data = actor_find(actor);
+  if (data == NULL) {
+    preempt_enable();
+    return -1; // not an actor, or stopped
+  }
+  msg->next = NULL;
+  if (data->mbox_tail != NULL)
+    data->mbox_tail->next = msg;
+  else
+    data->mbox_head = msg;
+  data->mbox_tail = msg;
+  // only an actor waiting on its empty mailbox is woken, a busy one gets there
+  if (data->waiting_msg && data->state == THREAD_BLOCKED)
+    thread_unblock(data);
+  preempt_enable();
+
+  return 0;
+}
+
+int uthread_actor_set_batch(uthread_t actor, int batch)
+{
+  if (batch <= 0)
+    return -1;
+
+  preempt_disable();
+  thread_data* data = actor_find(actor);
+  if (data != NULL)
+    ((actor_spec*)data->arg)->batch = batch;
+  preempt_enable();
+
+  return (data != NULL) ? 0 : -1;
+}
+
+int uthread_latency_track(uthread_t tid)
+{
+  preempt_disable();
+  thread_data* data = thread_table[tid];
+  if (data == NULL || data->state == THREAD_ZOMBIE) {
+    preempt_enable();
+    return -1; // thread not found or exited
+  }
+  if (data->latency == NULL) {
+    data->latency = (histogram_t*) calloc(1, sizeof(histogram_t));
+    if (data->latency == NULL) {
+      preempt_enable();
+      return -1; // return error if histogram allocation fails
+    }
+    if (nb_tracked++ == 0)
+      switch_work_set(SWITCH_TRACKED, 1);
+  }
+  preempt_enable();
+
+  return 0;
+}
+
+void uthread_latency_enable(int enable)
+{
+  preempt_disable();
+  switch_work_set(SWITCH_LATENCY, enable);
+  preempt_enable();
+}
+
+int uthread_latency_snapshot(int tid, struct uthread_latency *latency)
+{
+  if (latency == NULL || tid < UTHREAD_LATENCY_GLOBAL || tid > USHRT_MAX)
+    return -1;
+
+  preempt_disable();
+  histogram_t* hist = &latency_global;
+  if (tid != UTHREAD_LATENCY_GLOBAL) {
+    thread_data* data = thread_table[tid];
+    if (data == NULL || data->latency == NULL) {
+      preempt_enable();
+      return -1; // thread not found or not tracked
+    }
+    hist = data->latency;
+  }
+  latency->count = hist->count;
+  latency->p50 = histogram_percentile(hist, 50);
+  latency->p99 = histogram_percentile(hist, 99);
+  latency->p999 = histogram_percentile(hist, 99.9);
+  latency->max = hist->max;
+  preempt_enable();
+
+  return 0;
+}
+
+int uthread_latency_reset(int tid)
+{
+  if (tid < UTHREAD_LATENCY_GLOBAL || tid > USHRT_MAX)
+    return -1;
+
+  preempt_disable();
+  if (tid == UTHREAD_LATENCY_GLOBAL) {
+    histogram_reset(&latency_global);
+  } else {
+    thread_data* data = thread_table[tid];
+    if (data == NULL || data->latency == NULL) {
+      preempt_enable();
+      return -1; // thread not found or not tracked
+    }
+    histogram_reset(data->latency);
+  }
+  preempt_enable();
+
+  return 0;
+}
+
+int uthread_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+  struct timespec zero = { 0, 0 };
+
+  if (current == NULL) {
+    /* Only main is running, nothing to do but wait */
+    struct timespec wait = { timeout / 1000, (timeout % 1000) * 1000000L };
+    return ppoll(fds, nfds, (timeout < 0) ? NULL : &wait, NULL);
+  }
+
+  preempt_disable();
+  /* Try first, only wait if nothing is ready */
+  int ready = ppoll(fds, nfds, &zero, NULL);
+  if (ready != 0 || timeout == 0) {
+    preempt_enable();
+    return ready;
+  }
+  io_waiter waiter;
+  waiter.thread = current;
+  waiter.fds = fds;
+  waiter.nfds = nfds;
+  waiter.deadline = (timeout < 0) ? UINT64_MAX :
+                    now_ns() + (uint64_t)timeout * 1000000;
+  io_wait(&waiter);
+  preempt_enable();
+  thread_testcancel();
+
+  return waiter.ready;
+}
+
+void uthread_sleep_ns(unsigned long long ns)
+{
+  if (current == NULL) {
+    /* Only main is running, nothing to do but wait */
+    struct timespec wait = { ns / 1000000000, ns % 1000000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, 0, &wait, &wait) != 0)
+      ; // interrupted by a signal, sleep for the rest
+    return;
+  }
+
+  preempt_disable();
+  io_waiter waiter;
+  waiter.thread = current;
+  waiter.fds = NULL;
+  waiter.nfds = 0;
+  waiter.deadline = now_ns() + ns;
+  io_wait(&waiter);
+  preempt_enable();
+  thread_testcancel();
+}
+
+/* Runs an operation from a thread, blocking only that thread */
+static ssize_t io_run(io_request* req)
+{
+  if (current == NULL)
+    return io_helper_call(req); // only main is running, just block
+
+  preempt_disable();
+  if (io_backend == 0 && io_start() == -1) {
+    preempt_enable();
+    return io_helper_call(req); // no way around blocking the process
+  }
+  long res = io_submit(req);
+  if (!req->done) {
+    preempt_enable();
+    return io_helper_call(req); // no helper thread could be started
+  }
+  preempt_enable();
+  if (res < 0) {
+    errno = -res;
+    return -1;
+  }
+
+  return res;
+}
+
+ssize_t uthread_pread(int fd, void *buf, size_t count, off_t offset)
+{
+  io_request req = { .opcode = IORING_OP_READ, .fd = fd, .buf = buf,
+                     .len = count, .offset = offset };
+  return io_run(&req);
+}
+
+ssize_t uthread_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+  io_request req = { .opcode = IORING_OP_WRITE, .fd = fd, .buf = (void*)buf,
+                     .len = count, .offset = offset };
+  return io_run(&req);
+}
+
+int uthread_fsync(int fd)
+{
+  io_request req = { .opcode = IORING_OP_FSYNC, .fd = fd };
+  return io_run(&req);
+}
+
+ssize_t uthread_send(int fd, const void *buf, size_t len, int flags)
+{
+  io_request req = { .opcode = IORING_OP_SEND, .fd = fd, .buf = (void*)buf,
+                     .len = len, .flags = flags };
+  return io_run(&req);
+}
+
+ssize_t uthread_recv(int fd, void *buf, size_t len, int flags)
+{
+  io_request req = { .opcode = IORING_OP_RECV, .fd = fd, .buf = buf,
+                     .len = len, .flags = flags };
+  return io_run(&req);
+}
+
+int uthread_blocking_call(uthread_func_t func, void *arg)
+{
+  if (func == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (current == NULL)
+    return func(arg); // only main is running, just block
+
+  preempt_disable();
+  io_request req = { .opcode = IO_OP_CALL, .func = func, .buf = arg };
+  if (helper_start() == 0)
+    io_submit(&req);
+  preempt_enable();
+  if (!req.done)
+    return func(arg); // no way around blocking the process
+  if (req.error != 0)
+    errno = req.error;
+
+  return req.res;
+}
+
+int uthread_blocking_stats(struct uthread_blocking_stats *stats)
+{
+  if (stats == NULL)
+    return -1;
+
+  preempt_disable(); // the helpers' lock must not be held across a switch
+  helper_stats(stats);
+  preempt_enable();
+
+  return 0;
+}
+
+uthread_group_t uthread_group_create(void)
+{
+  preempt_disable();
+  uthread_group_t group = calloc(1, sizeof(struct uthread_group));
+  preempt_enable();
+
+  return group;
+}
+
+int uthread_group_destroy(uthread_group_t group)
+{
+  if (group == NULL)
+    return -1;
+
+  /* Out of the groups with a quota and freed at once, so that no switch
+     charges it in between */
+  preempt_disable();
+  if (group->members != NULL) {
+    preempt_enable();
+    return -1; // members not collected yet
+  }
+  group_set_quota(group, 0, 0);
+  free(group);
+  preempt_enable();
+
+  return 0;
+}
+
+int uthread_group_spawn(uthread_group_t group, uthread_func_t func, void *arg)
+{
+  if (group == NULL || func == NULL)
+    return -1;
+
+  return thread_create(group, func, arg, NULL);
+}
+
+int uthread_group_join(uthread_group_t group)
+{
+  if (group == NULL || current == NULL || current->group == group)
+    return -1;
+
+  preempt_disable();
+  if (group->joiner != NULL) {
+    preempt_enable();
+    return -1; // another thread is joining
+  }
+  group->joiner = current;
+  while (group->alive > 0) {
+    if (io_wait_ready() == -1) {
+      group->joiner = NULL;
+      preempt_enable();
+      return -1; // nothing could ever wake us up
+    }
+    thread_block(current); // woken by the last member to exit
+  }
+  group->joiner = NULL;
+
+  /* Collect the members nobody else joins or collects */
+  collect_detached();
+  thread_data* member = group->members;
+  while (member != NULL) {
+    thread_data* next = member->group_next;
+    if (member->joiner == NULL && !member->detached)
+      collect_thread(member);
+    member = next;
+  }
+  preempt_enable();
+
+  return 0;
+}
+
+int uthread_group_cancel(uthread_group_t group)
+{
+  if (group == NULL)
+    return -1;
+
+  preempt_disable();
+  group->canceled = 1;
+  for (thread_data* member = group->members; member != NULL;
+       member = member->group_next) {
+    member->canceled = 1;
+    if (member->state != THREAD_BLOCKED)
+      continue; // exits at its next cancellation point, or when it starts
+    /* Wake it up if it waits at a cancellation point */
+    if (member->futex != NULL)
+      futex_unlink(member->futex); // no wake can pick it anymore
+    if (member->waiter != NULL)
+      io_waiter_done(member->waiter, 0);
+    else if (member->TID_join == 0 && !member->waiting_io)
+      thread_unblock(member); // parked
+  }
+  preempt_enable();
+
+  return 0;
+}
+
+int uthread_group_set_quota(uthread_group_t group, unsigned long long quota,
+                            unsigned long long period)
+{
+  if (group == NULL || (quota != 0 && period == 0))
+    return -1;
+
+  preempt_disable();
+  group_set_quota(group, quota, period);
+  preempt_enable();
+
+  return 0;
+}
+
+void uthread_testcancel(void)
+{
+  thread_testcancel();
+}
+
+void* uthread_arena_alloc(size_t size)
+{
+  if (current == NULL && scheduler_init() == -1)
+    return NULL;
+
+  /* Only the thread itself touches its arena, but the chunks are shared */
+  void* ptr = arena_bump(&current->arena, size);
+  if (ptr == NULL) {
+    preempt_disable();
+    ptr = arena_alloc(&current->arena, size);
+    preempt_enable();
+  }
+
+  return ptr;
+}
+
+void uthread_arena_reset(void)
+{
+  if (current == NULL)
+    return; // nothing allocated yet
+
+  preempt_disable();
+  arena_reset(&current->arena);
+  preempt_enable();
+}
+
+/* First function run by every generator, hands back the end of the function
+   to uthread_gen_next() */
+static int gen_start(void* arg)
+{
+  uthread_gen_t gen = arg;
+  gen->func(gen->arg);
+  gen->done = 1;
+  uthread_ctx_jump(&gen->context, &gen->caller);
+  return 0; // never resumed
+}
+
+uthread_gen_t uthread_gen_create(uthread_func_t func, void *arg)
+{
+  if (func == NULL)
+    return NULL;
+
+  preempt_disable();
+  uthread_gen_t gen = gen_cache;
+  if (gen != NULL) {
+    gen_cache = gen->prev;
+    gen_cached--;
+  } else {
+    gen = malloc(sizeof(struct uthread_gen));
+    void* stack_pointer = uthread_ctx_alloc_stack();
+    if (gen == NULL || stack_pointer == NULL) {
+      free(gen);
+      uthread_ctx_destroy_stack(stack_pointer);
+      preempt_enable();
+      return NULL;
+    }
+    gen->stack_pointer = stack_pointer;
+  }
+  preempt_enable();
+
+  gen->func = func;
+  gen->arg = arg;
+  gen->value = NULL;
+  gen->running = 0;
+  gen->done = 0;
+  gen->prev = NULL;
+  if (uthread_ctx_init(&gen->context, gen->stack_pointer, gen_start,
+                       gen) == -1) {
+    uthread_gen_destroy(gen);
+    return NULL;
+  }
+
+  return gen;
+}
+
+int uthread_gen_next(uthread_gen_t gen, void **value)
+{
+  if (gen == NULL || gen->running)
+    return -1;
+  if (gen->done)
+    return 0;
+  if (current == NULL && scheduler_init() == -1)
+    return -1;
+
+  /* Run the generator until it yields or returns, on the same thread. Only
+     this thread touches its generators, and a tick preempting it anywhere in
+     between saves and restores every register: preemption stays enabled,
+     sparing the system calls that mask the ticks. */
+  gen->prev = current->gen;
+  current->gen = gen;
+  gen->running = 1;
+  uthread_ctx_jump(&gen->caller, &gen->context);
+  gen->running = 0;
+  current->gen = gen->prev;
+
+  if (gen->done)
+    return 0;
+  if (value != NULL)
+    *value = gen->value;
+
+  return 1;
+}
+
+int uthread_gen_yield(void *value)
+{
+  if (current == NULL || current->gen == NULL)
+    return -1; // not in a generator
+
+  uthread_gen_t gen = current->gen;
+  gen->value = value;
+  uthread_ctx_jump(&gen->context, &gen->caller);
+
+  return 0;
+}
+
+int uthread_gen_destroy(uthread_gen_t gen)
+{
+  if (gen == NULL || gen->running)
+    return -1;
+
+  preempt_disable();
+  if (gen_cached < GEN_CACHE) {
+    gen->prev = gen_cache;
+    gen_cache = gen;
+    gen_cached++;
+  } else {
+    uthread_ctx_destroy_stack(gen->stack_pointer);
+    free(gen);
+  }
+  preempt_enable();
+
+  return 0;
+}
+
+/* Makes the host ready again, ahead of every other thread. Must be called with
+   preemption disabled. */
+static void host_wake(void)
+{
+  host_inside = 0;
+  host->deadline = 1; // the nearest possible, restored once it runs
+  thread_unblock(host);
+}
+
+/* Runs the other threads until none is ready, @deadline passed, or (if @once)
+   each thread ready now ran, then returns the number of threads ready */
+static int host_run(uint64_t deadline, int once)
+{
+  if (current == NULL && scheduler_init() == -1)
+    return -1;
+
+  preempt_disable();
+  host = current;
+  switch_work_set(SWITCH_HOST, 1);
+  if (loop_signaled) {
+    eventfd_t count;
+    eventfd_read(loop_event, &count);
+    loop_signaled = 0;
+  }
+  if (loop_timer_at <= now_ns()) {
+    uint64_t expirations;
+    if (read(loop_timer, &expirations, sizeof(expirations)) < 0)
+      expirations = 0; // not expired yet after all
+    loop_timer_at = UINT64_MAX;
+  }
+  if (io_pending())
+    io_poll(0); // threads whose I/O completed or whose sleep ended
+  if (ready_count() > 0) {
+    uint64_t own_deadline = host->deadline;
+    host_inside = 1;
+    host_deadline = deadline;
+    // the switch after the one to the last of them wakes the host
+    host_switches = once ? (unsigned long)ready_count() + 1 : ULONG_MAX;
+    thread_block(host);
+    host->deadline = own_deadline;
+  }
+  if (loop_fd != -1)
+    loop_arm();
+  int ready = ready_count();
+  preempt_enable();
+
+  return ready;
+}
+
+/* Makes the file descriptor of uthread_get_fd() readable when the host has to
+   run the threads again. Must be called with preemption disabled. */
+static void loop_arm(void)
+{
+  if (ready_count() > 0 && !loop_signaled) {
+    eventfd_write(loop_event, 1);
+    loop_signaled = 1;
+  } else if (ready_count() == 0 && loop_signaled) {
+    eventfd_t count;
+    eventfd_read(loop_event, &count); // signaled while the host woke up
+    loop_signaled = 0;
+  }
+
+  /* Completions of the operations in flight */
+  struct epoll_event ev = { .events = EPOLLIN };
+  if (io_backend == IO_RING && !loop_ring_added) {
+    ev.data.fd = uring_fd();
+    loop_ring_added = (epoll_ctl(loop_fd, EPOLL_CTL_ADD, ev.data.fd, &ev) == 0);
+  }
+  if (helper_fd() != -1 && !loop_helper_added) {
+    ev.data.fd = helper_fd();
+    loop_helper_added =
+      (epoll_ctl(loop_fd, EPOLL_CTL_ADD, ev.data.fd, &ev) == 0);
+  }
+  if (io_ring_inflight > 0)
+    uring_submit(); // everything queued since the last check
+
+  /* File descriptors the waiters wait for, updated when they changed */
+  if (loop_gen != io_waiters_gen) {
+    loop_gen = io_waiters_gen;
+    for (int i = 0; i < loop_nb_regs; i++)
+      epoll_ctl(loop_fd, EPOLL_CTL_DEL, loop_regs[i].data.fd, NULL);
+    loop_nb_regs = 0;
+    loop_waiters_deadline = UINT64_MAX;
+    for (io_waiter* w = io_waiters; w != NULL; w = w->next) {
+      if (w->deadline < loop_waiters_deadline)
+        loop_waiters_deadline = w->deadline;
+      for (nfds_t i = 0; i < w->nfds; i++) {
+        if (loop_nb_regs == loop_regs_size) {
+          int size = (loop_regs_size > 0) ? 2 * loop_regs_size : 64;
+          struct epoll_event* regs =
+            realloc(loop_regs, size * sizeof(struct epoll_event));
+          if (regs == NULL)
+            break; // this waiter is only woken by the others
+          loop_regs = regs;
+          loop_regs_size = size;
+        }
+        struct epoll_event* reg = &loop_regs[loop_nb_regs];
+        reg->events = w->fds[i].events;
+        reg->data.fd = w->fds[i].fd;
+        if (epoll_ctl(loop_fd, EPOLL_CTL_ADD, reg->data.fd, reg) == 0) {
+          loop_nb_regs++;
+        } else if (errno == EEXIST) {
+          /* Waited for by several threads, wait for all their events */
+          for (int j = 0; j < loop_nb_regs; j++) {
+            if (loop_regs[j].data.fd == reg->data.fd) {
+              loop_regs[j].events |= reg->events;
+              epoll_ctl(loop_fd, EPOLL_CTL_MOD, reg->data.fd, &loop_regs[j]);
+              break;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  /* Nearest deadline, of a waiter or of the throttled threads */
+  uint64_t deadline = loop_waiters_deadline;
+  if (nb_throttled > 0 && next_refill < deadline)
+    deadline = next_refill;
+  if (deadline != loop_timer_at) {
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+    if (deadline != UINT64_MAX) {
+      its.it_value.tv_sec = deadline / 1000000000;
+      its.it_value.tv_nsec = deadline % 1000000000;
+      if (deadline == 0)
+        its.it_value.tv_nsec = 1; // 0 would disarm it
+    }
+    timerfd_settime(loop_timer, TFD_TIMER_ABSTIME, &its, NULL);
+    loop_timer_at = deadline;
+  }
+}
+
+int uthread_run_once(void)
+{
+  return host_run(UINT64_MAX, 1);
+}
+
+int uthread_run_for(unsigned long long ns)
+{
+  return host_run(now_ns() + ns, 0);
+}
+
+int uthread_get_fd(void)
+{
+  if (current == NULL && scheduler_init() == -1)
+    return -1;
+
+  preempt_disable();
+  if (loop_fd == -1) {
+    loop_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loop_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.fd = loop_event;
+    int ret = (loop_fd == -1 || loop_event == -1 || loop_timer == -1) ? -1 :
+              epoll_ctl(loop_fd, EPOLL_CTL_ADD, loop_event, &ev);
+    ev.data.fd = loop_timer;
+    if (ret == 0)
+      ret = epoll_ctl(loop_fd, EPOLL_CTL_ADD, loop_timer, &ev);
+    if (ret == -1) {
+      if (loop_fd != -1)
+        close(loop_fd);
+      if (loop_event != -1)
+        close(loop_event);
+      if (loop_timer != -1)
+        close(loop_timer);
+      loop_fd = loop_event = loop_timer = -1;
+      preempt_enable();
+      return -1;
+    }
+    loop_gen = io_waiters_gen - 1; // registers the waiters
+    switch_work_set(SWITCH_HOST, 1);
+    loop_arm();
+  }
+  preempt_enable();
+
+  return loop_fd;
+}
+
+/* Frees everything the scheduler holds once uthread_run() is done: the
+   threads left (daemons, or threads blocked for good) with their stacks, the
+   queues, the caches and the timer. The library starts over at the next
+   thread. Must be called by the main thread with preemption disabled. */
+static void scheduler_teardown(void)
+{
+  /* Operations in flight still write to the stacks of their threads */
+  while (io_ring_inflight + io_helper_inflight > 0)
+    io_poll(1);
+  preempt_stop();
+
+  for (int tid = 1; tid <= USHRT_MAX; tid++) {
+    thread_data* data = thread_table[tid];
+    if (data == NULL)
+      continue;
+    thread_table[tid] = NULL;
+    uthread_group_t group = data->group;
+    if (group != NULL) {
+      /* The group outlives its members, empty it */
+      group->members = NULL;
+      group->alive = 0;
+      group->joiner = NULL;
+      group->throttled = (thread_list){ NULL, NULL, 0 };
+    }
+    arena_release(&data->arena);
+    free(data->latency);
+    if (data->batch != NULL) {
+      if (--data->batch->count == 0)
+        free(data->batch);
+    } else {
+      uthread_ctx_destroy_stack(data->stack_pointer);
+      free(data);
+    }
+  }
+  detached_zombies = NULL;
+  ready_q = edf_q = block_q = zombie_q = (thread_list){ NULL, NULL, 0 };
+  nb_throttled = 0;
+  next_refill = 0; // recomputed at the next switch
+  nb_foreground = 0;
+  min_vruntime = 0;
+  stack_bytes = 0;
+  nb_tracked = 0;
+  switch_work_set(SWITCH_TRACKED, 0);
+
+  /* Waits, caches and the file descriptors of uthread_get_fd() */
+  io_waiters = NULL;
+  io_nb_fds = 0;
+  io_waiters_gen++;
+  memset(futex_buckets, 0, sizeof(futex_buckets));
+  free(io_fds);
+  io_fds = NULL;
+  io_fds_size = 0;
+  while (gen_cache != NULL) {
+    uthread_gen_t gen = gen_cache;
+    gen_cache = gen->prev;
+    uthread_ctx_destroy_stack(gen->stack_pointer);
+    free(gen);
+  }
+  gen_cached = 0;
+  arena_trim();
+  if (loop_fd != -1) {
+    close(loop_fd);
+    close(loop_event);
+    close(loop_timer);
+    loop_fd = loop_event = loop_timer = -1;
+  }
+  free(loop_regs);
+  loop_regs = NULL;
+  loop_nb_regs = loop_regs_size = 0;
+  loop_signaled = loop_ring_added = loop_helper_added = 0;
+  loop_timer_at = loop_waiters_deadline = UINT64_MAX;
+  host = NULL;
+  host_inside = 0;
+  switch_work_set(SWITCH_HOST, 0);
+
+  /* The main thread last, it runs on the process stack */
+  thread_data* main_thread = thread_table[0];
+  arena_release(&main_thread->arena);
+  free(main_thread->latency);
+  free(main_thread);
+  thread_table[0] = NULL;
+  current = NULL;
+  uthread_running = 0;
+  on_scheduler = 0;
+  TID_next = 1;
+  if (metrics != NULL)
+    metrics_publish();
+}
+
+int uthread_init(const struct uthread_config *config)
+{
+  if (current != NULL)
+    return -1; // already initialized, by this function or the first thread
+
+  if (config != NULL) {
+    if (uthread_set_sched_policy(config->policy) == -1)
+      return -1;
+    // without preemption, only the default mode is accepted
+    if (preempt_set_mode(config->preempt_mode) == -1 &&
+        config->preempt_mode != UTHREAD_PREEMPT_SIGNAL)
+      return -1;
+    uthread_set_shedding(config->shedding);
+  }
+
+  return scheduler_init();
+}
+
+int uthread_run(uthread_func_t func, void *arg)
+{
+  if (func == NULL || (current != NULL && current != thread_table[0]))
+    return -1; // only the main thread runs the others from here
+  if (current == NULL && scheduler_init() == -1)
+    return -1;
+
+  int ret = (thread_create(NULL, func, arg, NULL) == -1) ? -1 : 0;
+  preempt_disable();
+  /* Sleep until the last thread which is not a daemon exits */
+  run_waiter = current;
+  while (ret == 0 && nb_foreground > 0 && !run_stuck) {
+    if (io_wait_ready() == -1)
+      ret = -1; // nothing could ever make them exit
+    else
+      thread_block(current);
+  }
+  if (run_stuck)
+    ret = -1;
+  run_waiter = NULL;
+  run_stuck = 0;
+  scheduler_teardown();
+  preempt_enable();
+
+  return ret;
+}
+
+int uthread_set_daemon(uthread_t tid, int daemon)
+{
+  if (tid == 0)
+    return -1; // uthread_run() never waits for the main thread
+
+  preempt_disable();
+  thread_data* data = (current != NULL) ? thread_table[tid] : NULL;
+  if (data == NULL || data->state == THREAD_ZOMBIE) {
+    preempt_enable();
+    return -1; // thread not found or exited
+  }
+  daemon = (daemon != 0);
+  if (data->daemon != daemon) {
+    data->daemon = daemon;
+    if (!daemon)
+      nb_foreground++;
+    else if (--nb_foreground == 0 && run_waiter != NULL &&
+             run_waiter->state == THREAD_BLOCKED)
+      thread_unblock(run_waiter); // only daemons are left
+  }
+  preempt_enable();
+
+  return 0;
+}
+
+void uthread_set_switch_hooks(uthread_switch_hook_t on_switch_out,
+                              uthread_switch_hook_t on_switch_in,
+                              uthread_create_hook_t on_create,
+                              uthread_exit_hook_t on_exit, void *userdata)
+{
+  /* Set at once for the switches, which may be made by ticks */
+  preempt_disable();
+  hook_switch_out = on_switch_out;
+  hook_switch_in = on_switch_in;
+  hook_create = on_create;
+  hook_exit = on_exit;
+  hook_userdata = userdata;
+  switch_work_set(SWITCH_HOOKS, on_switch_out != NULL || on_switch_in != NULL);
+  preempt_enable();
+}
+
+/* Finds the running thread and the ready thread which waited the longest,
+   for the watchdog. Called from its signal handler, it only reads. */
+static void watchdog_inspect(uthread_t* running, uthread_t* oldest,
+                             uint64_t* waited)
+{
+  thread_data* data_current = current;
+  *running = (data_current != NULL) ? data_current->TID : 0;
+  *oldest = 0;
+  *waited = 0;
+  if (data_current == NULL)
+    return; // library not initialized
+  uint64_t now = now_ns();
+  for (int tid = 0; tid <= USHRT_MAX; tid++) {
+    thread_data* data = thread_table[tid];
+    if (data != NULL && data->state == THREAD_READY &&
+        now - data->ready_since > *waited) {
+      *oldest = data->TID;
+      *waited = now - data->ready_since;
+    }
+  }
+}
+
+int uthread_watchdog_start(const struct uthread_watchdog_config *config)
+{
+  if (config == NULL || (config->run_quanta == 0 && config->masked_ns == 0 &&
+                         config->wait_ns == 0))
+    return -1;
+
+  /* The monitor reads the switches, and when the ready threads started
+     waiting */
+  preempt_disable();
+  watchdog_probe.switches = count_switches;
+  watchdog_probe.ready = ready_count();
+  int ret = watchdog_start(config, watchdog_inspect);
+  if (ret == 0) {
+    switch_work_set(SWITCH_WATCHDOG, 1);
+    switch_work_set(SWITCH_STARVATION, config->wait_ns != 0);
+  }
+  preempt_enable();
+
+  return ret;
+}
+
+int uthread_watchdog_stop(void)
+{
+  preempt_disable();
+  switch_work_set(SWITCH_WATCHDOG | SWITCH_STARVATION, 0);
+  preempt_enable();
+  return watchdog_stop();
+}
+
+/* Finds the stack of @data holding @sp, its own or the one of a generator it
+   runs. Both bounds are 0 if none does, as for the main thread. */
+static void thread_stack(const thread_data* data, uintptr_t sp, uintptr_t* lo,
+                         uintptr_t* hi)
+{
+  *lo = *hi = 0;
+  uintptr_t base = (uintptr_t)data->stack_pointer;
+  for (uthread_gen_t gen = data->gen; gen != NULL; gen = gen->prev) {
+    if (sp >= (uintptr_t)gen->stack_pointer &&
+        sp < (uintptr_t)gen->stack_pointer + UTHREAD_STACK_SIZE) {
+      base = (uintptr_t)gen->stack_pointer;
+      break;
+    }
+  }
+  if (base != 0 && sp >= base && sp < base + UTHREAD_STACK_SIZE) {
+    *lo = base;
+    *hi = base + UTHREAD_STACK_SIZE;
+  }
+}
+
+/* Finds the running thread and the stack holding @sp, for the profiler.
+   Called from its signal handler, it only reads. */
+static uthread_t profile_inspect(uintptr_t sp, uintptr_t* lo, uintptr_t* hi)
+{
+  thread_data* data_current = current;
+  *lo = *hi = 0;
+  if (data_current == NULL)
+    return 0; // library not initialized, the main thread runs
+  thread_stack(data_current, sp, lo, hi);
+  return data_current->TID;
+}
+
+int uthread_profile_start(unsigned int hz, unsigned int max_samples)
+{
+  if (hz == 0)
+    hz = UTHREAD_PROFILE_HZ;
+  if (max_samples == 0)
+    max_samples = UTHREAD_PROFILE_SAMPLES;
+  return profile_start(hz, max_samples, profile_inspect);
+}
+
+int uthread_profile_stop(void)
+{
+  return profile_stop();
+}
+
+int uthread_profile_write(int fd)
+{
+  return profile_write(fd);
+}
+
+int uthread_set_name(uthread_t tid, const char *name)
+{
+  if (name == NULL)
+    return -1;
+
+  preempt_disable();
+  thread_data* data = (current != NULL) ? thread_table[tid] : NULL;
+  if (data == NULL || data->state == THREAD_ZOMBIE) {
+    preempt_enable();
+    return -1; // thread not found or exited
+  }
+  strncpy(data->name, name, UTHREAD_NAME_SIZE - 1);
+  data->name[UTHREAD_NAME_SIZE - 1] = '\0';
+  preempt_enable();
+
+  return 0;
+}
+
+/* Most frames written per thread by uthread_dump() */
+#define DUMP_FRAMES 32
+
+/* Delay before trying a dump again, when the signal came during a critical
+   section (in ns) */
+#define DUMP_RETRY_NS 1000000
+
+/* Dumps triggered by a signal, see uthread_dump_on_signal() */
+static int dump_signum = 0;
+static struct sigaction dump_old_action; // handler of dump_signum before
+static timer_t dump_timer; // sends dump_signum again to retry
+static pthread_t dump_thread; // system thread running the threads
+
+/* Bounds of the stack of the system thread, where the main thread runs */
+static uintptr_t system_lo = 0, system_hi = 0;
+
+/* Where a dump goes: a stream, or a file descriptor from a signal handler.
+   Lines are built with the async-signal-safe functions of sigsafe.h either
+   way. */
+typedef struct {
+  FILE* file;
+  int fd;
+  struct sigsafe_line line;
+} dump_out;
+
+/* Writes the line built, and empties it */
+static void dump_flush(dump_out* out)
+{
+  if (out->file != NULL)
+    fwrite(out->line.buf, 1, out->line.len, out->file);
+  else
+    (void)sigsafe_write(&out->line, out->fd); // lost if it cannot be written
+  out->line.len = 0;
+}
+
+/* Finds the bounds of the stack of the calling system thread, once. Not
+   async-signal-safe. */
+static void system_stack_init(void)
+{
+  pthread_attr_t attr;
+  void* addr;
+  size_t size;
+  if (system_hi != 0 || pthread_getattr_np(pthread_self(), &attr) != 0)
+    return;
+  if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+    system_lo = (uintptr_t)addr;
+    system_hi = system_lo + size;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+/* Tells what a blocked thread waits for */
+static const char* thread_waits(const thread_data* data)
+{
+  if (data->TID_join != 0)
+    return "join";
+  if (data->futex != NULL)
+    return "futex";
+  if (data->waiting_io)
+    return "I/O or sleep";
+  if (data->waiting_msg)
+    return "mailbox";
+  if (data == run_waiter)
+    return "uthread_run";
+  return "park or group";
+}
+
+/* Writes the state and the backtrace of @data. @uc is the context of the
+   running thread, NULL to start from the caller. */
+static void thread_dump_one(dump_out* out, thread_data* data, ucontext_t* uc)
+{
+  static const char* states[] = {
+    [THREAD_READY] = "ready", [THREAD_RUNNING] = "running",
+    [THREAD_BLOCKED] = "blocked", [THREAD_THROTTLED] = "throttled",
+    [THREAD_ZOMBIE] = "zombie"
+  };
+  uintptr_t pc, sp, fp;
+  if (data != current) {
+    profile_regs(&data->context, &pc, &sp, &fp); // saved by its last switch
+  } else if (uc != NULL) {
+    profile_regs(uc, &pc, &sp, &fp);
+  } else {
+    pc = (uintptr_t)thread_dump_one;
+    sp = fp = (uintptr_t)__builtin_frame_address(0);
+  }
+  uintptr_t lo, hi;
+  thread_stack(data, sp, &lo, &hi);
+  if (lo == 0 && sp >= system_lo && sp < system_hi) {
+    lo = system_lo;
+    hi = system_hi;
+  }
+
+  struct sigsafe_line* line = &out->line;
+  sigsafe_str(line, "thread ");
+  sigsafe_dec(line, data->TID);
+  sigsafe_str(line, " \"");
+  sigsafe_str(line, data->name);
+  sigsafe_str(line, "\": ");
+  sigsafe_str(line, states[data->state]);
+  if (data->state == THREAD_BLOCKED) {
+    sigsafe_str(line, " (");
+    sigsafe_str(line, thread_waits(data));
+    sigsafe_str(line, ")");
+  }
+  if (data->TID_join != 0) {
+    sigsafe_str(line, ", joins ");
+    sigsafe_dec(line, data->TID_join);
+  }
+  if (hi != 0 && data->state != THREAD_ZOMBIE) {
+    sigsafe_str(line, ", stack ");
+    sigsafe_dec(line, hi - sp);
+    sigsafe_str(line, "/");
+    sigsafe_dec(line, hi - lo);
+    sigsafe_str(line, " bytes");
+  }
+  if (data->daemon)
+    sigsafe_str(line, ", daemon");
+  if (data->detached)
+    sigsafe_str(line, ", detached");
+  sigsafe_str(line, "\n");
+  dump_flush(out);
+  if (data->state == THREAD_ZOMBIE)
+    return; // it will not run again
+
+  /* Symbols are looked up by dladdr(), which signal handlers may not call:
+     they print the addresses, for addr2line or uthread-gdb.py */
+  uintptr_t pcs[DUMP_FRAMES];
+  int depth = profile_unwind(pc, sp, fp, lo, hi, pcs, DUMP_FRAMES);
+  for (int i = 0; i < depth; i++) {
+    sigsafe_str(line, "  #");
+    sigsafe_dec(line, i);
+    sigsafe_str(line, " ");
+    if (out->file != NULL) {
+      char symbol[128];
+      profile_symbol(pcs[i], symbol, sizeof(symbol));
+      sigsafe_str(line, symbol);
+    } else {
+      sigsafe_hex(line, pcs[i]);
+    }
+    sigsafe_str(line, "\n");
+    dump_flush(out);
+  }
+}
+
+/* Writes every thread. Must be called with preemption disabled, or from a
+   signal handler which interrupted none of its critical sections. */
+static int thread_dump(dump_out* out, ucontext_t* uc)
+{
+  if (current == NULL) {
+    sigsafe_str(&out->line, "uthread dump: no threads\n");
+    dump_flush(out);
+    return 0;
+  }
+  int nb_threads = 0;
+  for (int tid = 0; tid <= USHRT_MAX; tid++) {
+    if (thread_table[tid] != NULL)
+      nb_threads++;
+  }
+  sigsafe_str(&out->line, "uthread dump: ");
+  sigsafe_dec(&out->line, nb_threads);
+  sigsafe_str(&out->line, " threads, ");
+  sigsafe_dec(&out->line, ready_count());
+  sigsafe_str(&out->line, " ready\n");
+  dump_flush(out);
+  for (int tid = 0; tid <= USHRT_MAX; tid++) {
+    if (thread_table[tid] != NULL)
+      thread_dump_one(out, thread_table[tid], uc);
+  }
+  return nb_threads;
+}
+
+int uthread_dump(FILE *out)
+{
+  if (out == NULL)
+    return -1;
+
+  system_stack_init();
+  dump_out to = { out, -1, { .len = 0 } };
+  preempt_disable();
+  int nb_threads = thread_dump(&to, NULL);
+  preempt_enable();
+  fflush(out);
+
+  return nb_threads;
+}
+
+/* Dumps the threads on the standard error, as soon as they are consistent */
+static void dump_handler(int signum, siginfo_t* info, void* ucontext)
+{
+  (void)info;
+  if (!pthread_equal(pthread_self(), dump_thread)) {
+    pthread_kill(dump_thread, signum); // only it may look at the threads
+    return;
+  }
+  int saved_errno = errno;
+  // not the tick handler, if it was interrupted as it started
+  ucontext_t* uc = preempt_interrupted(ucontext);
+  if (preempt_masked(uc)) {
+    /* In a critical section, which may be modifying the threads */
+    struct itimerspec retry = { { 0, 0 }, { 0, DUMP_RETRY_NS } };
+    timer_settime(dump_timer, 0, &retry, NULL);
+  } else {
+    dump_out to = { NULL, STDERR_FILENO, { .len = 0 } };
+    thread_dump(&to, uc);
+  }
+  errno = saved_errno;
+}
+
+int uthread_dump_on_signal(int signum)
+{
+  if (signum == 0) {
+    if (dump_signum == 0)
+      return -1;
+    timer_delete(dump_timer);
+    sigaction(dump_signum, &dump_old_action, NULL);
+    dump_signum = 0;
+    return 0;
+  }
+  if (dump_signum != 0 || signum < 1 || signum >= NSIG ||
+      signum == SIGVTALRM || signum == SIGKILL || signum == SIGSTOP)
+    return -1;
+
+  system_stack_init();
+  dump_thread = pthread_self();
+  struct sigevent event;
+  memset(&event, 0, sizeof(event));
+  event.sigev_notify = SIGEV_THREAD_ID;
+  event.sigev_signo = signum;
+  event._sigev_un._tid = gettid(); // sigev_notify_thread_id
+  if (timer_create(CLOCK_MONOTONIC, &event, &dump_timer) != 0)
+    return -1;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = dump_handler;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigaddset(&action.sa_mask, SIGVTALRM); // no tick while it runs
+  if (sigaction(signum, &action, &dump_old_action) != 0) {
+    timer_delete(dump_timer);
+    return -1;
+  }
+  dump_signum = signum;
+
+  return 0;
 }
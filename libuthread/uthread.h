@@ -1,6 +1,16 @@
 #ifndef _UTHREAD_H
 #define _UTHREAD_H
 
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*
  * uthread_t - Thread identifier (TID) type
  *
@@ -33,12 +43,88 @@ typedef int (*uthread_func_t)(void *arg);
  */
 int uthread_create(uthread_func_t func, void *arg);
 
+/* Size of the argument uthread_create_inline() keeps in the thread itself */
+#define UTHREAD_INLINE_SIZE 64
+
+/*
+ * uthread_init_func_t - Argument initialization function type
+ * @mem: Memory receiving the argument, UTHREAD_INLINE_SIZE bytes suitably
+ *	aligned for any type
+ * @arg: Argument given to uthread_create_inline()
+ */
+typedef void (*uthread_init_func_t)(void *mem, void *arg);
+
+/*
+ * uthread_create_inline - Create a new thread holding its argument
+ * @func: Function to be executed by the thread
+ * @size: Size of the argument of the thread (in bytes)
+ * @init: Function building the argument
+ * @init_arg: Argument to be passed to @init
+ *
+ * Same as uthread_create(), except that the argument passed to @func lives in
+ * the data of the new thread instead of being allocated by the caller: @init
+ * builds it there (from @init_arg) before the thread can run. It stays valid
+ * until the thread is collected. @init runs with preemption disabled and must
+ * not call the library.
+ *
+ * Return: -1 if @func or @init are NULL, if @size is larger than
+ * UTHREAD_INLINE_SIZE, or in case of failure. The TID of the new thread
+ * otherwise.
+ */
+int uthread_create_inline(uthread_func_t func, size_t size,
+			  uthread_init_func_t init, void *init_arg);
+
+/*
+ * uthread_create_n - Create a batch of threads
+ * @func: Function to be executed by each thread
+ * @args: Array of @n arguments, the i-th thread receives @args[i] (or NULL if
+ *	@args is NULL)
+ * @n: Number of threads to create
+ * @tids: (Optional) Array of @n TIDs receiving the TID of each new thread
+ *
+ * This function creates @n threads running the function @func, as if by @n
+ * calls to uthread_create(), but with a single memory allocation for all of
+ * them. The new threads become ready in order, after every thread that was
+ * already ready. The shared allocation is freed once every thread of the batch
+ * has been collected.
+ *
+ * Return: -1 in case of failure (memory allocation, context creation, TID
+ * overflow, etc.), in which case no thread is created. 0 otherwise.
+ */
+int uthread_create_n(uthread_func_t func, void *args[], int n,
+		     uthread_t tids[]);
+
+/*
+ * uthread_running - TID of the running thread
+ *
+ * Updated whenever threads switch, 0 (the main thread) while the library is not
+ * initialized. Only meant to be read by uthread_self().
+ */
+extern uthread_t uthread_running;
+
 /*
  * uthread_self - Get thread identifier
  *
+ * Inlined, so that it only costs a load.
+ *
  * Return: The TID of the currently running thread
  */
-uthread_t uthread_self(void);
+static inline uthread_t uthread_self(void)
+{
+	return uthread_running;
+}
+
+/*
+ * uthread_on_scheduler - Tell if the caller is one of the threads
+ *
+ * Code shared with other system threads, such as the functions given to
+ * uthread_blocking_call(), may only wait through the library when this is
+ * true: elsewhere it must make the plain system calls.
+ *
+ * Return: 1 if called from the system thread running the threads, once the
+ * library is initialized. 0 otherwise.
+ */
+int uthread_on_scheduler(void);
 
 /*
  * uthread_yield - Yield execution
@@ -48,6 +134,587 @@ uthread_t uthread_self(void);
  */
 void uthread_yield(void);
 
+/*
+ * uthread_yield_to - Yield execution to a specific thread
+ * @tid: TID of the thread to run next
+ *
+ * This function is to be called from the currently active and running thread in
+ * order to hand the processor directly to thread @tid, without waiting for the
+ * other ready threads to run first. The calling thread goes to the back of the
+ * ready threads like with uthread_yield(), and the other ready threads keep
+ * their relative order.
+ *
+ * Return: -1 if thread @tid is not ready to run (blocked, zombie or not
+ * found). 0 otherwise, including when @tid is the TID of the calling thread.
+ */
+int uthread_yield_to(uthread_t tid);
+
+/*
+ * uthread_poll - Wait for events on file descriptors
+ * @fds: Array of file descriptors and events to wait for, see poll(2)
+ * @nfds: Number of entries in @fds
+ * @timeout: Maximum time to wait (in ms), negative to wait forever
+ *
+ * Same as poll(2), except that only the calling thread waits: the other threads
+ * keep running in the meantime. The waiting threads are checked when no other
+ * thread can run, and otherwise at least every millisecond at context switches.
+ *
+ * Return: Number of entries of @fds with events, 0 if @timeout expired, or -1
+ * in case of error (errno is set)
+ */
+int uthread_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+
+/*
+ * uthread_sleep_ns - Suspend the running thread
+ * @ns: Time to sleep (in ns)
+ *
+ * Only the calling thread sleeps, the other threads keep running.
+ */
+void uthread_sleep_ns(unsigned long long ns);
+
+/*
+ * uthread_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Buffer receiving the data
+ * @count: Number of bytes to read
+ * @offset: Offset in the file
+ *
+ * Same as pread(2), except that only the calling thread waits for the data,
+ * including from regular files. The operation is queued to io_uring with the
+ * ones of the other threads, and submitted with them when no thread can run
+ * anymore (or at least every millisecond). Without io_uring, it is run by a
+ * helper system thread instead.
+ *
+ * Return: Number of bytes read, or -1 in case of error (errno is set)
+ */
+ssize_t uthread_pread(int fd, void *buf, size_t count, off_t offset);
+
+/*
+ * uthread_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data to write
+ * @count: Number of bytes to write
+ * @offset: Offset in the file
+ *
+ * Same as pwrite(2), only blocking the calling thread like uthread_pread().
+ *
+ * Return: Number of bytes written, or -1 in case of error (errno is set)
+ */
+ssize_t uthread_pwrite(int fd, const void *buf, size_t count, off_t offset);
+
+/*
+ * uthread_fsync - Flush a file to storage
+ * @fd: File descriptor
+ *
+ * Same as fsync(2), only blocking the calling thread like uthread_pread().
+ *
+ * Return: 0, or -1 in case of error (errno is set)
+ */
+int uthread_fsync(int fd);
+
+/*
+ * uthread_send - Send data on a socket
+ * @fd: Socket
+ * @buf: Data to send
+ * @len: Number of bytes to send
+ * @flags: Flags of send(2)
+ *
+ * Same as send(2), only blocking the calling thread like uthread_pread().
+ *
+ * Return: Number of bytes sent, or -1 in case of error (errno is set)
+ */
+ssize_t uthread_send(int fd, const void *buf, size_t len, int flags);
+
+/*
+ * uthread_recv - Receive data from a socket
+ * @fd: Socket
+ * @buf: Buffer receiving the data
+ * @len: Size of @buf
+ * @flags: Flags of recv(2)
+ *
+ * Same as recv(2), only blocking the calling thread like uthread_pread().
+ *
+ * Return: Number of bytes received, or -1 in case of error (errno is set)
+ */
+ssize_t uthread_recv(int fd, void *buf, size_t len, int flags);
+
+/*
+ * uthread_blocking_call - Run a blocking function without blocking the process
+ * @func: Function that may block in the system
+ * @arg: Argument to be passed to the function
+ *
+ * Calls that cannot be made asynchronous (getaddrinfo(), open() on a slow
+ * mount, libraries with their own locks...) block the only system thread
+ * running all the threads. This function runs @func on a helper system thread
+ * instead, and blocks only the calling thread until @func returns.
+ *
+ * Helper threads are started on demand, up to 4 or the number given by the
+ * environment variable UTHREAD_HELPERS, and run the calls in submission order.
+ * @func must not call any function of the library.
+ *
+ * Return: Return value of @func, with errno as @func left it. -1 if @func is
+ * NULL.
+ */
+int uthread_blocking_call(uthread_func_t func, void *arg);
+
+/*
+ * struct uthread_blocking_stats - State of the helper threads
+ * @threads: Helper threads started
+ * @max_threads: Most helper threads that can be started
+ * @busy: Helper threads running a call
+ * @queued: Calls waiting for a helper thread
+ * @calls: Calls run since the start
+ * @wait_p50: Median time a call waited for a helper thread (in ns)
+ * @wait_p99: 99th percentile of that time (in ns)
+ * @wait_max: Longest time a call waited for a helper thread (in ns)
+ *
+ * Helper threads run uthread_blocking_call(), and the file operations when
+ * io_uring is not available.
+ */
+struct uthread_blocking_stats {
+	unsigned int threads;
+	unsigned int max_threads;
+	unsigned int busy;
+	unsigned int queued;
+	unsigned long long calls;
+	unsigned long long wait_p50;
+	unsigned long long wait_p99;
+	unsigned long long wait_max;
+};
+
+/*
+ * uthread_blocking_stats - Get the state of the helper threads
+ * @stats: Address of the structure receiving the state
+ *
+ * Return: -1 if @stats is NULL. 0 otherwise.
+ */
+int uthread_blocking_stats(struct uthread_blocking_stats *stats);
+
+/*
+ * enum uthread_sched_policy - How the next thread to run is picked
+ * @UTHREAD_SCHED_RR: (Default) Round-robin, ready threads run in turn whatever
+ *	time they used.
+ * @UTHREAD_SCHED_FAIR: Fair share, each thread is charged the time it runs
+ *	divided by its weight, and the ready thread charged the least runs
+ *	next. A thread yielding before using its share keeps running. Threads
+ *	waking up after blocking are not credited for more than 10 ms.
+ */
+enum uthread_sched_policy {
+	UTHREAD_SCHED_RR,
+	UTHREAD_SCHED_FAIR,
+};
+
+/*
+ * uthread_set_sched_policy - Select the scheduling policy
+ * @policy: Scheduling policy
+ *
+ * This function must be called before the first thread is created.
+ *
+ * Return: -1 if @policy is invalid or if threads were already created. 0
+ * otherwise.
+ */
+int uthread_set_sched_policy(enum uthread_sched_policy policy);
+
+/* Weight of every thread until it is changed */
+#define UTHREAD_WEIGHT_DEFAULT 1024
+
+/*
+ * uthread_set_weight - Set the CPU share of a thread
+ * @tid: TID of the thread
+ * @weight: Weight of the thread, UTHREAD_WEIGHT_DEFAULT by default
+ *
+ * In fair mode, ready threads get CPU time in proportion to their weights: a
+ * thread of weight 2048 runs twice as much as one of weight 1024. Weights are
+ * ignored in round-robin.
+ *
+ * Return: -1 if @weight is 0, or if thread @tid cannot be found or exited. 0
+ * otherwise.
+ */
+int uthread_set_weight(uthread_t tid, unsigned int weight);
+
+/*
+ * uthread_set_deadline - Make a thread latency-critical
+ * @tid: TID of the thread
+ * @deadline: Absolute deadline of the thread, in ns of CLOCK_MONOTONIC, or 0
+ *	to make it a best-effort thread again
+ *
+ * Threads with a deadline are scheduled earliest deadline first, ahead of every
+ * best-effort thread (scheduled by the policy set with
+ * uthread_set_sched_policy()). A thread whose deadline becomes the nearest one
+ * takes the CPU from the running thread right away, or at its next checkpoint
+ * in polling mode. The deadline stays until it is changed, whether it passed
+ * or not.
+ *
+ * Return: -1 if thread @tid cannot be found or exited. 0 otherwise.
+ */
+int uthread_set_deadline(uthread_t tid, unsigned long long deadline);
+
+/* Return value of a thread shed before it ran */
+#define UTHREAD_SHED INT_MIN
+
+/*
+ * uthread_set_shedding - Fail threads which start after their deadline
+ * @enable: 1 to shed late threads, 0 (the default) to run them anyway
+ *
+ * When enabled, a thread with a deadline that is picked to run for the first
+ * time after its deadline exits right away, without calling its function, with
+ * UTHREAD_SHED as return value. Threads that already started are never shed:
+ * they can compare their deadline to the time themselves.
+ */
+void uthread_set_shedding(int enable);
+
+/*
+ * uthread_group_t - Thread group type
+ *
+ * A group holds the threads spawned in it with uthread_group_spawn(), until
+ * they are collected. Threads they create are not members.
+ */
+typedef struct uthread_group* uthread_group_t;
+
+/* Return value of a thread which exited because its group was canceled */
+#define UTHREAD_CANCELED (INT_MIN + 1)
+
+/*
+ * uthread_group_create - Create an empty thread group
+ *
+ * Return: NULL in case of failure (memory allocation). The new group otherwise.
+ */
+uthread_group_t uthread_group_create(void);
+
+/*
+ * uthread_group_destroy - Free a thread group
+ * @group: Group to free
+ *
+ * Return: -1 if @group is NULL or still has members that were not collected
+ * (by uthread_group_join() or uthread_join()). 0 otherwise.
+ */
+int uthread_group_destroy(uthread_group_t group);
+
+/*
+ * uthread_group_spawn - Create a new thread in a group
+ * @group: Group of the new thread
+ * @func: Function to be executed by the thread
+ * @arg: Argument to be passed to the thread
+ *
+ * Same as uthread_create(), the new thread being a member of @group. The
+ * thread can still be joined or detached on its own.
+ *
+ * Return: -1 in case of failure. The TID of the new thread otherwise.
+ */
+int uthread_group_spawn(uthread_group_t group, uthread_func_t func, void *arg);
+
+/*
+ * uthread_group_join - Wait for every thread of a group
+ * @group: Group to join
+ *
+ * This function blocks the currently running thread until every member of
+ * @group exited, then collects the members that are neither detached nor being
+ * joined on their own. Their return values are lost. Only one thread can join
+ * a group at a time, and members cannot join their own group.
+ *
+ * Return: -1 if @group is NULL, is already being joined, if the running thread
+ * is a member, or if the members can never exit. 0 otherwise.
+ */
+int uthread_group_join(uthread_group_t group);
+
+/*
+ * uthread_group_cancel - Cancel every thread of a group
+ * @group: Group to cancel
+ *
+ * Cancellation is deferred: members exit with UTHREAD_CANCELED as return value
+ * when they reach a cancellation point, namely when they start, in
+ * uthread_park(), uthread_poll(), uthread_sleep_ns() and uthread_testcancel().
+ * Members blocked in one of these functions are woken up right away. Threads
+ * spawned in @group afterwards are canceled as well.
+ *
+ * Return: -1 if @group is NULL. 0 otherwise.
+ */
+int uthread_group_cancel(uthread_group_t group);
+
+/*
+ * uthread_group_set_quota - Limit the CPU time of a group
+ * @group: Group to limit
+ * @quota: CPU time its members may use per period (in ns), 0 for no limit
+ * @period: Length of a period (in ns)
+ *
+ * Once the members of @group used @quota during a period, they are throttled:
+ * they do not run again until the next period starts. The running member is
+ * stopped at its next preemption tick, or at its next checkpoint in polling
+ * mode. Time used past the quota is paid back during the next periods. A new
+ * quota starts a new period.
+ *
+ * Return: -1 if @group is NULL, or if @quota is set and @period is 0. 0
+ * otherwise.
+ */
+int uthread_group_set_quota(uthread_group_t group, unsigned long long quota,
+			    unsigned long long period);
+
+/*
+ * uthread_testcancel - Exit if the group of the running thread was canceled
+ *
+ * Cancellation point for threads that compute without calling any other.
+ */
+void uthread_testcancel(void);
+
+/*
+ * uthread_arena_alloc - Allocate memory freed with the running thread
+ * @size: Size of the memory to allocate (in bytes)
+ *
+ * Memory is carved from chunks owned by the running thread, without any lock
+ * or search for a fitting block. It cannot be freed on its own: it is all
+ * released at once when the thread calls uthread_arena_reset() or exits, and
+ * its chunks are reused by the next threads. Other threads may use it until
+ * then.
+ *
+ * Return: NULL in case of failure (memory allocation). The allocated memory
+ * otherwise, aligned on 16 bytes.
+ */
+void *uthread_arena_alloc(size_t size);
+
+/*
+ * uthread_arena_reset - Free the memory allocated by the running thread
+ *
+ * Every block returned by uthread_arena_alloc() to the running thread becomes
+ * invalid, for instance between two requests handled by the same thread.
+ */
+void uthread_arena_reset(void);
+
+/*
+ * uthread_gen_t - Generator type
+ *
+ * A generator runs a function which produces values one at a time with
+ * uthread_gen_yield(), each of them handed to the thread asking for it with
+ * uthread_gen_next(). The generator runs on its own stack, but within the
+ * thread calling uthread_gen_next(): switching between them involves no other
+ * thread, no queue and no allocation.
+ */
+typedef struct uthread_gen* uthread_gen_t;
+
+/*
+ * uthread_gen_create - Create a generator
+ * @func: Function producing the values, its return value is ignored
+ * @arg: Argument to be passed to the function
+ *
+ * The function starts running at the first call to uthread_gen_next(). Stacks
+ * of destroyed generators are reused.
+ *
+ * Return: NULL if @func is NULL or in case of failure (memory allocation,
+ * context creation). The new generator otherwise.
+ */
+uthread_gen_t uthread_gen_create(uthread_func_t func, void *arg);
+
+/*
+ * uthread_gen_next - Get the next value of a generator
+ * @gen: Generator to run
+ * @value: Address receiving the value, or NULL
+ *
+ * This function runs the function of @gen until it yields a value or returns.
+ * Generators may call uthread_gen_next() on other generators.
+ *
+ * Return: -1 if @gen is NULL or already running. 0 if the function of @gen
+ * returned, now or before. 1 if a value was yielded.
+ */
+int uthread_gen_next(uthread_gen_t gen, void **value);
+
+/*
+ * uthread_gen_yield - Hand a value to the caller of uthread_gen_next()
+ * @value: Value to hand over
+ *
+ * This function suspends the generator running on the current thread until
+ * the next call to uthread_gen_next() on it.
+ *
+ * Return: -1 if no generator is running on the current thread. 0 otherwise.
+ */
+int uthread_gen_yield(void *value);
+
+/*
+ * uthread_gen_destroy - Free a generator
+ * @gen: Generator to free
+ *
+ * A generator suspended in uthread_gen_yield() is discarded without running
+ * the rest of its function. Its stack is kept for the next generators.
+ *
+ * Return: -1 if @gen is NULL or running. 0 otherwise.
+ */
+int uthread_gen_destroy(uthread_gen_t gen);
+
+/*
+ * uthread_run_once - Run every thread ready now, once
+ *
+ * This function and uthread_run_for() embed the threads in the loop of
+ * another framework (a game or GUI loop, an event loop): the thread calling
+ * them, the host, lets the others run from there only: from then on, timer
+ * ticks and uthread_yield() leave it running. It runs again once each thread that
+ * was ready ran (threads made ready meanwhile wait for the next call), or as
+ * soon as none is ready.
+ *
+ * Return: -1 in case of failure (library initialization). The number of
+ * threads still ready otherwise.
+ */
+int uthread_run_once(void);
+
+/*
+ * uthread_run_for - Run the ready threads for some time
+ * @ns: Time budget (in ns)
+ *
+ * The host runs again once @ns passed, at the next switch or timer tick, or
+ * as soon as no thread is ready. Threads completing their I/O or sleep are
+ * made ready first.
+ *
+ * Return: -1 in case of failure (library initialization). The number of
+ * threads still ready otherwise.
+ */
+int uthread_run_for(unsigned long long ns);
+
+/*
+ * uthread_get_fd - Get a file descriptor to wait for the threads
+ *
+ * The host loop waits for this file descriptor along with its own (with
+ * poll(), epoll, or the loop of its framework), and calls uthread_run_once()
+ * or uthread_run_for() when it is readable: some thread is ready, completed
+ * its I/O, or reached the end of its sleep or timeout. It is not readable
+ * while there is nothing to run, so the host loop sleeps then. Reading it is
+ * left to the library.
+ *
+ * Return: -1 in case of failure (file descriptor creation). The file
+ * descriptor otherwise, the same for every call.
+ */
+int uthread_get_fd(void);
+
+/*
+ * enum uthread_preempt_mode - How timer ticks preempt threads
+ * @UTHREAD_PREEMPT_SIGNAL: (Default) The tick switches the running thread
+ *	wherever it is, except in the C library where it is deferred a little.
+ * @UTHREAD_PREEMPT_POLL: The tick only asks the running thread to yield, which
+ *	it does at its next checkpoint (see uthread_checkpoint()) or library
+ *	call. Code that is not async-signal-safe is never interrupted by a
+ *	switch, and the library does not need to mask signals, but a thread
+ *	which never reaches a checkpoint is never preempted.
+ */
+enum uthread_preempt_mode {
+	UTHREAD_PREEMPT_SIGNAL,
+	UTHREAD_PREEMPT_POLL,
+};
+
+/*
+ * uthread_set_preempt_mode - Select the preemption mode
+ * @mode: Preemption mode
+ *
+ * This function must be called before the first thread is created, preemption
+ * starting with it.
+ *
+ * Return: -1 if @mode is invalid, if preemption already started or if the
+ * library was built without preemption. 0 otherwise.
+ */
+int uthread_set_preempt_mode(enum uthread_preempt_mode mode);
+
+/*
+ * struct uthread_config - Configuration of the library
+ * @policy: Scheduling policy (see uthread_set_sched_policy())
+ * @preempt_mode: Preemption mode (see uthread_set_preempt_mode())
+ * @shedding: 1 to shed late threads (see uthread_set_shedding())
+ *
+ * A configuration filled with zeros selects the defaults.
+ */
+struct uthread_config {
+	enum uthread_sched_policy policy;
+	enum uthread_preempt_mode preempt_mode;
+	int shedding;
+};
+
+/*
+ * uthread_init - Initialize the library
+ * @config: Configuration, or NULL for the defaults
+ *
+ * Without this function, the library initializes itself with the settings
+ * selected so far when the first thread is created. This function makes the
+ * calling thread the main thread, and starts preemption.
+ *
+ * Return: -1 if the library is already initialized, if @config is invalid
+ * (see uthread_set_preempt_mode()), or in case of failure (memory
+ * allocation). 0 otherwise.
+ */
+int uthread_init(const struct uthread_config *config);
+
+/*
+ * uthread_run - Run threads until they are done
+ * @func: Function of the first thread
+ * @arg: Argument to be passed to the first thread
+ *
+ * This function, called by the main thread, creates a thread running @func
+ * and sleeps until it and every thread it created, except daemons, exited.
+ * When no thread can run, the process sleeps in the kernel until one of them
+ * is woken (I/O, timeout, end of a quota period) instead of spinning. The
+ * daemons left are then discarded without running again, once their
+ * operations in flight completed. Every thread, stack, queue and cache of the
+ * library is freed, and the timer stopped, so that the library starts over at
+ * the next call (with the settings of the previous run, unless uthread_init()
+ * is called again). The helper threads and io_uring ring are kept.
+ *
+ * Return: -1 if @func is NULL, if called from another thread than the main
+ * one, in case of failure creating the first thread, or if the threads left
+ * were all blocked for good (they are discarded as well). 0 otherwise.
+ */
+int uthread_run(uthread_func_t func, void *arg);
+
+/*
+ * uthread_set_daemon - Make uthread_run() wait for a thread or not
+ * @tid: TID of the thread
+ * @daemon: 1 to make it a daemon, which uthread_run() does not wait for, 0 to
+ *	make it a regular thread again
+ *
+ * Threads are daemons if the thread creating them is one.
+ *
+ * Return: -1 if @tid is the main thread, or if thread @tid cannot be found or
+ * exited. 0 otherwise.
+ */
+int uthread_set_daemon(uthread_t tid, int daemon);
+
+/* Room for the name of a thread, including its terminating null byte */
+#define UTHREAD_NAME_SIZE 16
+
+/*
+ * uthread_set_name - Name a thread
+ * @tid: TID of the thread
+ * @name: Name, truncated to UTHREAD_NAME_SIZE - 1 characters, or "" to remove
+ *	it
+ *
+ * The name is shown by uthread_dump().
+ *
+ * Return: -1 if @name is NULL, or if thread @tid cannot be found or exited. 0
+ * otherwise.
+ */
+int uthread_set_name(uthread_t tid, const char *name);
+
+/*
+ * uthread_preempt_requested - Pending preemption flag
+ *
+ * Set by a tick which could not switch the running thread right away, cleared
+ * whenever threads switch. Only meant to be read by UTHREAD_CHECKPOINT().
+ */
+extern volatile sig_atomic_t uthread_preempt_requested;
+
+/*
+ * uthread_checkpoint - Preemption point
+ *
+ * Yield if a tick asked the running thread to, do nothing otherwise. Long
+ * computations that do not call the library should call this function (or
+ * UTHREAD_CHECKPOINT()) regularly to be preempted in polling mode.
+ */
+void uthread_checkpoint(void);
+
+/*
+ * UTHREAD_CHECKPOINT - Inline preemption point
+ *
+ * Same as uthread_checkpoint(), with the check inlined so that it only costs a
+ * load and a branch in loops when no tick is pending.
+ */
+#define UTHREAD_CHECKPOINT()				\
+	do {						\
+		if (uthread_preempt_requested)		\
+			uthread_checkpoint();		\
+	} while (0)
+
 /*
  * uthread_exit - Exit from currently running thread
  * @retval: Return value
@@ -81,4 +748,441 @@ void uthread_exit(int retval);
  */
 int uthread_join(uthread_t tid, int *retval);
 
+/*
+ * uthread_detach - Detach a thread
+ * @tid: TID of the thread to detach
+ *
+ * This function marks thread @tid as detached: its resources are collected
+ * automatically when it exits, and it can no longer be joined. If thread @tid
+ * already exited, it is collected right away.
+ *
+ * Return: -1 if @tid is 0, if thread @tid cannot be found, or if thread @tid is
+ * already detached or being joined. 0 otherwise.
+ */
+int uthread_detach(uthread_t tid);
+
+/*
+ * uthread_park - Block until unparked
+ *
+ * This function blocks the currently running thread until another thread
+ * calls uthread_unpark() on it. If uthread_unpark() was already called on the
+ * running thread since its last park, the function returns right away instead.
+ *
+ * The function may also return without being unparked (for instance if no
+ * other thread can run), so callers must check the condition they are waiting
+ * for again after it returns.
+ */
+void uthread_park(void);
+
+/*
+ * uthread_unpark - Unblock a parked thread
+ * @tid: TID of the thread to unpark
+ *
+ * This function makes thread @tid ready to run again if it is blocked in
+ * uthread_park(). Otherwise, the next call to uthread_park() from thread @tid
+ * returns right away.
+ *
+ * Return: -1 if thread @tid cannot be found or has exited. 0 otherwise.
+ */
+int uthread_unpark(uthread_t tid);
+
+/*
+ * uthread_futex_wait - Block until a memory word is woken
+ * @addr: Address of the word
+ * @expected: Value the word must hold for the thread to block
+ * @timeout: Longest time to block (in ns), or a negative value to block until
+ *	woken
+ *
+ * This function blocks the calling thread if *@addr still equals @expected,
+ * until a call to uthread_futex_wake() on @addr wakes it. Checking the word and
+ * blocking happen at once, so a thread changing the word and then waking @addr
+ * cannot be missed. Waking up is never spurious: uthread_unpark() leaves the
+ * thread blocked. It is a cancellation point (see uthread_group_cancel()).
+ *
+ * Return: 0 if woken. -1 otherwise, with errno set to EINVAL if @addr is NULL
+ * or if no thread was created yet, EAGAIN if *@addr differs from @expected,
+ * ETIMEDOUT if @timeout passed, or EDEADLK if no other thread could ever wake
+ * it.
+ */
+int uthread_futex_wait(unsigned int *addr, unsigned int expected,
+		       long long timeout);
+
+/*
+ * uthread_futex_wake - Wake threads blocked on a memory word
+ * @addr: Address of the word
+ * @n: Most threads to wake, INT_MAX to wake them all
+ *
+ * Threads blocked in uthread_futex_wait() on @addr are woken in the order they
+ * blocked. They become ready to run, the calling thread keeps running. With
+ * nobody waiting, this function costs a hash lookup.
+ *
+ * Return: -1 if @addr is NULL. The number of threads woken otherwise.
+ */
+int uthread_futex_wake(unsigned int *addr, int n);
+
+/*
+ * struct uthread_msg - Link of a message
+ * @next: Next message in the mailbox, used by the library
+ *
+ * Messages embed this link, so that sending them allocates nothing. A message
+ * belongs to the library from the time it is sent until the handler of the
+ * actor receives it.
+ */
+struct uthread_msg {
+	struct uthread_msg *next;
+};
+
+/*
+ * uthread_actor_func_t - Handler of an actor
+ * @state: State given to uthread_actor_spawn()
+ * @msg: Message received
+ *
+ * Return: 0 to go on receiving messages. Any other value stops the actor,
+ * which exits with it as return value.
+ */
+typedef int (*uthread_actor_func_t)(void *state, struct uthread_msg *msg);
+
+/* Most messages an actor handles per activation, unless set otherwise */
+#define UTHREAD_ACTOR_BATCH 64
+
+/*
+ * uthread_actor_spawn - Create an actor
+ * @handler: Function handling each message
+ * @state: State to be passed to the handler
+ *
+ * An actor is a thread which calls @handler on each message of its mailbox,
+ * in the order they were sent. It stays blocked while its mailbox is empty,
+ * and becomes ready when a message arrives. Once running, it handles up to a
+ * batch of messages (see uthread_actor_set_batch()) before letting the other
+ * threads run, so that a busy actor does not switch for each message. An actor
+ * which no other thread could ever send a message to stops with -1.
+ *
+ * An actor is joined or detached like any other thread. Messages left in its
+ * mailbox when it stops are never handled.
+ *
+ * Return: -1 if @handler is NULL or in case of failure (memory allocation,
+ * context creation, TID overflow). The TID of the actor otherwise.
+ */
+int uthread_actor_spawn(uthread_actor_func_t handler, void *state);
+
+/*
+ * uthread_actor_send - Send a message to an actor
+ * @actor: TID of the actor
+ * @msg: Message to send
+ *
+ * This function appends @msg to the mailbox of @actor, making it ready if it
+ * waited for messages. The calling thread keeps running. Actors may send
+ * messages to themselves.
+ *
+ * Return: -1 if @msg is NULL, or if thread @actor cannot be found, is not an
+ * actor or has stopped. 0 otherwise.
+ */
+int uthread_actor_send(uthread_t actor, struct uthread_msg *msg);
+
+/*
+ * uthread_actor_set_batch - Set how many messages an actor handles at once
+ * @actor: TID of the actor
+ * @batch: Most messages handled per activation, UTHREAD_ACTOR_BATCH by default
+ *
+ * Larger batches save switches, smaller ones let the other threads run sooner.
+ *
+ * Return: -1 if @batch is not positive, or if thread @actor cannot be found,
+ * is not an actor or has stopped. 0 otherwise.
+ */
+int uthread_actor_set_batch(uthread_t actor, int batch);
+
+/*
+ * struct uthread_latency - Scheduling latency summary
+ * @count: Number of times a thread went from ready to running
+ * @p50: Median delay between becoming ready and running (in ns)
+ * @p99: 99th percentile of the delay (in ns)
+ * @p999: 99.9th percentile of the delay (in ns)
+ * @max: Longest delay (in ns)
+ *
+ * A thread becomes ready when it is created, yields, or is woken after a join
+ * or a park. Percentiles are accurate within about 3%, the maximum is exact.
+ */
+struct uthread_latency {
+	unsigned long long count;
+	unsigned long long p50;
+	unsigned long long p99;
+	unsigned long long p999;
+	unsigned long long max;
+};
+
+/* TID standing for the latencies of every thread together */
+#define UTHREAD_LATENCY_GLOBAL -1
+
+/*
+ * uthread_latency_enable - Record the scheduling latencies of every thread
+ * @enable: 1 (the default) to record them together, 0 to stop
+ *
+ * Recording reads the clock once at every switch and whenever a thread
+ * becomes ready.
+ */
+void uthread_latency_enable(int enable);
+
+/*
+ * uthread_latency_track - Record the scheduling latencies of a thread
+ * @tid: TID of the thread
+ *
+ * Makes thread @tid record its own latencies, from now until it is collected,
+ * whether the ones of every thread are recorded or not.
+ *
+ * Return: -1 if thread @tid cannot be found or exited, or in case of failure
+ * when allocating its histogram. 0 otherwise.
+ */
+int uthread_latency_track(uthread_t tid);
+
+/*
+ * uthread_latency_snapshot - Get scheduling latencies
+ * @tid: TID of a thread tracked with uthread_latency_track(), or
+ *	UTHREAD_LATENCY_GLOBAL for every thread
+ * @latency: Address of the structure receiving the summary
+ *
+ * Return: -1 if @latency is NULL, or if thread @tid cannot be found or is not
+ * tracked. 0 otherwise.
+ */
+int uthread_latency_snapshot(int tid, struct uthread_latency *latency);
+
+/*
+ * uthread_latency_reset - Forget recorded scheduling latencies
+ * @tid: TID of a thread tracked with uthread_latency_track(), or
+ *	UTHREAD_LATENCY_GLOBAL for every thread
+ *
+ * Resetting the latencies of every thread does not reset the ones of the
+ * tracked threads, and the other way around.
+ *
+ * Return: -1 if thread @tid cannot be found or is not tracked. 0 otherwise.
+ */
+int uthread_latency_reset(int tid);
+
+/*
+ * uthread_switch_hook_t - Hook called when threads switch
+ * @prev: TID of the thread leaving the CPU
+ * @next: TID of the thread getting it
+ * @userdata: Pointer given to uthread_set_switch_hooks()
+ */
+typedef void (*uthread_switch_hook_t)(uthread_t prev, uthread_t next,
+				      void *userdata);
+
+/*
+ * uthread_create_hook_t - Hook called when a thread is created
+ * @parent: TID of the thread creating it
+ * @child: TID of the new thread
+ * @userdata: Pointer given to uthread_set_switch_hooks()
+ */
+typedef void (*uthread_create_hook_t)(uthread_t parent, uthread_t child,
+				      void *userdata);
+
+/*
+ * uthread_exit_hook_t - Hook called when a thread exits
+ * @tid: TID of the exiting thread
+ * @retval: Its return value
+ * @userdata: Pointer given to uthread_set_switch_hooks()
+ */
+typedef void (*uthread_exit_hook_t)(uthread_t tid, int retval,
+				    void *userdata);
+
+/*
+ * uthread_set_switch_hooks - Observe switches, creations and exits
+ * @on_switch_out: Called on every switch, whatever its cause (yield, block,
+ *	exit, tick), or NULL
+ * @on_switch_in: Called on every switch, right after @on_switch_out, or NULL
+ * @on_create: Called when a thread is created, before it can run, or NULL
+ * @on_exit: Called when a thread exits, before switching away, or NULL
+ * @userdata: Pointer passed to each hook
+ *
+ * The hooks replace the ones set before, and all of them NULL remove them:
+ * the library then only tests a flag at each switch, creation and exit. Switch
+ * hooks are called on the stack of @prev, just before @next resumes, so that
+ * no code of either thread runs in between. Every hook is called with
+ * preemption disabled, possibly from the handler of a tick, and must not call
+ * the library.
+ */
+void uthread_set_switch_hooks(uthread_switch_hook_t on_switch_out,
+			      uthread_switch_hook_t on_switch_in,
+			      uthread_create_hook_t on_create,
+			      uthread_exit_hook_t on_exit, void *userdata);
+
+/*
+ * enum uthread_watchdog_event - What the watchdog detected
+ * @UTHREAD_WATCHDOG_RUNAWAY: A thread ran for too long without switching
+ * @UTHREAD_WATCHDOG_MASKED: A thread ran for too long with preemption disabled
+ *	(ticks masked) in signal mode
+ * @UTHREAD_WATCHDOG_STARVED: A ready thread waited too long to run
+ */
+enum uthread_watchdog_event {
+	UTHREAD_WATCHDOG_RUNAWAY,
+	UTHREAD_WATCHDOG_MASKED,
+	UTHREAD_WATCHDOG_STARVED,
+};
+
+/*
+ * enum uthread_watchdog_action - What the watchdog does about an event
+ * @UTHREAD_WATCHDOG_LOG: (Default) Nothing more than logging it
+ * @UTHREAD_WATCHDOG_YIELD: Force the running thread to yield, like a tick in
+ *	signal mode even in polling mode. For a masked event, enable preemption
+ *	again instead, the next tick coming shortly.
+ * @UTHREAD_WATCHDOG_ABORT: Abort the process
+ */
+enum uthread_watchdog_action {
+	UTHREAD_WATCHDOG_LOG,
+	UTHREAD_WATCHDOG_YIELD,
+	UTHREAD_WATCHDOG_ABORT,
+};
+
+/*
+ * uthread_watchdog_hook_t - Decide what to do about an event
+ * @event: Event detected
+ * @tid: TID of the running thread, or for a starved event of the ready thread
+ *	which waited the longest
+ * @ns: How long it ran, or waited (in ns)
+ *
+ * Called from a signal handler, it must be async-signal-safe.
+ *
+ * Return: Action to take
+ */
+typedef enum uthread_watchdog_action (*uthread_watchdog_hook_t)(
+	enum uthread_watchdog_event event, uthread_t tid,
+	unsigned long long ns);
+
+/*
+ * struct uthread_watchdog_config - Thresholds of the watchdog
+ * @run_quanta: Quanta of 10 ms of CPU time a thread may run without
+ *	switching, 0 not to check
+ * @masked_ns: CPU time a thread may run with preemption disabled (in ns), 0
+ *	not to check
+ * @wait_ns: Time a ready thread may wait to run (in ns), 0 not to check
+ * @hook: Called on each event, NULL to only log them
+ */
+struct uthread_watchdog_config {
+	unsigned int run_quanta;
+	unsigned long long masked_ns;
+	unsigned long long wait_ns;
+	uthread_watchdog_hook_t hook;
+};
+
+/*
+ * uthread_watchdog_start - Watch the threads for runaways and starvation
+ * @config: Thresholds, and hook deciding what to do
+ *
+ * A monitor system thread samples the scheduler a few times per threshold,
+ * without slowing it down. On a suspicion, it interrupts the system thread
+ * running the threads (the one calling this function) with SIGURG, which the
+ * program must leave to the watchdog. The handler checks the event, logs the
+ * TID and duration with a backtrace of the running thread on the standard
+ * error (programs linked with -rdynamic get function names), then takes the
+ * action returned by the hook. An event which lasts is reported again each
+ * time the threshold passes once more.
+ *
+ * CPU time is the one of the system thread running the threads, so that the
+ * time spent sleeping in the kernel while no thread is ready does not count.
+ *
+ * Return: -1 if @config is NULL or checks nothing, if the watchdog already
+ * runs, or in case of failure (system thread creation). 0 otherwise.
+ */
+int uthread_watchdog_start(const struct uthread_watchdog_config *config);
+
+/*
+ * uthread_watchdog_stop - Stop the watchdog
+ *
+ * Return: -1 if the watchdog does not run. 0 otherwise.
+ */
+int uthread_watchdog_stop(void);
+
+/* Default sampling frequency of the profiler (in Hz) */
+#define UTHREAD_PROFILE_HZ 1000
+
+/* Default number of samples the profiler keeps */
+#define UTHREAD_PROFILE_SAMPLES 65536
+
+/*
+ * uthread_profile_start - Start sampling the threads
+ * @hz: Samples per second of CPU time, or 0 for UTHREAD_PROFILE_HZ
+ * @max_samples: Samples kept at most, the later ones being dropped, or 0 for
+ *	UTHREAD_PROFILE_SAMPLES
+ *
+ * SIGPROF interrupts the system thread calling this function, the one running
+ * the threads, which records the running thread and its stack, found by
+ * following the frame pointers: code built with -fno-omit-frame-pointer (and
+ * -mno-omit-leaf-frame-pointer on x86) unwinds fully, other frames may be
+ * skipped. The signal comes from a perf event counting the CPU time spent in
+ * user space, or if perf events are not available, from ITIMER_PROF, which
+ * counts the time in the kernel too but only expires on the ticks of the
+ * kernel (250 Hz at most on many systems). Either runs apart from the
+ * preemption ticks, which it does not delay. The samples of the last run are
+ * discarded.
+ *
+ * Return: -1 if @hz is above 1000000, if the profiler already runs, or in case
+ * of failure (memory allocation). 0 otherwise.
+ */
+int uthread_profile_start(unsigned int hz, unsigned int max_samples);
+
+/*
+ * uthread_profile_stop - Stop sampling the threads
+ *
+ * The samples are kept until the next uthread_profile_start().
+ *
+ * Return: -1 if the profiler does not run. The number of samples dropped for
+ * lack of room otherwise.
+ */
+int uthread_profile_stop(void);
+
+/*
+ * uthread_profile_write - Write the profile as folded stacks
+ * @fd: File descriptor to write to
+ *
+ * Writes a line per distinct stack, as read by flamegraph.pl: the thread
+ * ("uthread-<TID>") then its frames, outermost first, separated by ';', and
+ * the number of samples taken in that stack. Frames are named after their
+ * function if it is exported (programs linked with -rdynamic), or else
+ * written as an offset in their file.
+ *
+ * Return: -1 if the profiler runs or in case of failure. The number of samples
+ * written otherwise.
+ */
+int uthread_profile_write(int fd);
+
+/*
+ * uthread_dump - Describe every thread
+ * @out: Stream to write to
+ *
+ * Writes a paragraph per thread: its TID and name, its state (and what it
+ * waits for if blocked), the thread it joins, how much of its stack it uses,
+ * and its backtrace, found by following the frame pointers from its saved
+ * context (see uthread_profile_start() about frame pointers). The running
+ * thread is the one calling this function. Preemption is disabled meanwhile,
+ * the threads staying as they are.
+ *
+ * Return: -1 if @out is NULL. The number of threads otherwise.
+ */
+int uthread_dump(FILE *out);
+
+/*
+ * uthread_dump_on_signal - Dump the threads when a signal is received
+ * @signum: Signal triggering uthread_dump() on the standard error, SIGUSR2
+ *	typically, or 0 to stop
+ *
+ * Lets a hung program be inspected with `kill -USR2`. The running thread is
+ * then the one the signal interrupted. If it was in a critical section of the
+ * library, the dump is made shortly after instead, once the threads are
+ * consistent again; in the cooperative-only library, where the critical
+ * sections are not marked, it is made right away. Must be called from the
+ * system thread running the threads, the one the signal is sent to in the
+ * end.
+ *
+ * Signal handlers cannot look up symbols: the backtraces of these dumps hold
+ * the addresses of the frames, to be resolved with addr2line (minus the load
+ * address found in /proc/PID/maps for a position-independent executable).
+ *
+ * Return: -1 if @signum is invalid, if another signal already triggers dumps
+ * or none does (@signum 0), or in case of failure. 0 otherwise.
+ */
+int uthread_dump_on_signal(int signum);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* _THREAD_H */
@@ -0,0 +1,409 @@
+#ifndef _UTHREAD_HPP
+#define _UTHREAD_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define UTHREAD_COROUTINES 1
+#endif
+
+#include "uthread.h"
+
+/*
+ * C++ binding
+ *
+ * Threads run any callable (lambdas especially), stored in the thread itself
+ * when it fits in UTHREAD_INLINE_SIZE bytes, on the heap otherwise. Handles
+ * join their thread when they go out of scope. With C++20, coroutines can
+ * co_await joins and blocking calls, which then run on a worker thread.
+ */
+namespace uthread {
+
+namespace detail {
+
+/* Return value of a thread running @fn, 0 for callables returning nothing */
+template <class Fn>
+int invoke(Fn &fn)
+{
+	if constexpr (std::is_void_v<std::invoke_result_t<Fn &>>) {
+		fn();
+		return 0;
+	} else {
+		return static_cast<int>(fn());
+	}
+}
+
+template <class Fn>
+constexpr bool fits_inline = sizeof(Fn) <= UTHREAD_INLINE_SIZE &&
+	alignof(Fn) <= alignof(std::max_align_t);
+
+/* Builds the callable in the thread, from the one given to spawn() */
+template <class F>
+void construct(void *mem, void *arg) noexcept
+{
+	using Fn = std::decay_t<F>;
+	new (mem) Fn(std::forward<F>(*static_cast<std::remove_reference_t<F> *>(arg)));
+}
+
+/* Thread function of a callable stored in the thread, which destroys it */
+template <class Fn>
+int run_inline(void *arg) noexcept
+{
+	Fn &fn = *static_cast<Fn *>(arg);
+	int ret = invoke(fn);
+
+	fn.~Fn();
+	return ret;
+}
+
+/* Thread function of a callable allocated on the heap, which frees it */
+template <class Fn>
+int run_heap(void *arg) noexcept
+{
+	Fn *fn = static_cast<Fn *>(arg);
+	int ret = invoke(*fn);
+
+	delete fn;
+	return ret;
+}
+
+} // namespace detail
+
+/*
+ * handle - Joinable thread
+ *
+ * Move-only owner of a thread, which joins it when destroyed unless it was
+ * joined or detached before. An empty handle (default-constructed, moved from,
+ * or returned by a failed spawn()) owns no thread.
+ */
+class handle {
+public:
+	handle() noexcept = default;
+	explicit handle(int tid) noexcept : tid_(tid) {}
+	handle(handle &&other) noexcept : tid_(std::exchange(other.tid_, -1)) {}
+	handle &operator=(handle &&other) noexcept
+	{
+		if (this != &other) {
+			if (joinable())
+				join();
+			tid_ = std::exchange(other.tid_, -1);
+		}
+		return *this;
+	}
+	handle(const handle &) = delete;
+	handle &operator=(const handle &) = delete;
+	~handle()
+	{
+		if (joinable())
+			join();
+	}
+
+	bool joinable() const noexcept { return tid_ != -1; }
+	explicit operator bool() const noexcept { return joinable(); }
+	uthread_t id() const noexcept { return static_cast<uthread_t>(tid_); }
+
+	/* Return value of the thread, -1 if there is no thread to join */
+	int join() noexcept
+	{
+		int ret = -1;
+
+		if (joinable() && uthread_join(id(), &ret) == -1)
+			ret = -1;
+		tid_ = -1;
+		return ret;
+	}
+
+	void detach() noexcept
+	{
+		if (joinable())
+			uthread_detach(id());
+		tid_ = -1;
+	}
+
+	/* Gives up the thread without joining nor detaching it */
+	uthread_t release() noexcept
+	{
+		return static_cast<uthread_t>(std::exchange(tid_, -1));
+	}
+
+private:
+	int tid_ = -1;
+};
+
+/*
+ * spawn - Create a thread running a callable
+ * @f: Callable taking no argument, returning nothing or a value convertible
+ *	to int (the return value of the thread)
+ *
+ * Return: Handle of the new thread, empty in case of failure
+ */
+template <class F>
+handle spawn(F &&f)
+{
+	using Fn = std::decay_t<F>;
+
+	if constexpr (detail::fits_inline<Fn>) {
+		return handle(uthread_create_inline(detail::run_inline<Fn>,
+						    sizeof(Fn),
+						    detail::construct<F>,
+						    std::addressof(f)));
+	} else {
+		Fn *fn = new (std::nothrow) Fn(std::forward<F>(f));
+
+		if (fn == nullptr)
+			return handle();
+		int tid = uthread_create(detail::run_heap<Fn>, fn);
+		if (tid == -1)
+			delete fn;
+		return handle(tid);
+	}
+}
+
+#ifdef UTHREAD_COROUTINES
+namespace detail {
+
+/* Await waiting for a worker to make the call, then resume the coroutine */
+struct await_job {
+	await_job *next;
+	void (*call)(await_job *job) noexcept;
+	std::coroutine_handle<> coro;
+};
+
+/*
+ * Awaits queue their jobs here, to be taken by the workers. Idle workers block
+ * on @word, bumped by every new job, so that awaits reuse them rather than
+ * creating a thread each. A worker resuming a coroutine checks the queue
+ * again afterwards: @runner is its TID until an await made from it relies on
+ * that rather than on another worker, -1 otherwise. The lock only guards
+ * against preemption.
+ */
+struct await_pool {
+	std::atomic_flag lock = ATOMIC_FLAG_INIT;
+	await_job *head = nullptr;
+	await_job *tail = nullptr;
+	unsigned int word = 0;
+	int runner = -1;
+};
+
+inline await_pool pool;
+
+inline void pool_lock() noexcept
+{
+	while (pool.lock.test_and_set(std::memory_order_acquire))
+		uthread_yield(); // let the thread holding it go on
+}
+
+inline void pool_unlock() noexcept
+{
+	pool.lock.clear(std::memory_order_release);
+}
+
+/* Takes @job out of the queue, false if a worker already took it */
+inline bool pool_remove(await_job *job) noexcept
+{
+	await_job *prev = nullptr;
+
+	for (await_job *it = pool.head; it != nullptr; prev = it, it = it->next) {
+		if (it != job)
+			continue;
+		(prev != nullptr ? prev->next : pool.head) = job->next;
+		if (pool.tail == job)
+			pool.tail = prev;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Thread function of the workers, which run the jobs of the queue and block
+ * while it is empty. Idle workers are daemons: uthread_run() does not wait
+ * for them, only for the calls in progress.
+ */
+inline int await_worker(void *) noexcept
+{
+	int self = uthread_self();
+
+	for (;;) {
+		pool_lock();
+		if (pool.runner == self)
+			pool.runner = -1;
+		await_job *job = pool.head;
+		if (job != nullptr) {
+			pool.head = job->next;
+			if (pool.head == nullptr)
+				pool.tail = nullptr;
+			pool_unlock();
+			job->call(job);
+
+			std::coroutine_handle<> coro = job->coro;
+			pool_lock();
+			pool.runner = self;
+			pool_unlock();
+			coro.resume(); // the job may be gone afterwards
+			continue;
+		}
+		unsigned int word = pool.word;
+		pool_unlock();
+
+		uthread_set_daemon(self, 1);
+		int ret = uthread_futex_wait(&pool.word, word, -1);
+		int err = errno;
+		uthread_set_daemon(self, 0);
+		if (ret == -1 && err == EDEADLK)
+			return 0; // no job can come anymore
+	}
+}
+
+/*
+ * Queues @job for a worker, waking an idle one or creating a new one
+ *
+ * Return: false if there is no worker for it, the job being left out of the
+ * queue. True otherwise.
+ */
+inline bool pool_submit(await_job *job) noexcept
+{
+	bool checked;
+
+	job->next = nullptr;
+	pool_lock();
+	(pool.tail != nullptr ? pool.tail->next : pool.head) = job;
+	pool.tail = job;
+	pool.word++;
+	/* Awaits from a job are usually taken by its own worker */
+	checked = pool.runner == uthread_self();
+	if (checked)
+		pool.runner = -1;
+	pool_unlock();
+
+	/* A worker woken, or created, always checks the queue again */
+	if (checked || uthread_futex_wake(&pool.word, 1) == 1)
+		return true;
+	int tid = uthread_create(await_worker, nullptr);
+	if (tid != -1) {
+		uthread_detach(static_cast<uthread_t>(tid));
+		return true;
+	}
+
+	pool_lock();
+	bool queued = pool_remove(job);
+	pool_unlock();
+	return !queued;
+}
+
+} // namespace detail
+
+/*
+ * awaitable - Blocking call run on a worker thread
+ *
+ * Awaiting it suspends the coroutine and queues it for a worker thread, which
+ * makes the call then resumes the coroutine with its result. Workers are kept
+ * once idle, blocked on a futex, so that an await wakes one rather than
+ * creating a thread (and its stack) when one is available: there are as many
+ * workers as there were calls in progress at once. If no worker can be
+ * created, the call is made right away instead.
+ */
+template <class Op>
+class awaitable : private detail::await_job {
+public:
+	using result_type = std::invoke_result_t<Op &>;
+
+	explicit awaitable(Op op) : op_(std::move(op)) {}
+
+	bool await_ready() const noexcept { return false; }
+
+	bool await_suspend(std::coroutine_handle<> coro)
+	{
+		this->coro = coro;
+		call = call_op;
+		if (detail::pool_submit(this))
+			return true;
+		result_ = op_();
+		return false; // resumes the coroutine right away
+	}
+
+	result_type await_resume() { return std::move(result_); }
+
+private:
+	static void call_op(detail::await_job *job) noexcept
+	{
+		awaitable *self = static_cast<awaitable *>(job);
+
+		self->result_ = self->op_();
+	}
+
+	Op op_;
+	result_type result_{};
+};
+
+/*
+ * async_call - Await any blocking callable
+ * @op: Callable taking no argument, returning a value (not void)
+ */
+template <class Op>
+awaitable<std::decay_t<Op>> async_call(Op &&op)
+{
+	return awaitable<std::decay_t<Op>>(std::forward<Op>(op));
+}
+
+/*
+ * async_join - Await the end of a thread
+ * @thread: Handle of the thread, which gives it up
+ *
+ * The result of co_await is the return value of the thread, -1 if it could not
+ * be joined.
+ */
+inline auto async_join(handle &&thread)
+{
+	return async_call([tid = static_cast<int>(thread.joinable() ?
+			   thread.release() : -1)] {
+		int ret = -1;
+
+		if (tid != -1 && uthread_join(static_cast<uthread_t>(tid),
+					       &ret) == -1)
+			ret = -1;
+		return ret;
+	});
+}
+
+/* Await uthread_pread(), the result of co_await being its return value */
+inline auto async_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	return async_call([=] { return uthread_pread(fd, buf, count, offset); });
+}
+
+/* Await uthread_pwrite(), the result of co_await being its return value */
+inline auto async_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	return async_call([=] { return uthread_pwrite(fd, buf, count, offset); });
+}
+
+/* Await uthread_recv(), the result of co_await being its return value */
+inline auto async_recv(int fd, void *buf, size_t len, int flags)
+{
+	return async_call([=] { return uthread_recv(fd, buf, len, flags); });
+}
+
+/* Await uthread_send(), the result of co_await being its return value */
+inline auto async_send(int fd, const void *buf, size_t len, int flags)
+{
+	return async_call([=] { return uthread_send(fd, buf, len, flags); });
+}
+
+/* Await uthread_sleep_ns(), the result of co_await being 0 */
+inline auto async_sleep_ns(unsigned long long ns)
+{
+	return async_call([=] {
+		uthread_sleep_ns(ns);
+		return 0;
+	});
+}
+#endif /* UTHREAD_COROUTINES */
+
+} // namespace uthread
+
+#endif /* _UTHREAD_HPP */
@@ -0,0 +1,269 @@
+#include <errno.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "preempt.h"
+#include "sigsafe.h"
+#include "watchdog.h"
+
+/* Length of a quantum, the period of the preemption timer (in ns) */
+#define QUANTUM_NS 10000000ULL
+
+/* Bounds of the sampling period of the monitor (in ns) */
+#define MIN_PERIOD_NS 1000000ULL
+#define MAX_PERIOD_NS 100000000ULL
+
+/* Most frames of a logged backtrace */
+#define MAX_FRAMES 32
+
+struct watchdog_probe watchdog_probe;
+
+/* Settings, fixed while the monitor runs */
+static struct uthread_watchdog_config config;
+static watchdog_inspect_t inspect = NULL;
+static pthread_t sched_thread; // system thread running the threads
+static clockid_t sched_clock; // its CPU time clock
+static struct sigaction old_action; // handler of WATCHDOG_SIGNAL before
+static int running = 0;
+
+/* Monitor thread, woken early to stop */
+static pthread_t monitor;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static int stopping = 0;
+
+/* Suspicion handed from the monitor to the handler, one at a time: the
+   monitor fills it in only while pending is 0 */
+static volatile int pending = 0;
+static enum uthread_watchdog_event pending_event;
+static uint64_t pending_ns;
+
+/* Returns the time of @clock (in ns) */
+static uint64_t clock_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Checks the event handed by the monitor, on the system thread running the
+   threads, and handles it if it is confirmed. The backtrace was loaded by
+   watchdog_start(), everything else here is async-signal-safe. */
+static void watchdog_handler(int signum, siginfo_t* info, void* ucontext)
+{
+  (void)signum;
+  (void)info;
+  if (!__atomic_load_n(&pending, __ATOMIC_ACQUIRE))
+    return; // sent by someone else
+  int saved_errno = errno;
+  enum uthread_watchdog_event event = pending_event;
+  uint64_t ns = pending_ns;
+  uthread_t tid, oldest;
+  uint64_t waited;
+  int confirmed = 0;
+  inspect(&tid, &oldest, &waited);
+
+  struct sigsafe_line line = { .len = 0 };
+  switch (event) {
+  case UTHREAD_WATCHDOG_RUNAWAY:
+    sigsafe_str(&line, "uthread watchdog: thread ");
+    sigsafe_dec(&line, tid);
+    sigsafe_str(&line, " ran for ");
+    sigsafe_dec(&line, ns / 1000000);
+    sigsafe_str(&line, " ms without switching\n");
+    break;
+  case UTHREAD_WATCHDOG_MASKED:
+    if (!preempt_masked(ucontext))
+      goto out; // it was in the kernel, not masking ticks
+    sigsafe_str(&line, "uthread watchdog: thread ");
+    sigsafe_dec(&line, tid);
+    sigsafe_str(&line, " ran for ");
+    sigsafe_dec(&line, ns / 1000000);
+    sigsafe_str(&line, " ms with preemption disabled\n");
+    break;
+  case UTHREAD_WATCHDOG_STARVED:
+    if (waited < config.wait_ns)
+      goto out; // the ones waiting at the last switch ran meanwhile
+    sigsafe_str(&line, "uthread watchdog: thread ");
+    sigsafe_dec(&line, oldest);
+    sigsafe_str(&line, " waited ");
+    sigsafe_dec(&line, waited / 1000000);
+    sigsafe_str(&line, " ms to run, thread ");
+    sigsafe_dec(&line, tid);
+    sigsafe_str(&line, " running\n");
+    tid = oldest;
+    ns = waited;
+    break;
+  }
+  confirmed = 1;
+  if (sigsafe_write(&line, STDERR_FILENO) == -1)
+    goto out; // nowhere to log to, the hook still decides
+  /* The frames of the running thread, below the one of this handler */
+  void* frames[MAX_FRAMES];
+  int nb_frames = backtrace(frames, MAX_FRAMES);
+  backtrace_symbols_fd(frames + 1, nb_frames - 1, STDERR_FILENO);
+
+out:
+  if (confirmed) {
+    enum uthread_watchdog_action action = UTHREAD_WATCHDOG_LOG;
+    if (config.hook != NULL)
+      action = config.hook(event, tid, ns);
+    if (action == UTHREAD_WATCHDOG_ABORT)
+      abort();
+    if (action == UTHREAD_WATCHDOG_YIELD) {
+      if (event == UTHREAD_WATCHDOG_MASKED)
+        preempt_unmask(ucontext);
+      else
+        preempt_force(ucontext);
+    }
+  }
+  __atomic_store_n(&pending, 0, __ATOMIC_RELEASE);
+  errno = saved_errno;
+}
+
+/* Hands an event to the handler */
+static void report(enum uthread_watchdog_event event, uint64_t ns)
+{
+  pending_event = event;
+  pending_ns = ns;
+  __atomic_store_n(&pending, 1, __ATOMIC_RELEASE);
+  pthread_kill(sched_thread, WATCHDOG_SIGNAL);
+}
+
+/* Samples the scheduler until stopped. Each check has a time at which it
+   reports, pushed back whenever what it watches moves on. */
+static void* monitor_main(void* arg)
+{
+  (void)arg;
+  uint64_t run_limit = config.run_quanta * QUANTUM_NS;
+  uint64_t period = MAX_PERIOD_NS;
+  if (run_limit != 0 && run_limit / 4 < period)
+    period = run_limit / 4;
+  if (config.masked_ns != 0 && config.masked_ns / 4 < period)
+    period = config.masked_ns / 4;
+  if (config.wait_ns != 0 && config.wait_ns / 4 < period)
+    period = config.wait_ns / 4;
+  if (period < MIN_PERIOD_NS)
+    period = MIN_PERIOD_NS;
+
+  unsigned long switches = watchdog_probe.switches;
+  unsigned long ticks = preempt_ticks();
+  uint64_t cpu = clock_ns(sched_clock);
+  uint64_t wall = clock_ns(CLOCK_MONOTONIC);
+  uint64_t switch_cpu = cpu, switch_wall = wall, tick_cpu = cpu;
+  uint64_t run_at = cpu + run_limit; // CPU time
+  uint64_t masked_at = cpu + config.masked_ns; // CPU time
+  uint64_t wait_at = wall + config.wait_ns; // wall time
+
+  pthread_mutex_lock(&lock);
+  while (!stopping) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += period;
+    until.tv_sec += until.tv_nsec / 1000000000;
+    until.tv_nsec %= 1000000000;
+    pthread_cond_timedwait(&wakeup, &lock, &until);
+    if (stopping)
+      break;
+
+    cpu = clock_ns(sched_clock);
+    wall = clock_ns(CLOCK_MONOTONIC);
+    unsigned long now_switches =
+      __atomic_load_n(&watchdog_probe.switches, __ATOMIC_RELAXED);
+    if (now_switches != switches) {
+      switches = now_switches;
+      switch_cpu = cpu;
+      switch_wall = wall;
+      run_at = cpu + run_limit;
+      wait_at = wall + config.wait_ns;
+    }
+    unsigned long now_ticks = preempt_ticks();
+    if (now_ticks != ticks) {
+      ticks = now_ticks;
+      tick_cpu = cpu;
+      masked_at = cpu + config.masked_ns;
+    }
+    if (__atomic_load_n(&pending, __ATOMIC_ACQUIRE))
+      continue; // the last event was not handled yet
+
+    /* One event per sample at most, the others are seen at the next one */
+    if (run_limit != 0 && cpu >= run_at) {
+      report(UTHREAD_WATCHDOG_RUNAWAY, cpu - switch_cpu);
+      run_at = cpu + run_limit;
+    } else if (config.masked_ns != 0 && ticks > 0 && cpu >= masked_at) {
+      // no tick for that long, the handler checks whether they are masked
+      report(UTHREAD_WATCHDOG_MASKED, cpu - tick_cpu);
+      masked_at = cpu + config.masked_ns;
+    } else if (config.wait_ns != 0 && wall >= wait_at &&
+               __atomic_load_n(&watchdog_probe.ready, __ATOMIC_RELAXED) > 0) {
+      report(UTHREAD_WATCHDOG_STARVED, wall - switch_wall);
+      wait_at = wall + config.wait_ns;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  return NULL;
+}
+
+int watchdog_start(const struct uthread_watchdog_config* cfg,
+                   watchdog_inspect_t fn)
+{
+  if (running)
+    return -1;
+
+  config = *cfg;
+  inspect = fn;
+  sched_thread = pthread_self();
+  if (pthread_getcpuclockid(sched_thread, &sched_clock) != 0)
+    return -1;
+  /* The first backtrace loads the unwinder, which must not happen in the
+     handler */
+  void* frame;
+  backtrace(&frame, 1);
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = watchdog_handler;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigaddset(&action.sa_mask, SIGVTALRM); // no tick while it runs
+  sigaction(WATCHDOG_SIGNAL, &action, &old_action);
+
+  /* Like the helpers, the monitor takes none of the signals */
+  stopping = 0;
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int ret = pthread_create(&monitor, NULL, monitor_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (ret != 0) {
+    sigaction(WATCHDOG_SIGNAL, &old_action, NULL);
+    return -1;
+  }
+  running = 1;
+
+  return 0;
+}
+
+int watchdog_stop(void)
+{
+  if (!running)
+    return -1;
+
+  pthread_mutex_lock(&lock);
+  stopping = 1;
+  pthread_cond_signal(&wakeup);
+  pthread_mutex_unlock(&lock);
+  pthread_join(monitor, NULL);
+  /* An event sent last may still be delivered, with nothing pending */
+  __atomic_store_n(&pending, 0, __ATOMIC_RELEASE);
+  sigaction(WATCHDOG_SIGNAL, &old_action, NULL);
+  running = 0;
+
+  return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef _WATCHDOG_H
+#define _WATCHDOG_H
+
+#include <signal.h>
+#include <stdint.h>
+
+#include "uthread.h"
+
+/* Signal interrupting the system thread running the threads */
+#define WATCHDOG_SIGNAL SIGURG
+
+/*
+ * struct watchdog_probe - Scheduler state sampled by the monitor
+ * @switches: Context switches since the start
+ * @ready: Threads left waiting in the ready queues at the last switch
+ *
+ * Written by the scheduler at every switch, with relaxed atomic stores, and
+ * read by the monitor from its own system thread.
+ */
+struct watchdog_probe {
+	unsigned long switches;
+	int ready;
+};
+
+extern struct watchdog_probe watchdog_probe;
+
+/*
+ * watchdog_inspect_t - Look at the threads from the signal handler
+ * @running: Receives the TID of the running thread
+ * @oldest: Receives the TID of the ready thread which waited the longest
+ * @waited: Receives how long it waited (in ns), 0 if no thread is ready
+ */
+typedef void (*watchdog_inspect_t)(uthread_t *running, uthread_t *oldest,
+				   uint64_t *waited);
+
+/*
+ * watchdog_start - Start the monitor
+ * @config: Thresholds and hook, copied
+ * @inspect: Function giving the threads involved in an event
+ *
+ * Must be called from the system thread running the threads, which the
+ * monitor then interrupts with WATCHDOG_SIGNAL on a suspicion.
+ *
+ * Return: -1 if the monitor already runs or in case of failure, 0 otherwise
+ */
+int watchdog_start(const struct uthread_watchdog_config *config,
+		   watchdog_inspect_t inspect);
+
+/*
+ * watchdog_stop - Stop the monitor
+ *
+ * Return: -1 if the monitor does not run, 0 otherwise
+ */
+int watchdog_stop(void);
+
+#endif /* _WATCHDOG_H */
@@ -0,0 +1,255 @@
+/*
+ * Actor benchmark
+ *
+ * The semantics of actors are checked first (order of the messages, batches,
+ * actors sending to themselves, stopping, sending to threads which are not
+ * actors). Then ACTORS actors form a ring passing tokens around: SPARSE tokens
+ * making SPARSE_HOPS hops each, so that most actors have nothing to do, then
+ * DENSE tokens, several per actor, making DENSE_HOPS hops each.
+ * Rings are made of:
+ * - poll: plain threads polling a queue of their own, with uthread_yield()
+ *   while it is empty
+ * - actor, batch 1: actors handling one message per activation
+ * - actor, batch N: actors handling up to UTHREAD_ACTOR_BATCH messages per
+ *   activation
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+#include <uthread.h>
+
+#define ACTORS 10000
+#define SPARSE 100
+#define SPARSE_HOPS 200
+#define DENSE 50000
+#define DENSE_HOPS 20
+#define STRIDE 7919 // prime, the ring visits every node out of creation order
+
+struct token {
+	struct uthread_msg link;
+	int hops; // hops left
+};
+
+/* Member of the ring */
+struct node {
+	uthread_t tid; // its thread
+	struct node *next; // next one in the ring
+	struct uthread_msg *head, *tail; // queue of the poll mode
+};
+
+static struct node nodes[ACTORS];
+static struct token tokens[DENSE];
+static struct uthread_msg stop_msg;
+static int finished, nb_tokens;
+static int stop;
+static int use_actors;
+static unsigned long handled;
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Records the messages it handles, stops at stop_msg */
+int recorder(void *state, struct uthread_msg *msg)
+{
+	struct uthread_msg **log = state;
+
+	if (msg == &stop_msg)
+		return 42;
+	log[handled++] = msg;
+	return 0;
+}
+
+/* Sends its message back to itself, stops at stop_msg */
+int echo(void *state, struct uthread_msg *msg)
+{
+	unsigned long *count = state;
+
+	if (msg == &stop_msg)
+		return 42;
+	(*count)++;
+	assert(uthread_actor_send(uthread_self(), msg) == 0);
+	return 0;
+}
+
+int plain(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+static void check(void)
+{
+	struct uthread_msg msgs[5], *log[5];
+	uthread_t tid;
+	int ret;
+
+	assert(uthread_actor_spawn(NULL, NULL) == -1);
+	tid = uthread_create(plain, NULL);
+	assert(uthread_actor_send(tid, &msgs[0]) == -1); // not an actor
+	assert(uthread_actor_send(0, &msgs[0]) == -1);
+	assert(uthread_join(tid, NULL) == 0);
+
+	/* In order, by batches */
+	handled = 0;
+	tid = uthread_actor_spawn(recorder, log);
+	assert(tid != (uthread_t)-1);
+	assert(uthread_actor_send(tid, NULL) == -1);
+	assert(uthread_actor_set_batch(tid, 0) == -1);
+	assert(uthread_actor_set_batch(tid, 2) == 0);
+	for (int i = 0; i < 5; i++)
+		assert(uthread_actor_send(tid, &msgs[i]) == 0);
+	uthread_yield();
+	assert(handled > 0 && handled <= 2); // then it let us run
+	while (handled < 5)
+		uthread_yield();
+	for (int i = 0; i < 5; i++)
+		assert(log[i] == &msgs[i]);
+	uthread_yield(); // blocked on its empty mailbox
+	assert(handled == 5);
+
+	/* A batch spans the grabs of the mailbox: an actor sending to itself
+	   handles one message per turn, give or take a preemption */
+	unsigned long echoes = 0;
+	struct uthread_msg echo_msg;
+	uthread_t echo_tid = uthread_actor_spawn(echo, &echoes);
+	assert(uthread_actor_set_batch(echo_tid, 1) == 0);
+	assert(uthread_actor_send(echo_tid, &echo_msg) == 0);
+	for (int i = 0; i < 100; i++) {
+		unsigned long before = echoes;
+
+		uthread_yield();
+		assert(echoes - before >= 1 && echoes - before <= 2);
+	}
+	assert(uthread_actor_send(echo_tid, &stop_msg) == 0);
+	assert(uthread_join(echo_tid, &ret) == 0 && ret == 42);
+
+	/* Stopped by its handler, then by lack of senders */
+	assert(uthread_actor_send(tid, &stop_msg) == 0);
+	assert(uthread_join(tid, &ret) == 0 && ret == 42);
+	assert(uthread_actor_send(tid, &msgs[0]) == -1);
+	tid = uthread_actor_spawn(recorder, log);
+	assert(uthread_join(tid, &ret) == 0 && ret == -1);
+}
+
+/* Hands a token to a node */
+static void deliver(struct node *node, struct token *token)
+{
+	if (use_actors) {
+		assert(uthread_actor_send(node->tid, &token->link) == 0);
+		return;
+	}
+	token->link.next = NULL;
+	if (node->tail != NULL)
+		node->tail->next = &token->link;
+	else
+		node->head = &token->link;
+	node->tail = &token->link;
+}
+
+/* Forwards a token, or counts it once it made all its hops */
+static void pass(struct node *node, struct token *token)
+{
+	if (--token->hops > 0)
+		deliver(node->next, token);
+	else if (++finished == nb_tokens)
+		uthread_unpark(0);
+}
+
+int ring_actor(void *state, struct uthread_msg *msg)
+{
+	if (msg == &stop_msg)
+		return 1;
+	pass(state, (struct token *)msg);
+	return 0;
+}
+
+int ring_poller(void *arg)
+{
+	struct node *node = arg;
+
+	while (!stop) {
+		struct uthread_msg *msg = node->head;
+
+		if (msg == NULL) {
+			uthread_yield();
+			continue;
+		}
+		node->head = node->tail = NULL;
+		while (msg != NULL) {
+			struct uthread_msg *next = msg->next;
+
+			pass(node, (struct token *)msg);
+			msg = next;
+		}
+	}
+	return 0;
+}
+
+static void bench_ring(const char *name, int tokens_per_ring, int hops,
+		       int batch)
+{
+	double start = now_s();
+
+	finished = stop = 0;
+	nb_tokens = tokens_per_ring;
+	for (int i = 0; i < ACTORS; i++) {
+		nodes[i].next = &nodes[(i + STRIDE) % ACTORS];
+		nodes[i].head = nodes[i].tail = NULL;
+		if (use_actors) {
+			nodes[i].tid = uthread_actor_spawn(ring_actor,
+							   &nodes[i]);
+			assert(uthread_actor_set_batch(nodes[i].tid,
+						       batch) == 0);
+		} else {
+			nodes[i].tid = uthread_create(ring_poller, &nodes[i]);
+		}
+	}
+	/* Tokens start spread around the ring */
+	for (int i = 0; i < nb_tokens; i++) {
+		tokens[i].hops = hops;
+		deliver(&nodes[i % ACTORS], &tokens[i]);
+	}
+	while (finished < nb_tokens)
+		uthread_park();
+	double elapsed = now_s() - start;
+
+	if (use_actors) {
+		for (int i = 0; i < ACTORS; i++)
+			assert(uthread_actor_send(nodes[i].tid,
+						  &stop_msg) == 0);
+	}
+	stop = 1;
+	for (int i = 0; i < ACTORS; i++)
+		assert(uthread_join(nodes[i].tid, NULL) == 0);
+	printf("%-6s %-16s: %6.0f ns per hop\n",
+	       nb_tokens == SPARSE ? "sparse" : "dense", name,
+	       elapsed * 1e9 / ((double)nb_tokens * hops));
+}
+
+int main(void)
+{
+	static const int nb[] = { SPARSE, DENSE };
+	static const int hops[] = { SPARSE_HOPS, DENSE_HOPS };
+	char name[32];
+
+	check();
+
+	snprintf(name, sizeof(name), "actor, batch %d", UTHREAD_ACTOR_BATCH);
+	for (int i = 0; i < 2; i++) {
+		use_actors = 0;
+		bench_ring("poll", nb[i], hops[i], 0);
+		use_actors = 1;
+		bench_ring("actor, batch 1", nb[i], hops[i], 1);
+		bench_ring(name, nb[i], hops[i], UTHREAD_ACTOR_BATCH);
+	}
+
+	return 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * Arena allocation benchmark
+ *
+ * Request handlers allocate OBJECTS small objects of random sizes, link them,
+ * yield halfway (as if waiting for I/O, so that the allocations of concurrent
+ * requests interleave), walk them, and free them all. The objects come either
+ * from malloc() and are freed one by one, or from the arena of the thread and
+ * are freed at once. Requests run either on WORKERS long-lived threads, which
+ * reset their arena between requests, or on a thread each, whose arena is
+ * released when it exits.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#include <uthread.h>
+
+#define REQUESTS 20000
+#define WORKERS 8
+#define OBJECTS 256
+#define MAX_SIZE 512
+
+struct object {
+	struct object *next;
+	size_t size;
+};
+
+static int use_arena;
+static unsigned long checksum;
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void request(unsigned int seed)
+{
+	struct object *head = NULL;
+	unsigned long sum = 0;
+
+	for (int i = 0; i < OBJECTS; i++) {
+		size_t size;
+		struct object *obj;
+
+		seed = seed * 1103515245 + 12345;
+		size = sizeof(struct object) + (seed >> 16) % MAX_SIZE;
+		obj = use_arena ? uthread_arena_alloc(size) : malloc(size);
+		assert(obj != NULL);
+		memset(obj, 0, size);
+		obj->size = size;
+		obj->next = head;
+		head = obj;
+		if (i == OBJECTS / 2)
+			uthread_yield();
+	}
+	for (struct object *obj = head; obj != NULL; obj = obj->next)
+		sum += obj->size;
+	checksum += sum;
+
+	if (use_arena) {
+		uthread_arena_reset();
+		return;
+	}
+	while (head != NULL) {
+		struct object *next = head->next;
+
+		free(head);
+		head = next;
+	}
+}
+
+int worker(void* arg)
+{
+	unsigned int id = (unsigned int)(long)arg;
+
+	for (unsigned int i = id; i < REQUESTS; i += WORKERS)
+		request(i);
+	return 0;
+}
+
+int handler(void* arg)
+{
+	request((unsigned int)(long)arg);
+	return 0;
+}
+
+static double run_workers(void)
+{
+	uthread_t tids[WORKERS];
+	double start = now_s();
+
+	for (long i = 0; i < WORKERS; i++)
+		tids[i] = uthread_create(worker, (void*)i);
+	for (int i = 0; i < WORKERS; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+	return now_s() - start;
+}
+
+static double run_threads(void)
+{
+	uthread_t tids[WORKERS];
+	double start = now_s();
+
+	for (long i = 0; i < REQUESTS; i += WORKERS) {
+		for (long j = 0; j < WORKERS; j++)
+			tids[j] = uthread_create(handler, (void*)(i + j));
+		for (int j = 0; j < WORKERS; j++)
+			assert(uthread_join(tids[j], NULL) == 0);
+	}
+	return now_s() - start;
+}
+
+static void report(const char *name, double elapsed)
+{
+	printf("%-20s: %7.0f requests/s, %5.1f ns per object\n", name,
+	       REQUESTS / elapsed, elapsed * 1e9 / REQUESTS / OBJECTS);
+}
+
+int main(void)
+{
+	unsigned long expected;
+
+	use_arena = 0;
+	report("workers, malloc", run_workers());
+	expected = checksum;
+	use_arena = 1;
+	report("workers, arena", run_workers());
+	assert(checksum == 2 * expected);
+
+	use_arena = 0;
+	report("thread each, malloc", run_threads());
+	use_arena = 1;
+	report("thread each, arena", run_threads());
+	assert(checksum == 4 * expected);
+
+	return 0;
+}
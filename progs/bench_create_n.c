@@ -0,0 +1,86 @@
+/*
+ * Bulk thread creation benchmark
+ *
+ * Compares creating n threads with a loop of uthread_create() against a single
+ * uthread_create_n() call, for n = 64, 1024 and 65535 (every available TID).
+ * The creation time, the time to run and join every thread, and their total
+ * are reported.
+ *
+ * With preemption (bench_create_n.x), ticks during a long loop let the threads
+ * created so far run and exit before the loop ends, so that part of their run
+ * counts as creation: only the totals compare. Without preemption
+ * (bench_create_n_coop.x), every thread runs after the creation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+#include <uthread.h>
+
+#define MAX_THREADS 65535
+
+static uthread_t tids[MAX_THREADS];
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int task(void* arg)
+{
+	return (int)(long)arg;
+}
+
+static void join_all(int n)
+{
+	int ret_val;
+
+	for (int i = 0; i < n; i++) {
+		assert(uthread_join(tids[i], &ret_val) == 0);
+		assert(ret_val == i);
+	}
+}
+
+static void bench(int n)
+{
+	static void *args[MAX_THREADS];
+	double start, created, joined;
+
+	for (int i = 0; i < n; i++)
+		args[i] = (void*)(long)i;
+
+	start = now_us();
+	for (int i = 0; i < n; i++) {
+		int tid = uthread_create(task, args[i]);
+		assert(tid != -1);
+		tids[i] = tid;
+	}
+	created = now_us();
+	join_all(n);
+	joined = now_us();
+	printf("n=%-6d uthread_create loop: create %10.1f us, run+join %10.1f us, "
+	       "total %10.1f us\n", n, created - start, joined - created,
+	       joined - start);
+
+	start = now_us();
+	assert(uthread_create_n(task, args, n, tids) == 0);
+	created = now_us();
+	join_all(n);
+	joined = now_us();
+	printf("n=%-6d uthread_create_n:    create %10.1f us, run+join %10.1f us, "
+	       "total %10.1f us\n", n, created - start, joined - created,
+	       joined - start);
+}
+
+int main(void)
+{
+	bench(64);
+	bench(1024);
+	bench(MAX_THREADS);
+	return 0;
+}
@@ -0,0 +1,232 @@
+/*
+ * Deadline scheduling benchmark
+ *
+ * Requests arrive at a fixed rate, each handled by a new thread which must
+ * finish within DEADLINE_MS of the arrival, while best-effort threads keep
+ * computing in the background. Each request needs SERVICE_US of CPU, done in
+ * chunks with a yield in between, like a handler doing I/O. The share of
+ * requests which missed their deadline is reported for several loads (CPU the
+ * requests need over CPU available), with:
+ * - rr: plain round-robin, requests without deadline
+ * - edf: requests scheduled earliest deadline first
+ * - edf+shed: same, requests which start after their deadline are shed
+ * Each run is in its own process, repeated RUNS times: the median is reported
+ * with the spread across runs. The chunks are calibrated once beforehand, on
+ * the CPU time of the process rather than the wall clock, taking the median of
+ * several measures so that a preempted one does not skew every run.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <uthread.h>
+
+#define REQUESTS 500
+#define SERVICE_US 1000
+#define CHUNKS 10
+#define DEADLINE_MS 10
+#define BACKGROUND 2
+#define RUNS 5
+#define CALIBRATIONS 9
+
+enum mode { RR, EDF, EDF_SHED };
+
+struct request {
+	unsigned long long arrival; // time of arrival (in ns)
+	unsigned long long finish; // time of completion (in ns), 0 if shed
+};
+
+static struct request requests[REQUESTS];
+static unsigned long chunk_loops; // iterations of a loop taking a chunk
+static volatile int stop;
+static enum mode mode;
+static double load;
+
+static unsigned long long clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned long long now_ns(void)
+{
+	return clock_ns(CLOCK_MONOTONIC);
+}
+
+static void chunk(void)
+{
+	volatile unsigned long sum = 0;
+
+	for (unsigned long i = 0; i < chunk_loops; i++)
+		sum += i;
+}
+
+int handler(void* arg)
+{
+	struct request *req = arg;
+
+	for (int i = 0; i < CHUNKS; i++) {
+		chunk();
+		uthread_yield();
+	}
+	req->finish = now_ns();
+	return 0;
+}
+
+int background(void* arg)
+{
+	(void)arg;
+	while (!stop) {
+		chunk();
+		uthread_yield();
+	}
+	return 0;
+}
+
+int generator(void* arg)
+{
+	static uthread_t tids[REQUESTS];
+	unsigned long long interval = SERVICE_US * 1000 / load;
+	unsigned long long start = now_ns();
+
+	(void)arg;
+	for (int i = 0; i < REQUESTS; i++) {
+		unsigned long long arrival = start + i * interval;
+		unsigned long long now = now_ns();
+
+		/* The generator must preempt the requests to keep the pace */
+		if (mode != RR)
+			uthread_set_deadline(uthread_self(), arrival);
+		if (arrival > now)
+			uthread_sleep_ns(arrival - now);
+		requests[i].arrival = arrival;
+		tids[i] = uthread_create(handler, &requests[i]);
+		assert(tids[i] != -1);
+		if (mode != RR)
+			uthread_set_deadline(tids[i],
+					     arrival + DEADLINE_MS * 1000000ULL);
+	}
+	uthread_set_deadline(uthread_self(), 0);
+	for (int i = 0; i < REQUESTS; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+	stop = 1;
+	return 0;
+}
+
+/* Outcome of a run, in requests */
+struct outcome {
+	int missed; // late or shed
+	int shed;
+};
+
+static struct outcome run(void)
+{
+	uthread_t tids[BACKGROUND + 1];
+	struct outcome out = { 0, 0 };
+
+	uthread_set_shedding(mode == EDF_SHED);
+	for (int i = 0; i < BACKGROUND; i++)
+		tids[i] = uthread_create(background, NULL);
+	tids[BACKGROUND] = uthread_create(generator, NULL);
+	for (int i = 0; i <= BACKGROUND; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+
+	for (int i = 0; i < REQUESTS; i++) {
+		if (requests[i].finish == 0)
+			out.shed++;
+		if (requests[i].finish == 0 || requests[i].finish >
+		    requests[i].arrival + DEADLINE_MS * 1000000ULL)
+			out.missed++;
+	}
+	return out;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static int cmp_outcome(const void *a, const void *b)
+{
+	const struct outcome *x = a, *y = b;
+
+	return (x->missed > y->missed) - (x->missed < y->missed);
+}
+
+static void calibrate(void)
+{
+	unsigned long loops[CALIBRATIONS];
+
+	for (int i = 0; i < CALIBRATIONS; i++) {
+		unsigned long long start;
+
+		chunk_loops = 1000000;
+		start = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+		chunk();
+		loops[i] = chunk_loops * (SERVICE_US * 1000ULL / CHUNKS) /
+			(clock_ns(CLOCK_PROCESS_CPUTIME_ID) - start);
+	}
+	qsort(loops, CALIBRATIONS, sizeof(*loops), cmp_ulong);
+	chunk_loops = loops[CALIBRATIONS / 2];
+	printf("chunk of %d us: %lu loops (%lu to %lu over %d measures)\n",
+	       SERVICE_US / CHUNKS, chunk_loops, loops[0],
+	       loops[CALIBRATIONS - 1], CALIBRATIONS);
+}
+
+/* Runs the requests at @load_ in @mode_ in a new process */
+static struct outcome run_child(double load_, enum mode mode_)
+{
+	struct outcome out;
+	int fds[2], status;
+
+	assert(pipe(fds) == 0);
+	fflush(stdout);
+	if (fork() == 0) {
+		load = load_;
+		mode = mode_;
+		out = run();
+		assert(write(fds[1], &out, sizeof(out)) == sizeof(out));
+		exit(0);
+	}
+	close(fds[1]);
+	assert(read(fds[0], &out, sizeof(out)) == sizeof(out));
+	close(fds[0]);
+	wait(&status);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	return out;
+}
+
+int main(void)
+{
+	static const double loads[] = { 0.5, 0.9, 1.25 };
+	static const char *names[] = { "rr", "edf", "edf+shed" };
+
+	calibrate();
+	for (size_t l = 0; l < sizeof(loads) / sizeof(*loads); l++) {
+		for (int m = RR; m <= EDF_SHED; m++) {
+			struct outcome outs[RUNS], *median = &outs[RUNS / 2];
+
+			for (int r = 0; r < RUNS; r++)
+				outs[r] = run_child(loads[l], m);
+			qsort(outs, RUNS, sizeof(*outs), cmp_outcome);
+			printf("load %3.0f%% %-8s: %5.1f%% missed (%4.1f%% shed), "
+			       "%4.1f%% to %4.1f%% over %d runs\n",
+			       loads[l] * 100, names[m],
+			       100.0 * median->missed / REQUESTS,
+			       100.0 * median->shed / REQUESTS,
+			       100.0 * outs[0].missed / REQUESTS,
+			       100.0 * outs[RUNS - 1].missed / REQUESTS, RUNS);
+		}
+	}
+
+	return 0;
+}
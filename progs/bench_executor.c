@@ -0,0 +1,108 @@
+/*
+ * Executor benchmark
+ *
+ * Runs short tasks in rounds, first by creating and joining a thread per task,
+ * then by submitting them to an executor whose workers are reused, and reports
+ * the number of tasks per second for each.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+#include <executor.h>
+#include <uthread.h>
+
+#define TASKS 200000
+#define ROUND 1000
+#define WORKERS 8
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int task(void* arg)
+{
+	volatile int sum = 0;
+
+	for (int i = 0; i < 100; i++)
+		sum += i;
+	return (int)(long)arg;
+}
+
+static void spawn_per_task(void)
+{
+	static uthread_t tids[ROUND];
+	int ret_val;
+
+	for (int done = 0; done < TASKS; done += ROUND) {
+		for (int i = 0; i < ROUND; i++) {
+			int tid = uthread_create(task, (void*)(long)i);
+			assert(tid != -1);
+			tids[i] = tid;
+		}
+		for (int i = 0; i < ROUND; i++) {
+			assert(uthread_join(tids[i], &ret_val) == 0);
+			assert(ret_val == i);
+		}
+	}
+}
+
+static void executor(void)
+{
+	static uthread_future_t futures[ROUND];
+	uthread_executor_t ex = uthread_executor_create(WORKERS, WORKERS);
+	int ret_val;
+
+	assert(ex != NULL);
+	for (int done = 0; done < TASKS; done += ROUND) {
+		for (int i = 0; i < ROUND; i++) {
+			futures[i] = uthread_executor_submit(ex, task,
+							     (void*)(long)i);
+			assert(futures[i] != NULL);
+		}
+		for (int i = 0; i < ROUND; i++) {
+			assert(uthread_future_get(futures[i], &ret_val) == 0);
+			assert(ret_val == i);
+		}
+	}
+	assert(uthread_executor_destroy(ex) == 0);
+}
+
+static void elastic(void)
+{
+	/* Workers grow to the maximum during a round and shrink back after */
+	uthread_executor_t ex = uthread_executor_create(0, WORKERS);
+	uthread_future_t future;
+	int ret_val;
+
+	assert(ex != NULL);
+	for (int i = 0; i < ROUND; i++) {
+		future = uthread_executor_submit(ex, task, (void*)(long)i);
+		assert(uthread_future_get(future, &ret_val) == 0);
+		assert(ret_val == i);
+	}
+	assert(uthread_executor_destroy(ex) == 0);
+}
+
+int main(void)
+{
+	double start;
+
+	start = now_s();
+	spawn_per_task();
+	printf("spawn per task: %10.0f tasks/s\n", TASKS / (now_s() - start));
+
+	start = now_s();
+	executor();
+	printf("executor:       %10.0f tasks/s (%d workers)\n",
+	       TASKS / (now_s() - start), WORKERS);
+
+	elastic();
+	return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * Fair scheduling benchmark
+ *
+ * Threads doing the same work in bursts of different lengths, yielding after
+ * each burst, compete for the CPU for a fixed time. One of them never yields
+ * and relies on preemption. The share of the CPU each thread got (measured by
+ * the work it did) is compared to its fair share, first with equal weights,
+ * then with different weights. Each scheduling policy runs in its own process
+ * since the policy must be chosen before the first thread is created.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <uthread.h>
+
+#define THREADS 4
+#define DURATION 1.0
+#define SPIN 0 // burst of a thread that never yields
+
+struct worker {
+	int burst; // units of work between two yields
+	unsigned int weight;
+	unsigned long units; // units of work done
+};
+
+static double deadline;
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	/* Not the CPU time, a system call which would dwarf short bursts */
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void unit(void)
+{
+	volatile int sum = 0;
+
+	for (int i = 0; i < 2000; i++)
+		sum += i;
+}
+
+int work(void* arg)
+{
+	struct worker *w = arg;
+
+	while (now_s() < deadline) {
+		for (int i = 0; i < (w->burst == SPIN ? 100 : w->burst); i++)
+			unit();
+		w->units += (w->burst == SPIN) ? 100 : w->burst;
+		if (w->burst != SPIN)
+			uthread_yield();
+	}
+	return 0;
+}
+
+static void run(const char *name, struct worker workers[])
+{
+	uthread_t tids[THREADS];
+	unsigned long total = 0;
+	unsigned int weights = 0;
+	double error = 0;
+
+	deadline = now_s() + DURATION;
+	for (int i = 0; i < THREADS; i++) {
+		tids[i] = uthread_create(work, &workers[i]);
+		assert(uthread_set_weight(tids[i], workers[i].weight) == 0);
+	}
+	for (int i = 0; i < THREADS; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+
+	for (int i = 0; i < THREADS; i++) {
+		total += workers[i].units;
+		weights += workers[i].weight;
+	}
+	printf("%-4s", name);
+	for (int i = 0; i < THREADS; i++) {
+		double share = 100.0 * workers[i].units / total;
+		double fair = 100.0 * workers[i].weight / weights;
+
+		if (workers[i].burst == SPIN)
+			printf(" | spin  w%-4u", workers[i].weight);
+		else
+			printf(" | %-5d w%-4u", workers[i].burst, workers[i].weight);
+		printf(" %5.1f%%/%4.1f%%", share, fair);
+		if (share - fair > error || fair - share > error)
+			error = (share > fair) ? share - fair : fair - share;
+	}
+	printf(" | max error %5.1f%%\n", error);
+}
+
+static void policy(enum uthread_sched_policy policy, const char *name)
+{
+	struct worker mixed[THREADS] = {
+		{ 1, 1024, 0 }, { 10, 1024, 0 }, { 100, 1024, 0 },
+		{ SPIN, 1024, 0 },
+	};
+	struct worker weighted[THREADS] = {
+		{ 10, 512, 0 }, { 10, 1024, 0 }, { SPIN, 1024, 0 },
+		{ SPIN, 2048, 0 },
+	};
+
+	assert(uthread_set_sched_policy(policy) == 0);
+	run(name, mixed);
+	run(name, weighted);
+}
+
+int main(void)
+{
+	int status;
+
+	printf("Bursts (units of work between yields), weights, and share of "
+	       "the CPU got/fair\n");
+	fflush(stdout);
+	if (fork() == 0) {
+		policy(UTHREAD_SCHED_RR, "rr");
+		exit(0);
+	}
+	wait(&status);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	fflush(stdout);
+	if (fork() == 0) {
+		policy(UTHREAD_SCHED_FAIR, "fair");
+		exit(0);
+	}
+	wait(&status);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	return 0;
+}
@@ -0,0 +1,239 @@
+/*
+ * Futex benchmark
+ *
+ * The semantics of uthread_futex_wait() and uthread_futex_wake() are checked
+ * first (value mismatch, timeouts, wake order, unpark). Then are measured:
+ * - round trips between two threads handing a turn to each other, blocking on
+ *   a futex, or with uthread_park() and uthread_unpark()
+ * - wakes with nobody waiting
+ * - THREADS threads incrementing a counter under a lock, which they hold
+ *   across a uthread_yield() every YIELD_EVERY increments, so that the others
+ *   find it taken: a futex-based lock, or a lock retried after uthread_yield()
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include <uthread.h>
+
+#define ROUND_TRIPS 200000
+#define WAKES 10000000
+#define THREADS 8
+#define INCREMENTS 100000
+#define YIELD_EVERY 16
+
+static unsigned int turn;
+static unsigned int word;
+static unsigned int lock;
+static long counter;
+static int use_futex;
+static uthread_t peer;
+static int order[3], nb_woken;
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int waiter(void* arg)
+{
+	int ret = uthread_futex_wait(&word, 0, -1);
+
+	order[nb_woken++] = (int)(long)arg;
+	return ret;
+}
+
+int timed_waiter(void* arg)
+{
+	(void)arg;
+	return uthread_futex_wait(&word, 0, 1000000000LL);
+}
+
+static void check(void)
+{
+	uthread_t tids[3];
+	int ret;
+
+	/* Before any thread, and alone */
+	assert(uthread_futex_wait(&word, 0, -1) == -1 && errno == EINVAL);
+	tids[0] = uthread_create(waiter, NULL);
+	assert(uthread_futex_wake(&word, 1) == 0); // not waiting yet
+	uthread_yield();
+	assert(uthread_futex_wake(&word, 1) == 1);
+	assert(uthread_join(tids[0], &ret) == 0 && ret == 0);
+	assert(uthread_futex_wait(&word, 0, -1) == -1 && errno == EDEADLK);
+
+	assert(uthread_futex_wait(&word, 1, -1) == -1 && errno == EAGAIN);
+	assert(uthread_futex_wait(&word, 0, 0) == -1 && errno == ETIMEDOUT);
+	assert(uthread_futex_wait(&word, 0, 1000000) == -1 &&
+	       errno == ETIMEDOUT);
+	assert(uthread_futex_wake(NULL, 1) == -1);
+
+	/* Woken in order, never by an unpark */
+	nb_woken = 0;
+	for (long i = 0; i < 3; i++)
+		tids[i] = uthread_create(waiter, (void*)i);
+	uthread_yield();
+	assert(uthread_unpark(tids[0]) == 0);
+	uthread_yield();
+	assert(nb_woken == 0);
+	assert(uthread_futex_wake(&word + 1, INT_MAX) == 0);
+	assert(uthread_futex_wake(&word, 1) == 1);
+	assert(uthread_futex_wake(&word, INT_MAX) == 2);
+	for (int i = 0; i < 3; i++)
+		assert(uthread_join(tids[i], &ret) == 0 && ret == 0);
+	assert(order[0] == 0 && order[1] == 1 && order[2] == 2);
+
+	/* Woken before its timeout */
+	tids[0] = uthread_create(timed_waiter, NULL);
+	uthread_yield();
+	assert(uthread_futex_wake(&word, 1) == 1);
+	assert(uthread_join(tids[0], &ret) == 0 && ret == 0);
+}
+
+/* Hands the turn over, then waits for it to come back */
+int pong(void* arg)
+{
+	(void)arg;
+	for (int i = 0; i < ROUND_TRIPS; i++) {
+		while (turn == 0) {
+			if (use_futex)
+				uthread_futex_wait(&turn, 0, -1);
+			else
+				uthread_park();
+		}
+		turn = 0;
+		if (use_futex)
+			uthread_futex_wake(&turn, 1);
+		else
+			uthread_unpark(0);
+	}
+	return 0;
+}
+
+static void bench_round_trips(const char *name)
+{
+	double start = now_s();
+
+	turn = 0;
+	peer = uthread_create(pong, NULL);
+	for (int i = 0; i < ROUND_TRIPS; i++) {
+		turn = 1;
+		if (use_futex)
+			uthread_futex_wake(&turn, 1);
+		else
+			uthread_unpark(peer);
+		while (turn == 1) {
+			if (use_futex)
+				uthread_futex_wait(&turn, 1, -1);
+			else
+				uthread_park();
+		}
+	}
+	printf("%-20s: %6.0f ns per round trip\n", name,
+	       (now_s() - start) * 1e9 / ROUND_TRIPS);
+	assert(uthread_join(peer, NULL) == 0);
+}
+
+static void bench_empty_wake(void)
+{
+	double start = now_s();
+
+	for (int i = 0; i < WAKES; i++)
+		assert(uthread_futex_wake(&word, 1) == 0);
+	printf("%-20s: %6.1f ns per wake\n", "wake, nobody waiting",
+	       (now_s() - start) * 1e9 / WAKES);
+}
+
+/* Lock of three states: 0 free, 1 taken, 2 taken with threads waiting */
+static void futex_lock(unsigned int *l)
+{
+	unsigned int c = 0;
+
+	if (__atomic_compare_exchange_n(l, &c, 1, 0, __ATOMIC_ACQUIRE,
+					__ATOMIC_RELAXED))
+		return;
+	if (c != 2)
+		c = __atomic_exchange_n(l, 2, __ATOMIC_ACQUIRE);
+	while (c != 0) {
+		uthread_futex_wait(l, 2, -1);
+		c = __atomic_exchange_n(l, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+static void futex_unlock(unsigned int *l)
+{
+	if (__atomic_fetch_sub(l, 1, __ATOMIC_RELEASE) != 1) {
+		__atomic_store_n(l, 0, __ATOMIC_RELEASE);
+		uthread_futex_wake(l, 1);
+	}
+}
+
+static void yield_lock(unsigned int *l)
+{
+	while (__atomic_exchange_n(l, 1, __ATOMIC_ACQUIRE) != 0)
+		uthread_yield();
+}
+
+static void yield_unlock(unsigned int *l)
+{
+	__atomic_store_n(l, 0, __ATOMIC_RELEASE);
+}
+
+int incrementer(void* arg)
+{
+	(void)arg;
+	for (int i = 0; i < INCREMENTS; i++) {
+		if (use_futex)
+			futex_lock(&lock);
+		else
+			yield_lock(&lock);
+		counter++;
+		if (i % YIELD_EVERY == 0)
+			uthread_yield(); // still holding the lock
+		if (use_futex)
+			futex_unlock(&lock);
+		else
+			yield_unlock(&lock);
+	}
+	return 0;
+}
+
+static void bench_lock(const char *name)
+{
+	uthread_t tids[THREADS];
+	double start = now_s();
+
+	counter = 0;
+	for (int i = 0; i < THREADS; i++)
+		tids[i] = uthread_create(incrementer, NULL);
+	for (int i = 0; i < THREADS; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+	assert(counter == (long)THREADS * INCREMENTS);
+	printf("%-20s: %6.0f ns per increment\n", name,
+	       (now_s() - start) * 1e9 / counter);
+}
+
+int main(void)
+{
+	check();
+
+	use_futex = 1;
+	bench_round_trips("futex");
+	use_futex = 0;
+	bench_round_trips("park/unpark");
+	bench_empty_wake();
+	use_futex = 1;
+	bench_lock("lock, futex");
+	use_futex = 0;
+	bench_lock("lock, yield");
+
+	return 0;
+}
@@ -0,0 +1,149 @@
+/*
+ * Generator benchmark
+ *
+ * A consumer sums ELEMENTS values produced one at a time, either by a
+ * generator, or by a producer thread handing them through a shared buffer and
+ * uthread_yield(), with 0 or BYSTANDERS other threads ready to run (each yield
+ * then goes through all of them). Nested generators, and the reuse of the
+ * stacks of destroyed generators, are checked as well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+#include <uthread.h>
+
+#define ELEMENTS 2000000
+#define BYSTANDERS 4
+
+static volatile long buffer;
+static volatile int full;
+static volatile int stop;
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int count(void* arg)
+{
+	long n = (long)arg;
+
+	for (long i = 0; i < n; i++)
+		uthread_gen_yield((void*)i);
+	return 0;
+}
+
+/* Yields the values of a nested generator, doubled */
+int twice(void* arg)
+{
+	uthread_gen_t inner = uthread_gen_create(count, arg);
+	void *value;
+
+	while (uthread_gen_next(inner, &value) == 1)
+		uthread_gen_yield((void*)(2 * (long)value));
+	uthread_gen_destroy(inner);
+	return 0;
+}
+
+int producer(void* arg)
+{
+	(void)arg;
+	for (long i = 0; i < ELEMENTS; i++) {
+		while (full)
+			uthread_yield();
+		buffer = i;
+		full = 1;
+	}
+	return 0;
+}
+
+int bystander(void* arg)
+{
+	(void)arg;
+	while (!stop)
+		uthread_yield();
+	return 0;
+}
+
+static void report(const char *name, double elapsed, long sum)
+{
+	assert(sum == (long)ELEMENTS * (ELEMENTS - 1) / 2);
+	printf("%-24s: %6.2f M elements/s\n", name, ELEMENTS / elapsed / 1e6);
+}
+
+static void bench_gen(void)
+{
+	uthread_gen_t gen = uthread_gen_create(count, (void*)(long)ELEMENTS);
+	double start = now_s();
+	long sum = 0;
+	void *value;
+
+	while (uthread_gen_next(gen, &value) == 1)
+		sum += (long)value;
+	report("generator", now_s() - start, sum);
+	assert(uthread_gen_next(gen, &value) == 0);
+	assert(uthread_gen_destroy(gen) == 0);
+}
+
+static void bench_yield(int bystanders)
+{
+	uthread_t tids[BYSTANDERS + 1];
+	char name[32];
+	double start = now_s();
+	long sum = 0;
+
+	stop = 0;
+	for (int i = 0; i < bystanders; i++)
+		tids[i] = uthread_create(bystander, NULL);
+	tids[bystanders] = uthread_create(producer, NULL);
+	for (long i = 0; i < ELEMENTS; i++) {
+		while (!full)
+			uthread_yield();
+		sum += buffer;
+		full = 0;
+	}
+	snprintf(name, sizeof(name), "yield, %d bystanders", bystanders);
+	report(name, now_s() - start, sum);
+	stop = 1;
+	for (int i = 0; i <= bystanders; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+}
+
+static void check_nested(void)
+{
+	uthread_gen_t outer = uthread_gen_create(twice, (void*)10L);
+	void *value;
+	long expected = 0;
+
+	assert(uthread_gen_yield(NULL) == -1);
+	while (uthread_gen_next(outer, &value) == 1) {
+		assert((long)value == expected);
+		expected += 2;
+	}
+	assert(expected == 20);
+	assert(uthread_gen_destroy(outer) == 0);
+
+	/* A generator destroyed halfway leaves its stack to the next one */
+	outer = uthread_gen_create(count, (void*)10L);
+	assert(uthread_gen_next(outer, &value) == 1);
+	assert(uthread_gen_destroy(outer) == 0);
+	assert(uthread_gen_create(count, NULL) == outer);
+	assert(uthread_gen_next(outer, &value) == 0);
+	assert(uthread_gen_destroy(outer) == 0);
+}
+
+int main(void)
+{
+	check_nested();
+	bench_gen();
+	bench_yield(0);
+	bench_yield(BYSTANDERS);
+
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * Preemption mode benchmark
+ *
+ * Runs the scenario of test_preempt (threads spinning without ever yielding)
+ * in each preemption mode, the spinning loops being instrumented with
+ * UTHREAD_CHECKPOINT(). Each run is in its own process since the mode must be
+ * chosen before the first thread is created.
+ *
+ * The cost of ticks is the time per unit of work compared to the same work done
+ * by a baseline process without any thread nor timer. The length of the time
+ * slices between two switches gives the latency of preemption: a slice longer
+ * than the tick period is a tick that took that much longer to switch threads.
+ * The baseline and the modes take turns for RUNS rounds, so that a slower
+ * period of the machine does not fall on one of them only: the median is
+ * reported with the spread across runs, the overhead of each run being
+ * relative to the baseline of the same round.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <uthread.h>
+
+#define THREADS 3
+#define UNITS 500000
+#define MAX_SLICES 4096
+#define RUNS 7
+
+enum mode { BASELINE, SIGNAL, POLL };
+
+struct outcome {
+	double unit; // time per unit of work (in s)
+	double p50, p99, max; // time slices (in s), 0 for the baseline
+};
+
+static volatile uthread_t last_runner;
+static double last_switch;
+static double slices[MAX_SLICES];
+static int nb_slices;
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	/* Ticks are counted in CPU time too (ITIMER_VIRTUAL) */
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void unit(void)
+{
+	volatile int sum = 0;
+
+	for (int i = 0; i < 500; i++)
+		sum += i;
+}
+
+int spinner(void* arg)
+{
+	uthread_t self = uthread_self();
+
+	(void)arg;
+	for (int i = 0; i < UNITS; i++) {
+		unit();
+		UTHREAD_CHECKPOINT();
+		if (last_runner != self) {
+			/* The previous thread's slice ended with this switch */
+			double now = now_s();
+			if (last_runner != 0 && nb_slices < MAX_SLICES)
+				slices[nb_slices++] = now - last_switch;
+			last_switch = now;
+			last_runner = self;
+		}
+	}
+	return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Runs the spinners in @mode, or the same work without thread for BASELINE */
+static struct outcome run(enum mode mode)
+{
+	static const enum uthread_preempt_mode modes[] = {
+		[SIGNAL] = UTHREAD_PREEMPT_SIGNAL,
+		[POLL] = UTHREAD_PREEMPT_POLL,
+	};
+	struct outcome out = { 0 };
+	uthread_t tids[THREADS];
+	double start;
+
+	start = now_s();
+	if (mode == BASELINE) {
+		for (int i = 0; i < THREADS * UNITS; i++)
+			unit();
+		out.unit = (now_s() - start) / (THREADS * UNITS);
+		return out;
+	}
+
+	assert(uthread_set_preempt_mode(modes[mode]) == 0);
+	for (int i = 0; i < THREADS; i++)
+		tids[i] = uthread_create(spinner, NULL);
+	for (int i = 0; i < THREADS; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+	out.unit = (now_s() - start) / (THREADS * UNITS);
+
+	assert(nb_slices > 0);
+	qsort(slices, nb_slices, sizeof(double), cmp_double);
+	out.p50 = slices[nb_slices / 2];
+	out.p99 = slices[nb_slices * 99 / 100];
+	out.max = slices[nb_slices - 1];
+	return out;
+}
+
+/* Runs @mode in a new process */
+static struct outcome run_child(enum mode mode)
+{
+	struct outcome out;
+	int fds[2], status;
+
+	assert(pipe(fds) == 0);
+	fflush(stdout);
+	if (fork() == 0) {
+		out = run(mode);
+		assert(write(fds[1], &out, sizeof(out)) == sizeof(out));
+		exit(0);
+	}
+	close(fds[1]);
+	assert(read(fds[0], &out, sizeof(out)) == sizeof(out));
+	close(fds[0]);
+	wait(&status);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	return out;
+}
+
+/* Sorts the @field of the outcomes of @outs in @values */
+#define SORTED(values, outs, field)					\
+	do {								\
+		for (int r = 0; r < RUNS; r++)				\
+			(values)[r] = (outs)[r].field;			\
+		qsort((values), RUNS, sizeof(double), cmp_double);	\
+	} while (0)
+
+int main(void)
+{
+	static const char *names[] = { "base", "signal", "poll" };
+	struct outcome outs[POLL + 1][RUNS];
+	double base[RUNS];
+
+	for (int r = 0; r < RUNS; r++)
+		for (int m = BASELINE; m <= POLL; m++)
+			outs[m][r] = run_child(m);
+
+	SORTED(base, outs[BASELINE], unit);
+	printf("%-6s: %6.1f ns/unit (%6.1f to %6.1f over %d runs)\n",
+	       names[BASELINE], base[RUNS / 2] * 1e9, base[0] * 1e9,
+	       base[RUNS - 1] * 1e9, RUNS);
+	for (int m = SIGNAL; m <= POLL; m++) {
+		double unit[RUNS], ratio[RUNS], p50[RUNS], p99[RUNS], max[RUNS];
+
+		/* Compared to the baseline of the same round */
+		for (int r = 0; r < RUNS; r++)
+			ratio[r] = outs[m][r].unit / outs[BASELINE][r].unit - 1;
+		qsort(ratio, RUNS, sizeof(double), cmp_double);
+		SORTED(unit, outs[m], unit);
+		SORTED(p50, outs[m], p50);
+		SORTED(p99, outs[m], p99);
+		SORTED(max, outs[m], max);
+		printf("%-6s: %6.1f ns/unit (%6.1f to %6.1f), overhead %+5.1f%% "
+		       "(%+5.1f%% to %+5.1f%%), slices: p50 %5.2f ms, "
+		       "p99 %5.2f ms, max %5.2f ms\n", names[m],
+		       unit[RUNS / 2] * 1e9, unit[0] * 1e9, unit[RUNS - 1] * 1e9,
+		       ratio[RUNS / 2] * 100, ratio[0] * 100,
+		       ratio[RUNS - 1] * 100,
+		       p50[RUNS / 2] * 1e3, p99[RUNS / 2] * 1e3,
+		       max[RUNS / 2] * 1e3);
+	}
+
+	return 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * Profiler benchmark
+ *
+ * THREADS threads compute without ever yielding, so that only the preemption
+ * ticks switch them, thread i doing i + 1 units of work. The same work is
+ * timed without the profiler, then sampled at 1 kHz: the samples must be
+ * attributed to the threads in proportion to their work, within the functions
+ * they run. The folded stacks are written to the file given as argument, if
+ * any, for flamegraph.pl.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <uthread.h>
+
+#define THREADS 4
+#define UNIT 20000000
+#define ROUNDS 3
+#define HZ 1000
+
+static volatile unsigned long sink;
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+__attribute__((noinline)) void spin_inner(long n)
+{
+	for (long i = 0; i < n; i++)
+		sink += i;
+}
+
+__attribute__((noinline)) void spin_outer(long units)
+{
+	for (long i = 0; i < units; i++)
+		spin_inner(UNIT);
+}
+
+int worker(void *arg)
+{
+	spin_outer((long)arg + 1);
+	return 0;
+}
+
+/* Returns the time taken by the threads to do their work */
+static double run_workers(void)
+{
+	uthread_t tids[THREADS];
+	double start;
+
+	start = now_s();
+	for (long i = 0; i < THREADS; i++)
+		tids[i] = uthread_create(worker, (void *)i);
+	for (int i = 0; i < THREADS; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+	return now_s() - start;
+}
+
+int main(int argc, char *argv[])
+{
+	double none = 1e9, profiled = 1e9, t;
+	unsigned long per_thread[THREADS + 1] = { 0 }, in_spin = 0;
+	unsigned long count, total = 0;
+	uthread_t first;
+	char line[4096];
+	FILE *folded;
+	int samples, dropped;
+
+	/* Best of a few rounds each, the first threads are TIDs 1 to THREADS */
+	for (int i = 0; i < ROUNDS; i++) {
+		t = run_workers();
+		if (t < none)
+			none = t;
+	}
+	for (int i = 0; i < ROUNDS; i++) {
+		assert(uthread_profile_start(HZ, 0) == 0);
+		assert(uthread_profile_start(HZ, 0) == -1);
+		t = run_workers();
+		if (t < profiled)
+			profiled = t;
+		dropped = uthread_profile_stop();
+		assert(dropped == 0);
+	}
+	assert(uthread_profile_stop() == -1);
+
+	/* Samples of the last round */
+	folded = tmpfile();
+	assert(folded != NULL);
+	samples = uthread_profile_write(fileno(folded));
+	assert(samples > 0);
+	if (argc > 1) {
+		int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+		assert(fd != -1);
+		assert(uthread_profile_write(fd) == samples);
+		close(fd);
+	}
+
+	/* Thread TIDs grow from round to round, the first of the last round
+	   being the lowest seen */
+	first = 0;
+	rewind(folded);
+	while (fgets(line, sizeof(line), folded) != NULL) {
+		unsigned int tid;
+
+		assert(sscanf(line, "uthread-%u", &tid) == 1);
+		if (tid != 0 && (first == 0 || tid < first))
+			first = tid;
+	}
+	rewind(folded);
+	while (fgets(line, sizeof(line), folded) != NULL) {
+		unsigned int tid;
+
+		sscanf(line, "uthread-%u", &tid);
+		count = strtoul(strrchr(line, ' ') + 1, NULL, 10);
+		total += count;
+		if (tid >= first && tid < first + THREADS)
+			per_thread[tid - first] += count;
+		else
+			per_thread[THREADS] += count;
+		/* spin_outer is skipped by compilers leaving spin_inner
+		   without a frame, in spite of -mno-omit-leaf-frame-pointer */
+		if (strstr(line, ";worker;") != NULL &&
+		    strstr(line, ";spin_inner ") != NULL)
+			in_spin += count;
+	}
+	fclose(folded);
+
+	printf("%d samples in %.2f s (%.0f Hz)\n", samples, profiled,
+	       samples / profiled);
+	for (int i = 0; i < THREADS; i++)
+		printf("  thread %d (%d units): %lu samples\n", i + 1, i + 1,
+		       per_thread[i]);
+	printf("  others: %lu samples\n", per_thread[THREADS]);
+	printf("  %.1f%% in worker, down to spin_inner\n",
+	       100.0 * in_spin / total);
+	printf("%.3f s without profiler, %.3f s at %d Hz (%+.1f%%)\n", none,
+	       profiled, HZ, 100 * (profiled - none) / none);
+
+	assert(total == (unsigned long)samples);
+	for (int i = 1; i < THREADS; i++)
+		assert(per_thread[i] > per_thread[i - 1]);
+	assert(in_spin * 10 >= total * 9);
+	return 0;
+}
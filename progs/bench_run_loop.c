@@ -0,0 +1,167 @@
+/*
+ * Host loop benchmark
+ *
+ * The main thread is the loop of a game or GUI: every FRAME_NS it does
+ * WORK_NS of its own work, then lets THREADS threads run until the next frame.
+ * Most of them sleep for random durations and do a little work when they wake
+ * up, COMPUTE of them compute in slices and yield in between. The lateness of
+ * the frames is measured with a host which:
+ * - naive: calls uthread_yield() until the next frame
+ * - run_for: calls uthread_run_for() with the time left, then waits for the
+ *   file descriptor of uthread_get_fd() until the next frame
+ * Waking up from the file descriptor alone is checked as well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <poll.h>
+#include <time.h>
+
+#include <uthread.h>
+
+#define THREADS 10000
+#define COMPUTE 8
+#define FRAMES 200
+#define FRAME_NS 10000000ULL
+#define WORK_NS 2000000ULL
+#define SLICE_NS 100000ULL
+
+static volatile int stop;
+static unsigned long wakeups;
+static unsigned long slices;
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void spin_ns(unsigned long long ns)
+{
+	unsigned long long end = now_ns() + ns;
+
+	while (now_ns() < end)
+		;
+}
+
+int sleeper(void* arg)
+{
+	unsigned int seed = (unsigned int)(long)arg;
+
+	while (!stop) {
+		seed = seed * 1103515245 + 12345;
+		uthread_sleep_ns(10000000ULL + (seed >> 16) % 90000000ULL);
+		wakeups++;
+	}
+	return 0;
+}
+
+int compute(void* arg)
+{
+	(void)arg;
+	while (!stop) {
+		spin_ns(SLICE_NS);
+		slices++;
+		uthread_yield();
+	}
+	return 0;
+}
+
+static int cmp(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void run_host(const char *name, int use_fd)
+{
+	static unsigned long long lateness[FRAMES];
+	unsigned long long frame = now_ns() + FRAME_NS;
+	int fd = use_fd ? uthread_get_fd() : -1;
+
+	wakeups = slices = 0;
+	for (int i = 0; i < FRAMES; i++) {
+		unsigned long long now;
+
+		/* Wait for the frame, running the threads meanwhile */
+		while ((now = now_ns()) < frame) {
+			if (!use_fd) {
+				uthread_yield();
+				continue;
+			}
+			if (uthread_run_for(frame - now) > 0)
+				continue;
+			struct pollfd pfd = { .fd = fd, .events = POLLIN };
+			now = now_ns();
+			if (now < frame)
+				poll(&pfd, 1, (frame - now + 999999) / 1000000);
+		}
+		lateness[i] = now - frame;
+		spin_ns(WORK_NS);
+		frame += FRAME_NS;
+	}
+
+	qsort(lateness, FRAMES, sizeof(lateness[0]), cmp);
+	printf("%-8s: frame lateness p50 %6.0f us, p99 %6.0f us, max %6.0f us"
+	       " (%lu wakeups, %lu slices)\n", name,
+	       lateness[FRAMES / 2] / 1e3, lateness[FRAMES * 99 / 100] / 1e3,
+	       lateness[FRAMES - 1] / 1e3, wakeups, slices);
+	assert(wakeups > 0 && slices > 0);
+}
+
+int nap(void* arg)
+{
+	(void)arg;
+	uthread_sleep_ns(5000000);
+	return 1;
+}
+
+/* A sleeping thread makes the file descriptor readable when it wakes up */
+static void check_fd(void)
+{
+	int fd = uthread_get_fd();
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	unsigned long long start;
+	uthread_t tid;
+	int ret;
+
+	assert(fd != -1 && uthread_get_fd() == fd);
+	tid = uthread_create(nap, NULL);
+	assert(poll(&pfd, 1, 1000) == 1); // ready to start
+	assert(uthread_run_once() == 0);
+	start = now_ns();
+	assert(poll(&pfd, 1, 1000) == 1); // woken up
+	assert(now_ns() - start >= 4000000);
+	assert(uthread_run_once() == 0);
+	assert(poll(&pfd, 1, 0) == 0); // nothing to run
+	assert(uthread_join(tid, &ret) == 0 && ret == 1);
+}
+
+static void run_threads(const char *name, int use_fd)
+{
+	static uthread_t tids[THREADS];
+
+	stop = 0;
+	for (long i = 0; i < THREADS; i++)
+		tids[i] = uthread_create(i < COMPUTE ? compute : sleeper,
+					 (void*)i);
+	run_host(name, use_fd);
+	stop = 1;
+	for (int i = 0; i < THREADS; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+}
+
+int main(void)
+{
+	/* The naive host first, uthread_yield() does nothing in the host */
+	run_threads("naive", 0);
+	check_fd();
+	run_threads("run_for", 1);
+
+	return 0;
+}
@@ -0,0 +1,185 @@
+/*
+ * C++ spawn benchmark
+ *
+ * Threads running a closure of three values are created and joined in rounds
+ * of BATCH, through:
+ * - raw: uthread_create() with the closure allocated with malloc()
+ * - spawn: uthread::spawn() with a lambda, stored in the thread itself
+ * - spawn (large): uthread::spawn() with a lambda too large to be stored in
+ *   the thread, allocated on the heap
+ * Then BATCH coroutines at once await a call AWAITS times in a row, the call
+ * returning right away or yielding first, and a coroutine awaits a join and a
+ * read, resumed on another thread.
+ */
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <coroutine>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+
+#include <uthread.hpp>
+
+#define THREADS 100000
+#define BATCH 100
+#define AWAITS 1000
+
+struct closure {
+	long a, b;
+	long *sum;
+};
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run_closure(void *arg)
+{
+	struct closure *c = static_cast<struct closure *>(arg);
+
+	*c->sum += c->a + c->b;
+	free(c);
+	return 0;
+}
+
+static void report(const char *name, double elapsed, long sum)
+{
+	assert(sum == 3L * THREADS);
+	printf("%-14s: %6.0f ns per thread (create and join)\n", name,
+	       elapsed * 1e9 / THREADS);
+}
+
+static void bench_raw(void)
+{
+	uthread_t tids[BATCH];
+	long sum = 0;
+	double start = now_s();
+
+	for (int i = 0; i < THREADS; i += BATCH) {
+		for (int j = 0; j < BATCH; j++) {
+			struct closure *c = static_cast<struct closure *>(
+				malloc(sizeof(struct closure)));
+
+			*c = { 1, 2, &sum };
+			tids[j] = uthread_create(run_closure, c);
+		}
+		for (int j = 0; j < BATCH; j++)
+			assert(uthread_join(tids[j], NULL) == 0);
+	}
+	report("raw", now_s() - start, sum);
+}
+
+static void bench_spawn(void)
+{
+	std::vector<uthread::handle> threads(BATCH);
+	long sum = 0, a = 1, b = 2;
+	double start = now_s();
+
+	for (int i = 0; i < THREADS; i += BATCH) {
+		for (int j = 0; j < BATCH; j++)
+			threads[j] = uthread::spawn([a, b, &sum] { sum += a + b; });
+		for (int j = 0; j < BATCH; j++)
+			assert(threads[j].join() == 0);
+	}
+	report("spawn", now_s() - start, sum);
+}
+
+static void bench_spawn_large(void)
+{
+	std::vector<uthread::handle> threads(BATCH);
+	long sum = 0, pad[16] = { 1, 2 };
+	double start = now_s();
+
+	for (int i = 0; i < THREADS; i += BATCH) {
+		for (int j = 0; j < BATCH; j++)
+			threads[j] = uthread::spawn([pad, &sum] {
+				sum += pad[0] + pad[1];
+			});
+		/* Joined by the destructors of the handles */
+		for (int j = 0; j < BATCH; j++)
+			threads[j] = uthread::handle();
+	}
+	report("spawn (large)", now_s() - start, sum);
+}
+
+/* Coroutine started right away, and never awaited */
+struct task {
+	struct promise_type {
+		task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::abort(); }
+	};
+};
+
+static task await_loop(bool yield, long *sum, int *done)
+{
+	for (int i = 0; i < AWAITS; i++)
+		*sum += co_await uthread::async_call([yield] {
+			if (yield)
+				uthread_yield(); // like a call which blocks
+			return 3L;
+		});
+	++*done;
+}
+
+static void bench_await(bool yield)
+{
+	long sum = 0;
+	int done = 0;
+	double start = now_s();
+
+	for (int i = 0; i < BATCH; i++)
+		await_loop(yield, &sum, &done); // returns at the first co_await
+	while (done < BATCH)
+		uthread_yield();
+	assert(sum == 3L * AWAITS * BATCH);
+	printf("%-14s: %6.0f ns per co_await\n",
+	       yield ? "await (yield)" : "await", (now_s() - start) * 1e9 /
+	       (AWAITS * BATCH));
+}
+
+static task await_both(int fd, int *done)
+{
+	char buf[4];
+	uthread_t self = uthread_self();
+
+	int ret = co_await uthread::async_join(uthread::spawn([] { return 42; }));
+	assert(ret == 42);
+	assert(uthread_self() != self); // resumed by the joining thread
+	ssize_t len = co_await uthread::async_pread(fd, buf, sizeof(buf), 0);
+	assert(len == sizeof(buf));
+	*done = 1;
+}
+
+static void check_coroutine(void)
+{
+	int fd = open("/proc/self/exe", O_RDONLY);
+	int done = 0;
+
+	assert(fd != -1);
+	await_both(fd, &done); // returns at the first co_await
+	while (!done)
+		uthread_yield();
+	close(fd);
+}
+
+int main(void)
+{
+	bench_raw();
+	bench_spawn();
+	bench_spawn_large();
+	bench_await(false);
+	bench_await(true);
+	check_coroutine();
+
+	return 0;
+}
@@ -0,0 +1,135 @@
+/*
+ * Switch hooks benchmark
+ *
+ * Hooks counting the switches, creations and exits are checked first: every
+ * thread created and exiting is seen once, with its return value, and each
+ * switch leaves the thread the previous one entered. Then THREADS threads
+ * yield to each other as in bench_yield, without hooks, with the counting
+ * hooks, and once they are removed again, to show what they cost per switch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+#include <uthread.h>
+
+#define THREADS 4
+#define BATCH 16
+#define YIELDS 1000000
+
+/* What the hooks saw */
+static unsigned long outs, ins, creates, exits, mismatches;
+static uthread_t running;
+static int retval_sum;
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void count_switch_out(uthread_t prev, uthread_t next, void *userdata)
+{
+	(void)next;
+	assert(userdata == &running);
+	if (prev != running)
+		mismatches++;
+	outs++;
+}
+
+static void count_switch_in(uthread_t prev, uthread_t next, void *userdata)
+{
+	(void)prev;
+	(void)userdata;
+	running = next;
+	ins++;
+}
+
+static void count_create(uthread_t parent, uthread_t child, void *userdata)
+{
+	(void)child;
+	(void)userdata;
+	if (parent != running)
+		mismatches++;
+	creates++;
+}
+
+static void count_exit(uthread_t tid, int retval, void *userdata)
+{
+	(void)userdata;
+	if (tid != running)
+		mismatches++;
+	retval_sum += retval;
+	exits++;
+}
+
+int yielder(void *arg)
+{
+	for (int i = 0; i < YIELDS; i++)
+		uthread_yield();
+	return (int)(long)arg;
+}
+
+int returner(void *arg)
+{
+	uthread_yield();
+	return (int)(long)arg;
+}
+
+/* Returns the yields per second of THREADS yielding threads */
+static double run_yielders(void)
+{
+	uthread_t tids[THREADS];
+	double start;
+
+	start = now_s();
+	for (int i = 0; i < THREADS; i++)
+		tids[i] = uthread_create(yielder, (void *)(long)i);
+	for (int i = 0; i < THREADS; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+	return (double)THREADS * YIELDS / (now_s() - start);
+}
+
+int main(void)
+{
+	void *args[BATCH];
+	uthread_t tids[BATCH];
+	double none, hooked, removed;
+
+	/* Counted for one batch and one thread, from the main thread (TID 0) */
+	running = 0;
+	uthread_set_switch_hooks(count_switch_out, count_switch_in, count_create,
+				 count_exit, &running);
+	for (int i = 0; i < BATCH; i++)
+		args[i] = (void *)(long)i;
+	assert(uthread_create_n(returner, args, BATCH, tids) == 0);
+	for (int i = 0; i < BATCH; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+	assert(uthread_join(uthread_create(returner, (void *)100L), NULL) == 0);
+	uthread_set_switch_hooks(NULL, NULL, NULL, NULL, NULL);
+	printf("hooks: %lu switches, %lu creates, %lu exits\n", outs, creates,
+	       exits);
+	assert(creates == BATCH + 1 && exits == BATCH + 1);
+	assert(retval_sum == BATCH * (BATCH - 1) / 2 + 100);
+	assert(outs == ins && outs >= 2 * (BATCH + 1));
+	assert(mismatches == 0 && running == 0);
+
+	none = run_yielders();
+	assert(outs == ins && creates == BATCH + 1);
+	uthread_set_switch_hooks(count_switch_out, count_switch_in, count_create,
+				 count_exit, &running);
+	hooked = run_yielders();
+	uthread_set_switch_hooks(NULL, NULL, NULL, NULL, NULL);
+	assert(outs == ins && mismatches == 0 && running == 0);
+	removed = run_yielders();
+
+	printf("%10.0f yields/s without hooks\n", none);
+	printf("%10.0f yields/s with hooks (%+.1f ns per switch)\n", hooked,
+	       (1e9 / hooked - 1e9 / none));
+	printf("%10.0f yields/s with hooks removed\n", removed);
+	return 0;
+}
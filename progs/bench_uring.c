@@ -0,0 +1,115 @@
+/*
+ * Batched file I/O benchmark
+ *
+ * Threads issue 4 KiB reads at random offsets of a temporary file with
+ * uthread_pread(), one thread per outstanding read, and the number of reads
+ * per second is reported for queue depths from 1 to 256. Each pass runs in a
+ * child process, once with io_uring and once with the blocking helper thread
+ * (UTHREAD_IO_URING=0), after a baseline of plain pread() calls.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <uthread.h>
+
+#define FILE_SIZE (64 << 20)
+#define BLOCK 4096
+#define READS 65536
+
+static int fd;
+static int reads_per_thread;
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static off_t random_offset(unsigned int *seed)
+{
+	return (off_t)(rand_r(seed) % (FILE_SIZE / BLOCK)) * BLOCK;
+}
+
+int reader(void* arg)
+{
+	unsigned int seed = (unsigned int)(long)arg;
+	char buf[BLOCK];
+
+	for (int i = 0; i < reads_per_thread; i++)
+		assert(uthread_pread(fd, buf, BLOCK, random_offset(&seed)) == BLOCK);
+	return 0;
+}
+
+static void run(const char *name, int depth)
+{
+	uthread_t tids[256];
+	double start;
+
+	reads_per_thread = READS / depth;
+	start = now_s();
+	for (int i = 0; i < depth; i++)
+		tids[i] = uthread_create(reader, (void*)(long)(i + 1));
+	for (int i = 0; i < depth; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+
+	printf("%-8s QD %3d: %10.0f reads/s\n", name, depth,
+	       (double)reads_per_thread * depth / (now_s() - start));
+}
+
+static void plain(void)
+{
+	unsigned int seed = 1;
+	char buf[BLOCK];
+	double start;
+
+	start = now_s();
+	for (int i = 0; i < READS; i++)
+		assert(pread(fd, buf, BLOCK, random_offset(&seed)) == BLOCK);
+	printf("%-8s QD   1: %10.0f reads/s\n", "pread",
+	       READS / (now_s() - start));
+}
+
+int main(void)
+{
+	static const int depths[] = { 1, 4, 16, 64, 256 };
+	static const char *backends[] = { "io_uring", "helper" };
+	char path[] = "/tmp/bench_uring.XXXXXX";
+	static char block[BLOCK];
+
+	fd = mkstemp(path);
+	assert(fd != -1);
+	unlink(path);
+	memset(block, 0x5a, sizeof(block));
+	for (off_t off = 0; off < FILE_SIZE; off += BLOCK)
+		assert(pwrite(fd, block, BLOCK, off) == BLOCK);
+
+	plain();
+	for (int b = 0; b < 2; b++) {
+		fflush(stdout);
+		pid_t pid = fork();
+		assert(pid != -1);
+		if (pid == 0) {
+			if (b == 1)
+				setenv("UTHREAD_IO_URING", "0", 1);
+			for (size_t i = 0; i < sizeof(depths) / sizeof(*depths); i++)
+				run(backends[b], depths[i]);
+			exit(0);
+		}
+
+		int status;
+		assert(waitpid(pid, &status, 0) == pid);
+		assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	}
+
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * Yield throughput benchmark
+ *
+ * A few threads yield to each other in a loop, and the number of context
+ * switches per second is reported. The program is linked twice: against the
+ * preemptive library (bench_yield.x) and against the cooperative-only one
+ * (bench_yield_coop.x), to show what preemption costs on the yield path.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+#include <uthread.h>
+
+#define THREADS 4
+#define YIELDS 1000000
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int yielder(void* arg)
+{
+	(void)arg;
+	for (int i = 0; i < YIELDS; i++)
+		uthread_yield();
+	return 0;
+}
+
+int main(void)
+{
+	uthread_t tids[THREADS];
+	double start;
+
+	start = now_s();
+	for (int i = 0; i < THREADS; i++)
+		tids[i] = uthread_create(yielder, NULL);
+	for (int i = 0; i < THREADS; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+
+	printf("%10.0f yields/s (%d threads)\n",
+	       (double)THREADS * YIELDS / (now_s() - start), THREADS);
+	return 0;
+}
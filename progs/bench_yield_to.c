@@ -0,0 +1,103 @@
+/*
+ * Directed yield benchmark
+ *
+ * Measures the round-trip latency of a ping-pong between two threads while
+ * 10000 background threads are ready to run, first handing off with
+ * uthread_yield() and then with uthread_yield_to().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+#include <uthread.h>
+
+#define BACKGROUND 10000
+#define ROUNDS_YIELD 20
+#define ROUNDS_YIELD_TO 200000
+
+static volatile int stop;
+static volatile int ping, pong;
+static uthread_t ping_tid, pong_tid;
+static int directed;
+static int rounds;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void handoff(uthread_t tid)
+{
+	if (directed)
+		uthread_yield_to(tid);
+	else
+		uthread_yield();
+}
+
+int background(void* arg)
+{
+	while (!stop)
+		uthread_yield();
+	return 0;
+}
+
+int ponger(void* arg)
+{
+	for (int i = 1; i <= rounds; i++) {
+		while (ping != i)
+			handoff(ping_tid);
+		pong = i;
+	}
+	return 0;
+}
+
+int pinger(void* arg)
+{
+	double start = now_ns();
+
+	for (int i = 1; i <= rounds; i++) {
+		ping = i;
+		while (pong != i)
+			handoff(pong_tid);
+	}
+	return (int)((now_ns() - start) / rounds);
+}
+
+static int run(int use_yield_to, int nb_rounds)
+{
+	int ret_val;
+
+	directed = use_yield_to;
+	rounds = nb_rounds;
+	ping = pong = 0;
+	ping_tid = uthread_create(pinger, NULL);
+	pong_tid = uthread_create(ponger, NULL);
+	assert(uthread_join(ping_tid, &ret_val) == 0);
+	assert(uthread_join(pong_tid, NULL) == 0);
+	return ret_val;
+}
+
+int main(void)
+{
+	static uthread_t tids[BACKGROUND];
+	int i;
+
+	for (i = 0; i < BACKGROUND; i++)
+		tids[i] = uthread_create(background, NULL);
+
+	printf("%d background threads\n", BACKGROUND);
+	printf("uthread_yield:    %d ns per round trip\n",
+	       run(0, ROUNDS_YIELD));
+	printf("uthread_yield_to: %d ns per round trip\n",
+	       run(1, ROUNDS_YIELD_TO));
+
+	stop = 1;
+	for (i = 0; i < BACKGROUND; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+	return 0;
+}
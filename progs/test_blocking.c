@@ -0,0 +1,104 @@
+/*
+ * Blocking call offloading test
+ *
+ * Several threads make a blocking call (a 100 ms sleep) through
+ * uthread_blocking_call(), more than there are helper threads, while another
+ * thread keeps computing. The calls must overlap up to the size of the pool,
+ * the computing thread must keep running meanwhile, and the state of the
+ * helpers must account for every call. errno must come back from the helper.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <uthread.h>
+
+#define CALLERS 8
+#define HELPERS 4
+#define SLEEP_MS 100
+
+static volatile int callers_done;
+static volatile unsigned long ticks;
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int sleeper(void* arg)
+{
+	struct timespec ts = { 0, SLEEP_MS * 1000000L };
+
+	nanosleep(&ts, NULL);
+	return (int)(long)arg;
+}
+
+int failer(void* arg)
+{
+	return open((const char*)arg, O_RDONLY);
+}
+
+int caller(void* arg)
+{
+	assert(uthread_blocking_call(sleeper, arg) == (int)(long)arg);
+	callers_done++;
+	return 0;
+}
+
+int ticker(void* arg)
+{
+	(void)arg;
+	while (callers_done < CALLERS) {
+		ticks++;
+		uthread_yield();
+	}
+	return 0;
+}
+
+int main(void)
+{
+	struct uthread_blocking_stats stats;
+	uthread_t tids[CALLERS + 1];
+	double start, elapsed;
+
+	setenv("UTHREAD_HELPERS", "4", 1);
+
+	start = now_s();
+	for (int i = 0; i < CALLERS; i++)
+		tids[i] = uthread_create(caller, (void*)(long)i);
+	tids[CALLERS] = uthread_create(ticker, NULL);
+	for (int i = 0; i <= CALLERS; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+	elapsed = now_s() - start;
+
+	printf("%d calls of %d ms in %.0f ms, %lu ticks meanwhile\n",
+	       CALLERS, SLEEP_MS, elapsed * 1000, ticks);
+	/* Two rounds of HELPERS calls at once */
+	assert(elapsed >= 0.9 * CALLERS / HELPERS * SLEEP_MS / 1000);
+	assert(elapsed < (double)CALLERS * SLEEP_MS / 1000);
+	assert(ticks > 100);
+
+	assert(uthread_blocking_stats(&stats) == 0);
+	printf("%u/%u helpers, %llu calls, wait p50 %llu us, max %llu us\n",
+	       stats.threads, stats.max_threads, stats.calls,
+	       stats.wait_p50 / 1000, stats.wait_max / 1000);
+	assert(stats.threads == HELPERS && stats.max_threads == HELPERS);
+	assert(stats.busy == 0 && stats.queued == 0);
+	assert(stats.calls == CALLERS);
+	/* The second round waited for the first one */
+	assert(stats.wait_max >= 0.9 * SLEEP_MS * 1000000);
+
+	errno = 0;
+	assert(uthread_blocking_call(failer, "/nonexistent") == -1);
+	assert(errno == ENOENT);
+	assert(uthread_blocking_call(NULL, NULL) == -1);
+	return 0;
+}
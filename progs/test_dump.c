@@ -0,0 +1,228 @@
+/*
+ * Thread dump test
+ *
+ * Named threads are left blocked on a futex, in uthread_park(), polling a
+ * pipe and joining another one, next to a thread which did not run yet. The
+ * dump written by uthread_dump() must show each of them in its state, with
+ * its own functions in its backtrace.
+ *
+ * Then SIGUSR2 triggers dumps on the standard error, captured in a file: once
+ * from the main thread, then repeatedly from a system thread while threads
+ * keep switching, so that some signals come during critical sections of the
+ * library and are deferred. Every dump must come out whole, with the addresses
+ * of the frames since symbols cannot be looked up from a signal handler.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <uthread.h>
+
+#define YIELDERS 4
+#define SIGNALS 20
+
+static unsigned int word;
+static int fds[2];
+static uthread_t parker_tid;
+static volatile int done;
+
+int futex_waiter(void *arg)
+{
+	(void)arg;
+	while (word == 0)
+		uthread_futex_wait(&word, 0, -1);
+	return 0;
+}
+
+int parker(void *arg)
+{
+	(void)arg;
+	uthread_park();
+	return 0;
+}
+
+int poller(void *arg)
+{
+	struct pollfd pfd = { .fd = fds[0], .events = POLLIN };
+
+	(void)arg;
+	assert(uthread_poll(&pfd, 1, -1) == 1);
+	return 0;
+}
+
+int joiner(void *arg)
+{
+	(void)arg;
+	assert(uthread_join(parker_tid, NULL) == 0); // not a tail call
+	return 0;
+}
+
+int idle(void *arg)
+{
+	(void)arg;
+	return 0;
+}
+
+int yielder(void *arg)
+{
+	(void)arg;
+	while (!done)
+		uthread_yield();
+	return 0;
+}
+
+static void *sender(void *arg)
+{
+	(void)arg;
+	for (int i = 0; i < SIGNALS; i++) {
+		kill(getpid(), SIGUSR2);
+		usleep(2000);
+	}
+	done = 1;
+	return NULL;
+}
+
+/* Returns the text of @file, which must be freed */
+static char *read_all(FILE *file)
+{
+	long size;
+	char *text;
+
+	fflush(file);
+	size = ftell(file);
+	text = malloc(size + 1);
+	rewind(file);
+	assert(fread(text, 1, size, file) == (size_t)size);
+	text[size] = '\0';
+	return text;
+}
+
+/* Returns the paragraph of thread @name in @text */
+static char *paragraph(char *text, const char *name)
+{
+	char header[64], *start, *end;
+
+	snprintf(header, sizeof(header), "\"%s\": ", name);
+	start = strstr(text, header);
+	assert(start != NULL);
+	end = strstr(start, "\nthread ");
+	if (end != NULL)
+		*end = '\0';
+	return start;
+}
+
+int main(void)
+{
+	uthread_t tids[5], yielders[YIELDERS];
+	char *text, *p;
+	FILE *dump;
+	pthread_t thread;
+	int err_fd, dumps = 0;
+
+	assert(pipe(fds) == 0);
+	tids[0] = uthread_create(futex_waiter, NULL);
+	tids[1] = parker_tid = uthread_create(parker, NULL);
+	tids[2] = uthread_create(poller, NULL);
+	tids[3] = uthread_create(joiner, NULL);
+	assert(uthread_set_name(tids[0], "futex_waiter") == 0);
+	assert(uthread_set_name(tids[1], "parker") == 0);
+	assert(uthread_set_name(tids[2], "poller") == 0);
+	assert(uthread_set_name(tids[3], "joiner with a long name") == 0);
+	assert(uthread_set_name(0, "main") == 0);
+	assert(uthread_set_name(tids[3] + 1, "none") == -1);
+	assert(uthread_set_name(0, NULL) == -1);
+	uthread_yield(); // they all block
+	tids[4] = uthread_create(idle, NULL);
+	assert(uthread_set_name(tids[4], "idle") == 0);
+
+	assert(uthread_dump(NULL) == -1);
+	dump = tmpfile();
+	assert(uthread_dump(dump) == 6);
+	text = read_all(dump);
+	fclose(dump);
+	printf("%s", text);
+	assert(strncmp(text, "uthread dump: 6 threads, 1 ready\n", 33) == 0);
+	/* Paragraphs are cut off the text, last ones first */
+	p = paragraph(text, "idle");
+	assert(strstr(p, "ready") != NULL);
+	p = paragraph(text, "joiner with a l");
+	assert(strstr(p, "blocked (join), joins 2") != NULL);
+	assert(strstr(p, "joiner+") != NULL);
+	p = paragraph(text, "poller");
+	assert(strstr(p, "blocked (I/O or sleep)") != NULL);
+	assert(strstr(p, "poller+") != NULL);
+	p = paragraph(text, "parker");
+	assert(strstr(p, "blocked (park or group)") != NULL);
+	assert(strstr(p, "uthread_park+") != NULL);
+	p = paragraph(text, "futex_waiter");
+	assert(strstr(p, "blocked (futex)") != NULL);
+	assert(strstr(p, "uthread_futex_wait+") != NULL);
+	assert(strstr(p, "futex_waiter+") != NULL);
+	p = paragraph(text, "main");
+	assert(strstr(p, "running") != NULL);
+	assert(strstr(p, "uthread_dump+") != NULL);
+	assert(strstr(p, "main+") != NULL);
+	free(text);
+
+	/* Dumps triggered by SIGUSR2, on the standard error captured */
+	dump = tmpfile();
+	err_fd = dup(STDERR_FILENO);
+	dup2(fileno(dump), STDERR_FILENO);
+	assert(uthread_dump_on_signal(SIGUSR2) == 0);
+	assert(uthread_dump_on_signal(SIGUSR1) == -1);
+	raise(SIGUSR2);
+	for (int i = 0; i < YIELDERS; i++)
+		yielders[i] = uthread_create(yielder, NULL);
+	assert(pthread_create(&thread, NULL, sender, NULL) == 0);
+	for (int i = 0; i < YIELDERS; i++)
+		assert(uthread_join(yielders[i], NULL) == 0);
+	pthread_join(thread, NULL);
+	assert(uthread_dump_on_signal(0) == 0);
+	assert(uthread_dump_on_signal(0) == -1);
+	dup2(err_fd, STDERR_FILENO);
+	close(err_fd);
+
+	/* Every dump holds as many paragraphs as it says */
+	fseek(dump, 0, SEEK_END);
+	text = read_all(dump);
+	fclose(dump);
+	p = text;
+	while (*p != '\0') {
+		int threads, ready;
+
+		assert(sscanf(p, "uthread dump: %d threads, %d ready",
+			      &threads, &ready) == 2);
+		dumps++;
+		p = strchr(p, '\n') + 1;
+		for (int i = 0; i < threads; i++) {
+			assert(strncmp(p, "thread ", 7) == 0);
+			p = strchr(p, '\n') + 1;
+			while (strncmp(p, "  #", 3) == 0) {
+				unsigned long pc;
+
+				assert(sscanf(p, "  #%*d 0x%lx", &pc) == 1);
+				p = strchr(p, '\n') + 1;
+			}
+		}
+	}
+	free(text);
+	printf("signal: %d dumps for %d signals\n", dumps, SIGNALS + 1);
+	assert(dumps >= 2);
+
+	/* Release the threads */
+	word = 1;
+	uthread_futex_wake(&word, 1);
+	uthread_unpark(parker_tid);
+	assert(write(fds[1], "", 1) == 1);
+	for (int i = 0; i < 5; i++) {
+		if (tids[i] != parker_tid) // joined by the joiner
+			assert(uthread_join(tids[i], NULL) == 0);
+	}
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Floating point environment test
+ *
+ * Threads select different rounding modes and yield to each other: each one
+ * must find its own mode again every time it runs, both in the x87 control
+ * word (fegetround()) and in the SSE control register (a division rounded
+ * with it). Linked against the preemptive library (test_fpenv.x) and the
+ * cooperative-only one (test_fpenv_coop.x), which switch contexts differently.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <fenv.h>
+
+#include <uthread.h>
+
+#define YIELDS 1000
+
+static const int modes[] = { FE_UPWARD, FE_DOWNWARD, FE_TOWARDZERO };
+
+#define THREADS (int)(sizeof(modes) / sizeof(modes[0]))
+
+/* Returns 1/3 in the current rounding mode */
+static double third(void)
+{
+	volatile double one = 1.0, three = 3.0;
+
+	return one / three;
+}
+
+int rounder(void* arg)
+{
+	int mode = *(const int *)arg;
+	double expected;
+
+	assert(fesetround(mode) == 0);
+	expected = third();
+	for (int i = 0; i < YIELDS; i++) {
+		uthread_yield();
+		assert(fegetround() == mode);
+		assert(third() == expected);
+	}
+	return 0;
+}
+
+int main(void)
+{
+	uthread_t tids[THREADS];
+	double nearest = third();
+
+	for (int i = 0; i < THREADS; i++)
+		tids[i] = uthread_create(rounder, (void *)&modes[i]);
+	for (int i = 0; i < THREADS; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+
+	/* The modes of the threads rounded differently, not the main one */
+	fesetround(FE_UPWARD);
+	assert(third() > nearest);
+	fesetround(FE_TONEAREST);
+	assert(fegetround() == FE_TONEAREST && third() == nearest);
+
+	printf("OK\n");
+	return 0;
+}
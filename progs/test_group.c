@@ -0,0 +1,195 @@
+/*
+ * Thread group test
+ *
+ * A group of threads is joined at once. A group of threads parked, sleeping,
+ * computing or not started yet is canceled: each of them must exit right away
+ * with UTHREAD_CANCELED. Then a well-behaved group serving requests (arriving
+ * at a fixed rate, each needing SERVICE_US of CPU) competes with a noisy group
+ * of threads that never stop computing, first without quota, then with the
+ * noisy group limited to half of the CPU. The throughput and the mean response
+ * time of the requests must improve with the quota.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+#include <uthread.h>
+
+#define MEMBERS 10
+#define NOISY 8
+#define DURATION_MS 1000
+#define INTERVAL_US 2000
+#define SERVICE_US 500
+#define QUOTA_MS 10
+#define PERIOD_MS 20
+
+struct result {
+	int served; // requests served
+	unsigned long long response; // total response time (in ns)
+};
+
+static volatile int started;
+static unsigned long unit_loops; // iterations of a loop taking 10 us
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void unit(void)
+{
+	volatile unsigned long sum = 0;
+
+	for (unsigned long i = 0; i < unit_loops; i++)
+		sum += i;
+}
+
+static void calibrate(void)
+{
+	unsigned long long start;
+
+	unit_loops = 1000000;
+	start = now_ns();
+	unit();
+	unit_loops = unit_loops * 10000ULL / (now_ns() - start);
+}
+
+int member(void* arg)
+{
+	return (int)(long)arg;
+}
+
+int parker(void* arg)
+{
+	(void)arg;
+	started++;
+	while (1)
+		uthread_park();
+	return 0;
+}
+
+int sleeper(void* arg)
+{
+	(void)arg;
+	started++;
+	uthread_sleep_ns(10000000000ULL);
+	return 0;
+}
+
+int spinner(void* arg)
+{
+	(void)arg;
+	started++;
+	while (1) {
+		unit();
+		uthread_testcancel();
+	}
+	return 0;
+}
+
+int server(void* arg)
+{
+	struct result *res = arg;
+	unsigned long long start = now_ns();
+	unsigned long long end = start + DURATION_MS * 1000000ULL;
+
+	for (int i = 0; ; i++) {
+		unsigned long long arrival = start + i * INTERVAL_US * 1000ULL;
+		unsigned long long now = now_ns();
+
+		if (arrival >= end || now >= end)
+			break; // requests left are not served in time
+		if (arrival > now)
+			uthread_sleep_ns(arrival - now);
+		for (int j = 0; j < SERVICE_US / 10; j++)
+			unit();
+		res->served++;
+		res->response += now_ns() - arrival;
+	}
+	return 0;
+}
+
+static void test_join(void)
+{
+	uthread_group_t group = uthread_group_create();
+
+	assert(group != NULL);
+	for (long i = 0; i < MEMBERS; i++)
+		assert(uthread_group_spawn(group, member, (void*)i) != -1);
+	assert(uthread_group_destroy(group) == -1);
+	assert(uthread_group_join(group) == 0);
+	assert(uthread_group_destroy(group) == 0);
+}
+
+static void test_cancel(void)
+{
+	int (*funcs[])(void*) = { parker, sleeper, spinner };
+	uthread_group_t group = uthread_group_create();
+	uthread_t tids[4];
+	unsigned long long start;
+	int retval;
+
+	for (int i = 0; i < 3; i++)
+		tids[i] = uthread_group_spawn(group, funcs[i], NULL);
+	while (started < 3)
+		uthread_yield();
+	start = now_ns();
+	assert(uthread_group_cancel(group) == 0);
+	/* Never runs */
+	tids[3] = uthread_group_spawn(group, parker, NULL);
+	for (int i = 0; i < 4; i++) {
+		assert(uthread_join(tids[i], &retval) == 0);
+		assert(retval == UTHREAD_CANCELED);
+	}
+	assert(started == 3);
+	/* No timer tick or sleep was waited for */
+	assert(now_ns() - start < 5000000);
+	assert(uthread_group_join(group) == 0);
+	assert(uthread_group_destroy(group) == 0);
+}
+
+static void compete(int quota, struct result *res)
+{
+	uthread_group_t good = uthread_group_create();
+	uthread_group_t noisy = uthread_group_create();
+
+	if (quota)
+		assert(uthread_group_set_quota(noisy, QUOTA_MS * 1000000ULL,
+					       PERIOD_MS * 1000000ULL) == 0);
+	for (int i = 0; i < NOISY; i++)
+		assert(uthread_group_spawn(noisy, spinner, NULL) != -1);
+	assert(uthread_group_spawn(good, server, res) != -1);
+	assert(uthread_group_join(good) == 0);
+	assert(uthread_group_cancel(noisy) == 0);
+	assert(uthread_group_join(noisy) == 0);
+	assert(uthread_group_destroy(good) == 0);
+	assert(uthread_group_destroy(noisy) == 0);
+
+	printf("%-8s: %4.0f requests/s, mean response %6.2f ms\n",
+	       quota ? "quota" : "no quota",
+	       res->served * 1000.0 / DURATION_MS,
+	       res->response / 1e6 / res->served);
+	fflush(stdout);
+}
+
+int main(void)
+{
+	struct result free_run = { 0, 0 }, limited = { 0, 0 };
+
+	calibrate();
+	test_join();
+	test_cancel();
+
+	compete(0, &free_run);
+	compete(1, &limited);
+	assert(limited.served > free_run.served);
+	assert(limited.response / limited.served <
+	       free_run.response / free_run.served);
+
+	return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Blocking call hooks test
+ *
+ * A client and a server written with plain blocking calls (connect, accept,
+ * send, recv, poll, usleep, nanosleep) talk over a UNIX socket from two threads
+ * of the same process, while a third thread keeps computing. Without the hooks
+ * the first blocking call would stall the whole process, and never return since
+ * its peer could not run.
+ *
+ * Then a write much bigger than a pipe holds feeds two readers of the same
+ * pipe, which keep waking up for data the other one took.
+ *
+ * A fourth thread meanwhile hands the same calls to uthread_blocking_call():
+ * made on a helper system thread, they must block it as they are.
+ *
+ * Built twice:
+ * - test_hook.x, to be run with LD_PRELOAD=../libuthread/libuthread_hook.so
+ * - test_hook_wrap.x, linked with the hooks (-Wl,--wrap=...)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <uthread.h>
+
+#define REQUESTS 5
+#define SERVICE_MS 20
+#define HELPER_CALLS 20
+#define PIPE_BYTES (1 << 20)
+
+static struct sockaddr_un addr;
+static volatile int done;
+static volatile unsigned long ticks;
+static int helper_fds[2];
+static int pipe_fds[2];
+static char pipe_data[PIPE_BYTES];
+
+/*
+ * Client and server, written without any knowledge of the library
+ */
+
+static void blocking_client(void)
+{
+	char buf[64];
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	assert(fd != -1);
+	assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+	for (int i = 0; i < REQUESTS; i++) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		int len = snprintf(buf, sizeof(buf), "request %d", i);
+
+		assert(send(fd, buf, len + 1, 0) == len + 1);
+		assert(poll(&pfd, 1, -1) == 1);
+		assert(recv(fd, buf, sizeof(buf), 0) > 0);
+		assert(strncmp(buf, "reply", 5) == 0);
+		usleep(1000);
+	}
+	close(fd);
+}
+
+static void blocking_server(int listen_fd)
+{
+	char buf[64];
+	struct timespec service = { 0, SERVICE_MS * 1000000L };
+	int fd = accept(listen_fd, NULL, NULL);
+
+	assert(fd != -1);
+	for (int i = 0; i < REQUESTS; i++) {
+		assert(read(fd, buf, sizeof(buf)) > 0);
+		nanosleep(&service, NULL); // pretend to work
+		int len = snprintf(buf, sizeof(buf), "reply %d", i);
+		assert(write(fd, buf, len + 1) == len + 1);
+	}
+	close(fd);
+}
+
+/* Run on a helper system thread, which has no threads to switch to */
+static int blocking_func(void *arg)
+{
+	struct timespec pause = { 0, 100000 };
+	char c;
+
+	(void)arg;
+	usleep(100);
+	nanosleep(&pause, NULL);
+	if (write(helper_fds[1], "x", 1) != 1)
+		return -1;
+	return read(helper_fds[0], &c, 1);
+}
+
+/*
+ * Threads
+ */
+
+int client(void* arg)
+{
+	(void)arg;
+	blocking_client();
+	return 0;
+}
+
+int server(void* arg)
+{
+	blocking_server((int)(long)arg);
+	return 0;
+}
+
+int pipe_writer(void* arg)
+{
+	(void)arg;
+	assert(write(pipe_fds[1], pipe_data, PIPE_BYTES) == PIPE_BYTES);
+	close(pipe_fds[1]);
+	return 0;
+}
+
+int pipe_reader(void* arg)
+{
+	char buf[4096];
+	ssize_t len;
+	long total = 0;
+
+	(void)arg;
+	while ((len = read(pipe_fds[0], buf, sizeof(buf))) > 0)
+		total += len;
+	assert(len == 0);
+	return total;
+}
+
+int helped(void* arg)
+{
+	(void)arg;
+	for (int i = 0; i < HELPER_CALLS; i++)
+		assert(uthread_blocking_call(blocking_func, NULL) == 1);
+	return 0;
+}
+
+int ticker(void* arg)
+{
+	(void)arg;
+	while (!done) {
+		ticks++;
+		uthread_yield();
+	}
+	return 0;
+}
+
+int main(void)
+{
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	uthread_t tids[3], tid_ticker;
+	struct timespec start, end;
+
+	alarm(10); // a blocking call that is not hooked deadlocks
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/test_hook.%d",
+		 getpid());
+	assert(listen_fd != -1);
+	assert(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+	assert(listen(listen_fd, 1) == 0);
+	assert(pipe(helper_fds) == 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	tids[0] = uthread_create(server, (void*)(long)listen_fd);
+	tids[1] = uthread_create(client, NULL);
+	tids[2] = uthread_create(helped, NULL);
+	tid_ticker = uthread_create(ticker, NULL);
+	uthread_join(tids[0], NULL);
+	uthread_join(tids[1], NULL);
+	uthread_join(tids[2], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	done = 1;
+	uthread_join(tid_ticker, NULL);
+	close(listen_fd);
+	unlink(addr.sun_path);
+
+	/* Partial writes and readers racing for the same data */
+	uthread_t pipe_tids[3];
+	int read1, read2;
+	assert(pipe(pipe_fds) == 0);
+	pipe_tids[0] = uthread_create(pipe_reader, NULL);
+	pipe_tids[1] = uthread_create(pipe_reader, NULL);
+	pipe_tids[2] = uthread_create(pipe_writer, NULL);
+	uthread_join(pipe_tids[0], &read1);
+	uthread_join(pipe_tids[1], &read2);
+	uthread_join(pipe_tids[2], NULL);
+	close(pipe_fds[0]);
+	printf("pipe: %d bytes read by one reader, %d by the other\n", read1,
+	       read2);
+	assert(read1 + read2 == PIPE_BYTES);
+
+	double elapsed = (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%d requests in %.0f ms, %lu ticks meanwhile\n", REQUESTS,
+	       elapsed * 1e3, ticks);
+	/* The computing thread ran while the others were blocked */
+	assert(elapsed >= REQUESTS * SERVICE_MS / 1e3 && ticks > 1000);
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * Scheduling latency test
+ *
+ * A thread that keeps the processor for a known time before yielding delays
+ * the other ready thread by at least that much, which must show in the
+ * histograms of both the delayed thread and all threads together. Then only
+ * the delayed thread records its latencies.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+#include <uthread.h>
+
+#define ROUNDS 100
+#define HOG_NS 1000000ULL
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int hog(void* arg)
+{
+	(void)arg;
+	for (int i = 0; i < ROUNDS; i++) {
+		unsigned long long start = now_ns();
+		while (now_ns() - start < HOG_NS)
+			; // keep the processor
+		uthread_yield();
+	}
+	return 0;
+}
+
+int victim(void* arg)
+{
+	(void)arg;
+	for (int i = 0; i < ROUNDS; i++)
+		uthread_yield();
+	return 0;
+}
+
+static void print_latency(const char *name, struct uthread_latency *l)
+{
+	printf("%-7s: %5llu switches, p50 %8llu ns, p99 %8llu ns, "
+	       "p999 %8llu ns, max %8llu ns\n", name, l->count, l->p50,
+	       l->p99, l->p999, l->max);
+}
+
+int main(void)
+{
+	struct uthread_latency global, own;
+	uthread_t tid_hog, tid_victim;
+
+	/* Nothing to report on an untracked thread */
+	assert(uthread_latency_snapshot(0, &own) == -1);
+	assert(uthread_latency_snapshot(UTHREAD_LATENCY_GLOBAL, NULL) == -1);
+
+	tid_hog = uthread_create(hog, NULL);
+	tid_victim = uthread_create(victim, NULL);
+	assert(uthread_latency_track(tid_victim) == 0);
+	assert(uthread_latency_reset(UTHREAD_LATENCY_GLOBAL) == 0);
+
+	/* Main waits in join while the two threads alternate */
+	uthread_join(tid_victim, NULL);
+	assert(uthread_latency_snapshot(tid_victim, &own) == -1); // collected
+	uthread_join(tid_hog, NULL);
+
+	assert(uthread_latency_snapshot(UTHREAD_LATENCY_GLOBAL, &global) == 0);
+	print_latency("global", &global);
+	assert(global.count >= 2 * ROUNDS);
+	assert(global.p50 <= global.p99 && global.p99 <= global.p999);
+	assert(global.p999 <= global.max && global.max >= HOG_NS);
+
+	/* Per-thread tracking alone, on a new victim looked at before it exits */
+	uthread_latency_enable(0);
+	tid_hog = uthread_create(hog, NULL);
+	tid_victim = uthread_create(victim, NULL);
+	assert(uthread_latency_track(tid_victim) == 0);
+	while (uthread_latency_snapshot(tid_victim, &own) == 0 &&
+	       own.count < ROUNDS)
+		uthread_yield();
+	print_latency("victim", &own);
+	/* Every time, the victim waited for the hog to give up the processor */
+	assert(own.count >= ROUNDS && own.p50 >= HOG_NS);
+	assert(uthread_latency_reset(tid_victim) == 0);
+	assert(uthread_latency_snapshot(tid_victim, &own) == 0 && own.count == 0);
+	uthread_join(tid_victim, NULL);
+	uthread_join(tid_hog, NULL);
+	/* Nothing more was recorded for all threads together */
+	assert(uthread_latency_snapshot(UTHREAD_LATENCY_GLOBAL, &own) == 0);
+	assert(own.count == global.count);
+
+	printf("OK\n");
+	return 0;
+}
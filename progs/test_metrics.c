@@ -0,0 +1,68 @@
+/*
+ * Metrics export test
+ *
+ * Enables the export of the metrics, then reads them back through the file
+ * like a monitoring tool would, checking that they follow the threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include <metrics.h>
+#include <uthread.h>
+
+#define THREADS 10
+
+static const struct uthread_metrics *region;
+
+int sleeper(void* arg)
+{
+	(void)arg;
+	uthread_park();
+	return 0;
+}
+
+int main(void)
+{
+	struct uthread_metrics m;
+	uthread_t tids[THREADS];
+	char path[64];
+
+	setenv("UTHREAD_METRICS", "1", 1);
+	for (int i = 0; i < THREADS; i++)
+		tids[i] = uthread_create(sleeper, NULL);
+	region = uthread_metrics_open(getpid());
+	assert(region != NULL);
+
+	/* Created, not run yet */
+	assert(uthread_metrics_read(region, &m) == 0);
+	assert(m.pid == getpid() && m.creates == THREADS);
+	assert(m.runnable == THREADS + 1 && m.blocked == 0);
+	assert(m.stack_bytes >= THREADS * 32768);
+
+	/* All of them park */
+	uthread_yield();
+	assert(uthread_metrics_read(region, &m) == 0);
+	assert(m.runnable == 1 && m.blocked == THREADS);
+	assert(m.switches >= THREADS + 1);
+
+	for (int i = 0; i < THREADS; i++) {
+		uthread_unpark(tids[i]);
+		uthread_join(tids[i], NULL);
+	}
+	assert(uthread_metrics_read(region, &m) == 0);
+	assert(m.exits == THREADS && m.zombies == 0 && m.blocked == 0);
+	assert(m.stack_bytes == 0);
+	printf("%llu switches, %llu preemptions\n",
+	       (unsigned long long)m.switches,
+	       (unsigned long long)m.preemptions);
+	uthread_metrics_close(region);
+
+	/* The file goes away with the process */
+	snprintf(path, sizeof(path), UTHREAD_METRICS_PATH, getpid());
+	assert(access(path, F_OK) == 0);
+	printf("OK\n");
+	return 0;
+}
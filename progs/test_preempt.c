@@ -40,10 +40,5 @@ int thread1(void* arg)
 
 int main(void)
 {
-  uthread_create(thread1, NULL); //this will start timer
-  while(1){
-    //do nothing
-  }
-
-  return 0;
+  return uthread_run(thread1, NULL); //this will start timer
 }
@@ -0,0 +1,87 @@
+/*
+ * Preemption stress test with heavy memory allocation
+ *
+ * Several threads that never yield allocate, fill, check and free memory in a
+ * tight loop, so that most timer ticks land inside malloc() or free(). Every
+ * switch between them is therefore a preemption. The heap must stay consistent
+ * and the threads must still be preempted regularly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <uthread.h>
+
+#define THREADS 8
+#define SLOTS 64
+#define ITERATIONS 1000000
+
+static volatile uthread_t last_runner;
+static volatile int preemptions;
+
+static unsigned int xorshift(unsigned int *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+int allocator(void* arg)
+{
+	unsigned char *slots[SLOTS] = { NULL };
+	size_t sizes[SLOTS] = { 0 };
+	unsigned int seed = 2463534242u + (unsigned int)(long)arg;
+	unsigned char pattern = (unsigned char)uthread_self();
+
+	for (int i = 0; i < ITERATIONS; i++) {
+		int slot = xorshift(&seed) % SLOTS;
+		size_t size = 1 + xorshift(&seed) % 4096;
+
+		/* Nobody else should have touched our memory */
+		for (size_t j = 0; j < sizes[slot]; j += 61)
+			assert(slots[slot][j] == pattern);
+
+		switch (i % 3) {
+		case 0:
+			free(slots[slot]);
+			slots[slot] = malloc(size);
+			break;
+		case 1:
+			slots[slot] = realloc(slots[slot], size);
+			break;
+		default:
+			free(slots[slot]);
+			slots[slot] = calloc(1, size);
+			break;
+		}
+		assert(slots[slot] != NULL);
+		memset(slots[slot], pattern, size);
+		sizes[slot] = size;
+
+		if (last_runner != uthread_self()) {
+			last_runner = uthread_self();
+			preemptions++;
+		}
+	}
+
+	for (int i = 0; i < SLOTS; i++)
+		free(slots[i]);
+	return 0;
+}
+
+int main(void)
+{
+	uthread_t tids[THREADS];
+
+	for (int i = 0; i < THREADS; i++)
+		tids[i] = uthread_create(allocator, (void*)(long)i);
+	for (int i = 0; i < THREADS; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+
+	printf("%d preemptions\n", preemptions);
+	assert(preemptions > 2 * THREADS);
+	return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * Preemption stress test with C++ allocations
+ *
+ * The C++ variant of test_preempt_malloc: threads that never yield allocate
+ * through operator new (vectors and strings) in a tight loop, so that most
+ * ticks land in libstdc++ or in malloc(). The heap must stay consistent and
+ * the threads must still be preempted regularly.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <uthread.h>
+
+#define THREADS 8
+#define SLOTS 64
+#define ITERATIONS 300000
+
+static volatile uthread_t last_runner;
+static volatile int preemptions;
+
+static unsigned int xorshift(unsigned int *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static int allocator(void *arg)
+{
+	std::vector<std::unique_ptr<std::vector<unsigned char>>> slots(SLOTS);
+	std::vector<std::string> names(SLOTS);
+	unsigned int seed = 2463534242u + (unsigned int)(long)arg;
+	unsigned char pattern = (unsigned char)uthread_self();
+
+	for (int i = 0; i < ITERATIONS; i++) {
+		int slot = xorshift(&seed) % SLOTS;
+		size_t size = 1 + xorshift(&seed) % 4096;
+
+		/* Nobody else should have touched our memory */
+		if (slots[slot] != nullptr) {
+			for (size_t j = 0; j < slots[slot]->size(); j += 61)
+				assert((*slots[slot])[j] == pattern);
+			assert(names[slot] == std::to_string(slots[slot]->size()));
+		}
+
+		switch (i % 3) {
+		case 0:
+			slots[slot] = std::make_unique<std::vector<unsigned char>>(
+				size, pattern);
+			break;
+		case 1:
+			if (slots[slot] == nullptr)
+				slots[slot] = std::make_unique<
+					std::vector<unsigned char>>();
+			slots[slot]->resize(size, pattern);
+			std::fill(slots[slot]->begin(), slots[slot]->end(),
+				  pattern);
+			break;
+		default:
+			std::string bytes(size, (char)pattern);
+			slots[slot].reset(new std::vector<unsigned char>(
+				bytes.begin(), bytes.end()));
+			break;
+		}
+		names[slot] = std::to_string(size);
+
+		if (last_runner != uthread_self()) {
+			last_runner = uthread_self();
+			preemptions = preemptions + 1;
+		}
+	}
+
+	return 0;
+}
+
+int main(void)
+{
+	uthread_t tids[THREADS];
+
+	for (int i = 0; i < THREADS; i++)
+		tids[i] = uthread_create(allocator, (void *)(long)i);
+	for (int i = 0; i < THREADS; i++)
+		assert(uthread_join(tids[i], NULL) == 0);
+
+	printf("%d preemptions\n", preemptions);
+	assert(preemptions > 2 * THREADS);
+	return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Scheduler entry test
+ *
+ * uthread_run() runs WORKERS threads sleeping in turn, next to daemons that
+ * never exit: it must return once the workers are done, without spinning
+ * meanwhile (the process uses little CPU time), and discard the daemons. A
+ * run whose threads are left blocked for good must fail. After each run, the
+ * timer must be stopped and the library usable again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <time.h>
+
+#include <uthread.h>
+
+#define WORKERS 100
+#define NAPS 10
+#define NAP_NS 10000000ULL
+
+static int done;
+static int service_rounds;
+static volatile int never;
+
+static double clock_s(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int worker(void* arg)
+{
+	(void)arg;
+	for (int i = 0; i < NAPS; i++)
+		uthread_sleep_ns(NAP_NS);
+	done++;
+	return 0;
+}
+
+/* Daemon which would run forever, and its thread, a daemon as well */
+int service(void* arg)
+{
+	if (arg == NULL && uthread_create(service, (void*)1L) == -1)
+		return -1;
+	while (1) {
+		assert(uthread_arena_alloc(100) != NULL);
+		uthread_sleep_ns(NAP_NS / 2);
+		service_rounds++;
+	}
+	return 0;
+}
+
+int parker(void* arg)
+{
+	(void)arg;
+	while (!never)
+		uthread_park();
+	return 0;
+}
+
+int app(void* arg)
+{
+	uthread_t tid;
+
+	(void)arg;
+	assert(uthread_run(app, NULL) == -1); // not from a thread
+	tid = uthread_create(parker, NULL);
+	assert(uthread_set_daemon(tid, 1) == 0);
+	assert(uthread_set_daemon(0, 1) == -1);
+	tid = uthread_create(service, NULL);
+	assert(uthread_set_daemon(tid, 1) == 0);
+	for (int i = 0; i < WORKERS; i++)
+		assert(uthread_create(worker, NULL) != -1);
+	return 0;
+}
+
+/* Returns at once, leaving a parked thread which nobody will wake up */
+int stuck(void* arg)
+{
+	(void)arg;
+	assert(uthread_create(parker, NULL) != -1);
+	uthread_yield(); // parks
+	return 0;
+}
+
+int child(void* arg)
+{
+	return (int)(long)arg;
+}
+
+static void check_restart(void)
+{
+	int ret;
+
+	uthread_t tid = uthread_create(child, (void*)7L);
+	assert(uthread_join(tid, &ret) == 0 && ret == 7);
+}
+
+int main(void)
+{
+	struct uthread_config config = { .policy = UTHREAD_SCHED_FAIR };
+	double wall, cpu;
+
+	assert(uthread_init(&config) == 0);
+	assert(uthread_init(NULL) == -1);
+	wall = clock_s(CLOCK_MONOTONIC);
+	cpu = clock_s(CLOCK_PROCESS_CPUTIME_ID);
+	assert(uthread_run(app, NULL) == 0);
+	wall = clock_s(CLOCK_MONOTONIC) - wall;
+	cpu = clock_s(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+	printf("run: %d workers in %.0f ms, %.1f ms of CPU, %d service rounds\n",
+	       done, wall * 1e3, cpu * 1e3, service_rounds);
+	assert(done == WORKERS);
+	assert(wall >= NAPS * NAP_NS / 1e9);
+	assert(cpu < wall / 2);
+
+	assert(uthread_run(NULL, NULL) == -1);
+	assert(uthread_run(stuck, NULL) == -1);
+	printf("stuck: failed\n");
+
+	/* The timer is stopped: its tick would kill the process now */
+	for (double end = clock_s(CLOCK_PROCESS_CPUTIME_ID) + 0.05;
+	     clock_s(CLOCK_PROCESS_CPUTIME_ID) < end;)
+		;
+	check_restart();
+	printf("restart: ok\n");
+
+	return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * Watchdog test
+ *
+ * A thread spins until another one, ready meanwhile, releases it:
+ * - in polling mode, without any checkpoint: the watchdog reports the ready
+ *   thread as starved, then the spinning one as a runaway, which it forces to
+ *   yield
+ * - in signal mode, with ticks masked as by a preempt_disable() left
+ *   unbalanced: the watchdog reports it, then enables preemption again
+ * - in polling mode again, in a child process whose hook aborts
+ * Events are logged on the standard error, with a backtrace.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <uthread.h>
+
+#define QUANTA 5
+#define WAIT_NS 30000000ULL
+#define MASKED_NS 50000000ULL
+
+static volatile int released;
+static int mask_ticks;
+static uthread_t spinner_tid, releaser_tid;
+static enum uthread_watchdog_action on_runaway;
+
+/* Events seen by the hook */
+static volatile int runaways, starved, masked;
+static volatile unsigned long long runaway_ns;
+
+static enum uthread_watchdog_action hook(enum uthread_watchdog_event event,
+					 uthread_t tid, unsigned long long ns)
+{
+	switch (event) {
+	case UTHREAD_WATCHDOG_RUNAWAY:
+		if (tid == spinner_tid && runaways++ == 0)
+			runaway_ns = ns;
+		return on_runaway;
+	case UTHREAD_WATCHDOG_MASKED:
+		if (tid == spinner_tid)
+			masked++;
+		return UTHREAD_WATCHDOG_YIELD;
+	case UTHREAD_WATCHDOG_STARVED:
+		if (tid == releaser_tid && ns >= WAIT_NS)
+			starved++;
+		return UTHREAD_WATCHDOG_LOG;
+	}
+	return UTHREAD_WATCHDOG_LOG;
+}
+
+int spinner(void *arg)
+{
+	(void)arg;
+	if (mask_ticks) {
+		sigset_t set;
+
+		sigemptyset(&set);
+		sigaddset(&set, SIGVTALRM);
+		sigprocmask(SIG_BLOCK, &set, NULL);
+	}
+	while (!released)
+		;
+	return 0;
+}
+
+int releaser(void *arg)
+{
+	(void)arg;
+	released = 1;
+	return 0;
+}
+
+int app(void *arg)
+{
+	(void)arg;
+	released = 0;
+	spinner_tid = uthread_create(spinner, NULL);
+	releaser_tid = uthread_create(releaser, NULL);
+	return 0;
+}
+
+static void run(enum uthread_preempt_mode mode,
+		const struct uthread_watchdog_config *watchdog)
+{
+	struct uthread_config config = { .preempt_mode = mode };
+
+	assert(uthread_watchdog_start(watchdog) == 0);
+	assert(uthread_watchdog_start(watchdog) == -1);
+	assert(uthread_init(&config) == 0);
+	assert(uthread_run(app, NULL) == 0);
+	assert(uthread_watchdog_stop() == 0);
+	assert(released);
+}
+
+int main(void)
+{
+	struct uthread_watchdog_config none = { 0 };
+	struct uthread_watchdog_config runaway = {
+		.run_quanta = QUANTA, .wait_ns = WAIT_NS, .hook = hook
+	};
+	struct uthread_watchdog_config mask = {
+		.masked_ns = MASKED_NS, .hook = hook
+	};
+	int status;
+
+	assert(uthread_watchdog_start(NULL) == -1);
+	assert(uthread_watchdog_start(&none) == -1);
+	assert(uthread_watchdog_stop() == -1);
+
+	on_runaway = UTHREAD_WATCHDOG_YIELD;
+	run(UTHREAD_PREEMPT_POLL, &runaway);
+	printf("runaway: %d report(s), after %llu ms, %d starved\n", runaways,
+	       runaway_ns / 1000000, starved);
+	assert(runaways >= 1 && runaway_ns >= QUANTA * 10000000ULL);
+	assert(starved >= 1);
+
+	mask_ticks = 1;
+	run(UTHREAD_PREEMPT_SIGNAL, &mask);
+	printf("masked: %d report(s)\n", masked);
+	assert(masked >= 1);
+
+	/* The runaway aborts the child */
+	mask_ticks = 0;
+	on_runaway = UTHREAD_WATCHDOG_ABORT;
+	fflush(stdout);
+	pid_t pid = fork();
+	assert(pid != -1);
+	if (pid == 0) {
+		run(UTHREAD_PREEMPT_POLL, &runaway);
+		_exit(0);
+	}
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+	printf("abort: ok\n");
+
+	return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * uthreadtop - Monitor the schedulers of running processes
+ *
+ * Usage: uthreadtop.x [-d seconds] [-n iterations] [pid...]
+ *
+ * Shows the threads and the rates of the processes exporting their metrics
+ * (started with UTHREAD_METRICS=1), or only of the given PIDs, refreshed every
+ * -d seconds (1 by default) -n times (forever by default). The metrics are only
+ * read, the monitored processes are never interrupted.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <metrics.h>
+
+#define MAX_PROCS 64
+
+struct proc {
+	int pid;
+	const struct uthread_metrics *region;
+	struct uthread_metrics last; // sample of the previous refresh
+	int sampled; // 1 once last holds a sample
+};
+
+static struct proc procs[MAX_PROCS];
+static int nb_procs;
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_proc(int pid)
+{
+	for (int i = 0; i < nb_procs; i++)
+		if (procs[i].pid == pid)
+			return; // already monitored
+	if (nb_procs == MAX_PROCS)
+		return;
+	const struct uthread_metrics *region = uthread_metrics_open(pid);
+	if (region == NULL)
+		return;
+	procs[nb_procs].pid = pid;
+	procs[nb_procs].region = region;
+	// rates of the first refresh are counted from now
+	procs[nb_procs].sampled =
+		(uthread_metrics_read(region, &procs[nb_procs].last) == 0);
+	nb_procs++;
+}
+
+/* Finds the processes exporting their metrics */
+static void scan_procs(void)
+{
+	DIR *dir = opendir("/dev/shm");
+	struct dirent *entry;
+	int pid;
+
+	if (dir == NULL)
+		return;
+	while ((entry = readdir(dir)) != NULL)
+		if (sscanf(entry->d_name, "uthread-%d", &pid) == 1 &&
+		    (kill(pid, 0) == 0 || errno != ESRCH))
+			add_proc(pid);
+	closedir(dir);
+}
+
+static void drop_proc(int i)
+{
+	uthread_metrics_close(procs[i].region);
+	procs[i] = procs[--nb_procs];
+}
+
+static void refresh(double elapsed, int clear)
+{
+	struct uthread_metrics m;
+
+	if (clear)
+		printf("\033[H\033[J");
+	printf("%7s %6s %6s %6s %10s %10s %9s %9s %9s\n", "PID", "RUN", "BLK",
+	       "ZOMB", "SWITCH/s", "PREEMPT/s", "CREATE/s", "EXIT/s",
+	       "STACK KB");
+	for (int i = 0; i < nb_procs; i++) {
+		struct proc *p = &procs[i];
+		if (kill(p->pid, 0) == -1 && errno == ESRCH) {
+			drop_proc(i--); // exited without removing its file
+			continue;
+		}
+		if (uthread_metrics_read(p->region, &m) == -1)
+			continue;
+		if (!p->sampled) {
+			p->last = m;
+			p->sampled = 1;
+		}
+		printf("%7d %6llu %6llu %6llu %10.0f %10.0f %9.0f %9.0f %9llu\n",
+		       p->pid, (unsigned long long)m.runnable,
+		       (unsigned long long)m.blocked,
+		       (unsigned long long)m.zombies,
+		       (m.switches - p->last.switches) / elapsed,
+		       (m.preemptions - p->last.preemptions) / elapsed,
+		       (m.creates - p->last.creates) / elapsed,
+		       (m.exits - p->last.exits) / elapsed,
+		       (unsigned long long)m.stack_bytes / 1024);
+		p->last = m;
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	double delay = 1, last;
+	long iterations = -1;
+	int opt, given_pids;
+
+	while ((opt = getopt(argc, argv, "d:n:")) != -1) {
+		switch (opt) {
+		case 'd':
+			delay = atof(optarg);
+			break;
+		case 'n':
+			iterations = atol(optarg);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-d seconds] [-n iterations] "
+				"[pid...]\n", argv[0]);
+			return 1;
+		}
+	}
+	given_pids = (optind < argc);
+	for (int i = optind; i < argc; i++)
+		add_proc(atoi(argv[i]));
+
+	last = now_s();
+	if (!given_pids)
+		scan_procs();
+	for (long i = 0; iterations < 0 || i < iterations; i++) {
+		struct timespec ts = { (time_t)delay,
+				       (long)((delay - (time_t)delay) * 1e9) };
+		nanosleep(&ts, NULL);
+		if (!given_pids)
+			scan_procs(); // pick up new processes
+		double now = now_s();
+		refresh(now - last, isatty(STDOUT_FILENO));
+		last = now;
+	}
+
+	return 0;
+}